@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <cinttypes>
 #include <fstream>
@@ -20,9 +21,11 @@
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -31,18 +34,27 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
 #include "absl/memory/memory.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/substitute.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/text_format.h"
 #include "re2/re2.h"
@@ -70,9 +82,12 @@ static void Throw(const char *str, int line) {
 namespace bloaty {
 
 // Use a global since we would have to plumb it through so many call-stacks
-// otherwise.  We would make this thread_local but that's not supported on OS X
-// right now.
-int verbose_level = 0;
+// otherwise.  This and the other per-run globals are thread_local, so runs on
+// different threads (see Server) don't interfere.
+thread_local int verbose_level = 0;
+
+// Options::max_memory, or 0 for no limit.
+thread_local uint64_t max_memory = 0;
 
 struct DataSourceDefinition {
   DataSource number;
@@ -92,6 +107,8 @@ constexpr DataSourceDefinition data_sources[] = {
      "the filename specified on the Bloaty command-line"},
     {DataSource::kInlines, "inlines",
      "source line/file where inlined code came from.  requires debug info."},
+    {DataSource::kPages, "pages",
+     "the VM and file pages (see --page-size) that the binary occupies"},
     {DataSource::kSections, "sections", "object file section"},
     {DataSource::kSegments, "segments", "load commands in the binary"},
     {DataSource::kSymbols, "symbols", "symbols from symbol table"},
@@ -101,7 +118,9 @@ constexpr DataSourceDefinition data_sources[] = {
 
 const char* GetDataSourceLabel(DataSource source) {
   for (size_t i = 0; i < ARRAY_SIZE(data_sources); i++) {
-    if (data_sources[i].number == source) {
+    // Skip "inputfiles", which borrows kInlines.
+    if (data_sources[i].number == source &&
+        strcmp(data_sources[i].name, "inputfiles") != 0) {
       return data_sources[i].name;
     }
   }
@@ -138,30 +157,21 @@ void CheckedAdd(A* accum, B val) {
 #endif
 }
 
-std::string CSVEscape(string_view str) {
-  bool need_escape = false;
-
-  for (char ch : str) {
-    if (ch == '"' || ch == ',') {
-      need_escape = true;
-      break;
-    }
+// Appends "str" to "out" as a CSV field, quoting it if necessary.
+void AppendCSVEscaped(string_view str, std::string* out) {
+  if (str.find_first_of("\",") == string_view::npos) {
+    out->append(str.data(), str.size());
+    return;
   }
 
-  if (need_escape) {
-    std::string ret = "\"";
-    for (char ch : str) {
-      if (ch == '"') {
-        ret += "\"\"";
-      } else {
-        ret += ch;
-      }
+  out->push_back('"');
+  for (char ch : str) {
+    if (ch == '"') {
+      out->push_back('"');
     }
-    ret += "\"";
-    return ret;
-  } else {
-    return std::string(str);
+    out->push_back(ch);
   }
+  out->push_back('"');
 }
 
 template <class Func>
@@ -170,7 +180,9 @@ class RankComparator {
   RankComparator(Func func) : func_(func) {}
 
   template <class T>
-  bool operator()(const T& a, const T& b) { return func_(a) < func_(b); }
+  bool operator()(const T& a, const T& b) const {
+    return func_(a) < func_(b);
+  }
 
  private:
   Func func_;
@@ -243,7 +255,19 @@ LineReader ReadLinesFromPipe(const std::string& cmd) {
 
 // Demangler ///////////////////////////////////////////////////////////////////
 
-Demangler::Demangler() {
+// Past this many names the cache is cleared, so a long-lived Demangler doesn't
+// grow without bound.
+static const size_t kMaxDemangleCacheSize = 1 << 20;
+
+Demangler::Demangler() : write_file_(nullptr), child_pid_(0) {}
+
+// Keeps "fd" out of the subprocesses we start (like c++filt), which would
+// otherwise hold our pipes and sockets open after we close them.
+static void SetCloseOnExec(int fd) {
+  CHECK_SYSCALL(fcntl(fd, F_SETFD, FD_CLOEXEC));
+}
+
+void Demangler::Start() {
   int toproc_pipe_fd[2];
   int fromproc_pipe_fd[2];
   if (pipe(toproc_pipe_fd) < 0 || pipe(fromproc_pipe_fd) < 0) {
@@ -251,6 +275,13 @@ Demangler::Demangler() {
     exit(1);
   }
 
+  // The child's copies are dup2()'d to stdin and stdout, which clears the
+  // flag for those.
+  for (int fd : {toproc_pipe_fd[0], toproc_pipe_fd[1], fromproc_pipe_fd[0],
+                 fromproc_pipe_fd[1]}) {
+    SetCloseOnExec(fd);
+  }
+
   pid_t pid = fork();
   if (pid < 0) {
     perror("fork");
@@ -290,6 +321,10 @@ Demangler::Demangler() {
 }
 
 Demangler::~Demangler() {
+  if (!write_file_) {
+    return;
+  }
+
   int status;
   kill(child_pid_, SIGTERM);
   waitpid(child_pid_, &status, WEXITED);
@@ -297,6 +332,16 @@ Demangler::~Demangler() {
 }
 
 std::string Demangler::Demangle(const std::string& symbol) {
+  auto it = cache_.find(symbol);
+  if (it != cache_.end()) {
+    return it->second;
+  }
+
+  if (!write_file_) {
+    Start();
+  }
+
+  stats.demangle_calls++;
   const char *writeptr = symbol.c_str();
   const char *writeend = writeptr + symbol.size();
 
@@ -318,37 +363,323 @@ std::string Demangler::Demangle(const std::string& symbol) {
   }
 
   reader_->Next();
-  return reader_->line();
+  if (cache_.size() >= kMaxDemangleCacheSize) {
+    cache_.clear();
+  }
+  return cache_[symbol] = reader_->line();
 }
 
 
-// NameMunger //////////////////////////////////////////////////////////////////
+// Tracing /////////////////////////////////////////////////////////////////////
 
-// Use to transform input names according to the user's configuration.
-// For example, the user can use regexes.
-class NameMunger {
- public:
-  NameMunger() {}
+#ifdef BLOATY_ENABLE_TRACING
+
+bool trace_enabled = false;
+
+struct TraceEvent {
+  std::string name;
+  std::string file;
+  double start_us;
+  double duration_us;
+  int tid;
+};
 
-  // Adds a regex that will be applied to all names.  All regexes will be
-  // applied in sequence.
-  void AddRegex(const std::string& regex, const std::string& replacement);
+// Spans may end on any thread, so these are guarded by trace_mutex.
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+static std::map<std::thread::id, int> trace_thread_ids;
+static std::chrono::steady_clock::time_point trace_start;
+
+void TraceSpan::Begin(string_view name, string_view file) {
+  active_ = true;
+  name_ = std::string(name);
+  file_ = std::string(file);
+  start_ = std::chrono::steady_clock::now();
+}
 
-  std::string Munge(string_view name) const;
+void TraceSpan::End() {
+  typedef std::chrono::duration<double, std::micro> Micros;
+  auto end = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  // Small thread IDs read better in the viewer than std::thread::id hashes.
+  int next_tid = trace_thread_ids.size() + 1;
+  int tid =
+      trace_thread_ids.emplace(std::this_thread::get_id(), next_tid).first->second;
+  trace_events.push_back(TraceEvent{std::move(name_), std::move(file_),
+                                    Micros(start_ - trace_start).count(),
+                                    Micros(end - start_).count(), tid});
+}
 
-  bool IsEmpty() const { return regexes_.empty(); }
+void StartTrace() {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_events.clear();
+  trace_thread_ids.clear();
+  trace_start = std::chrono::steady_clock::now();
+  trace_enabled = true;
+}
 
- private:
-  BLOATY_DISALLOW_COPY_AND_ASSIGN(NameMunger);
-  std::vector<std::pair<std::unique_ptr<RE2>, std::string>> regexes_;
+static void AppendJSONString(string_view str, std::string* out) {
+  out->push_back('"');
+  for (char ch : str) {
+    if (ch == '"' || ch == '\\') {
+      out->push_back('\\');
+      out->push_back(ch);
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      out->append(buf);
+    } else {
+      out->push_back(ch);
+    }
+  }
+  out->push_back('"');
+}
+
+bool WriteTrace(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  trace_enabled = false;
+
+  // "X" (complete) events, which carry their own duration.
+  std::string json = "{\"traceEvents\":[";
+  char buf[128];
+  for (size_t i = 0; i < trace_events.size(); i++) {
+    const TraceEvent& event = trace_events[i];
+    json += (i == 0) ? "\n{\"name\":" : ",\n{\"name\":";
+    AppendJSONString(event.name, &json);
+    snprintf(buf, sizeof(buf),
+             ",\"cat\":\"bloaty\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+             "\"pid\":%d,\"tid\":%d,\"args\":{\"file\":",
+             event.start_us, event.duration_us, static_cast<int>(getpid()),
+             event.tid);
+    json += buf;
+    AppendJSONString(event.file, &json);
+    json += "}}";
+  }
+  json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+  std::ofstream out(filename, std::ios::out | std::ios::binary);
+  out.write(json.data(), json.size());
+  return static_cast<bool>(out);
+}
+
+#else
+
+void StartTrace() {}
+
+bool WriteTrace(const std::string& /* filename */) { return false; }
+
+#endif  // BLOATY_ENABLE_TRACING
+
+
+// Stats ///////////////////////////////////////////////////////////////////////
+
+thread_local Stats stats;
+
+struct StatsTiming {
+  std::string file;
+  std::string phase;
+  double wall_ms;
+  double cpu_ms;
+};
+
+// In the order each (file, phase) first finished, indexed by (file, phase).
+static thread_local std::vector<StatsTiming> stats_timings;
+static thread_local std::map<std::pair<std::string, std::string>, size_t>
+    stats_timing_index;
+
+StatsTimer::StatsTimer(string_view file, string_view phase)
+    : file_(file),
+      phase_(phase),
+      wall_start_(std::chrono::steady_clock::now()),
+#ifdef BLOATY_ENABLE_TRACING
+      cpu_start_(std::clock()),
+      span_(phase, file) {}
+#else
+      cpu_start_(std::clock()) {}
+#endif
+
+StatsTimer::~StatsTimer() {
+  double wall_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - wall_start_)
+                       .count();
+  double cpu_ms = (std::clock() - cpu_start_) * 1000.0 / CLOCKS_PER_SEC;
+
+  auto key = std::make_pair(file_, phase_);
+  auto it = stats_timing_index.find(key);
+  if (it == stats_timing_index.end()) {
+    it = stats_timing_index.emplace(key, stats_timings.size()).first;
+    stats_timings.push_back(StatsTiming{file_, phase_, 0, 0});
+  }
+  StatsTiming& timing = stats_timings[it->second];
+  timing.wall_ms += wall_ms;
+  timing.cpu_ms += cpu_ms;
+}
+
+void CountMemory(MemoryUse use, int64_t bytes) {
+  int i = static_cast<int>(use);
+  stats.memory_in_use[i] += bytes;
+  stats.memory_peak[i] =
+      std::max(stats.memory_peak[i], stats.memory_in_use[i]);
+  stats.total_memory_in_use += bytes;
+}
+
+size_t StringHeapBytes(const std::string& str) {
+  // Short strings keep their characters inside the std::string itself.
+  const char* data = str.data();
+  const char* self = reinterpret_cast<const char*>(&str);
+  if (data >= self && data < self + sizeof(str)) {
+    return 0;
+  }
+  return str.capacity() + 1;
+}
+
+static const char* const memory_use_names[kNumMemoryUses] = {
+  "range_maps", "labels", "rollups", "symbol_tables", "dwarf",
 };
 
+void ResetStats() {
+  stats = Stats();
+  stats_timings.clear();
+  stats_timing_index.clear();
+}
+
+static uint64_t GetPeakRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss;  // Bytes on OS X.
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // KiB on Linux.
+#endif
+}
+
+std::string FixedWidthString(const std::string& input, size_t size) {
+  if (input.size() < size) {
+    std::string ret = input;
+    while (ret.size() < size) {
+      ret += " ";
+    }
+    return ret;
+  } else {
+    return input.substr(0, size);
+  }
+}
+
+static void PrintStatsTiming(const std::string& label, double wall_ms,
+                             double cpu_ms, std::ostream* out) {
+  char buf[32];
+  *out << FixedWidthString(label, 40);
+  snprintf(buf, sizeof(buf), "%12.3f%12.3f\n", wall_ms, cpu_ms);
+  *out << buf;
+}
+
+void PrintStats(StatsFormat format, std::ostream* out) {
+  const std::pair<const char*, uint64_t> counters[] = {
+    {"ranges_added", stats.ranges_added},
+    {"overlaps_trimmed", stats.overlaps_trimmed},
+    {"map_iterations", stats.map_iterations},
+    {"dies_decoded", stats.dies_decoded},
+    {"leb128_reads", stats.leb128_reads},
+    {"abbrev_tables_built", stats.abbrev_tables_built},
+    {"demangle_calls", stats.demangle_calls},
+    {"munge_calls", stats.munge_calls},
+    {"peak_rss_bytes", GetPeakRSS()},
+  };
+
+  if (format == StatsFormat::kCSV) {
+    std::string line;
+    char buf[32];
+    *out << "kind,file,name,value\n";
+    for (const auto& timing : stats_timings) {
+      for (int cpu = 0; cpu < 2; cpu++) {
+        line = cpu ? "cpu_ms," : "wall_ms,";
+        AppendCSVEscaped(timing.file, &line);
+        line += ',';
+        AppendCSVEscaped(timing.phase, &line);
+        snprintf(buf, sizeof(buf), ",%.3f\n",
+                 cpu ? timing.cpu_ms : timing.wall_ms);
+        line += buf;
+        *out << line;
+      }
+    }
+    for (const auto& counter : counters) {
+      *out << "counter,," << counter.first << "," << counter.second << "\n";
+    }
+    for (int i = 0; i < kNumMemoryUses; i++) {
+      *out << "peak_bytes,," << memory_use_names[i] << ","
+           << stats.memory_peak[i] << "\n";
+    }
+    return;
+  }
+
+  // Per-file phases first, then the same phases summed over all files (which
+  // is the per-data-source view), then the phases that aren't per-file.
+  std::vector<std::string> phases;
+  std::map<std::string, std::pair<double, double>> phase_totals;
+  std::set<std::string> files;
+  const std::string* last_file = nullptr;
+
+  *out << FixedWidthString("Phase", 40) << "     Wall ms      CPU ms\n";
+  for (const auto& timing : stats_timings) {
+    if (timing.file.empty()) continue;
+    if (!last_file || *last_file != timing.file) {
+      *out << timing.file << "\n";
+      last_file = &timing.file;
+    }
+    PrintStatsTiming("  " + timing.phase, timing.wall_ms, timing.cpu_ms, out);
+    files.insert(timing.file);
+    if (phase_totals.find(timing.phase) == phase_totals.end()) {
+      phases.push_back(timing.phase);
+    }
+    auto& total = phase_totals[timing.phase];
+    total.first += timing.wall_ms;
+    total.second += timing.cpu_ms;
+  }
+
+  if (files.size() > 1) {
+    *out << "[All Files]\n";
+    for (const auto& phase : phases) {
+      const auto& total = phase_totals[phase];
+      PrintStatsTiming("  " + phase, total.first, total.second, out);
+    }
+  }
+
+  for (const auto& timing : stats_timings) {
+    if (!timing.file.empty()) continue;
+    PrintStatsTiming(timing.phase, timing.wall_ms, timing.cpu_ms, out);
+  }
+
+  *out << "\n" << FixedWidthString("Counter", 40) << "       Value\n";
+  for (const auto& counter : counters) {
+    std::string label = counter.first;
+    std::replace(label.begin(), label.end(), '_', ' ');
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%12" PRIu64 "\n", counter.second);
+    *out << FixedWidthString(label, 40) << buf;
+  }
+
+  *out << "\n" << FixedWidthString("Memory", 40) << "  Peak bytes\n";
+  for (int i = 0; i < kNumMemoryUses; i++) {
+    std::string label = memory_use_names[i];
+    std::replace(label.begin(), label.end(), '_', ' ');
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%12" PRId64 "\n", stats.memory_peak[i]);
+    *out << FixedWidthString(label, 40) << buf;
+  }
+}
+
+
+// NameMunger //////////////////////////////////////////////////////////////////
+
 void NameMunger::AddRegex(const std::string& regex, const std::string& replacement) {
   auto re2 = absl::make_unique<RE2>(regex);
   regexes_.push_back(std::make_pair(std::move(re2), replacement));
 }
 
 std::string NameMunger::Munge(string_view name) const {
+  stats.munge_calls++;
   re2::StringPiece piece(name.data(), name.size());
   std::string ret;
 
@@ -393,257 +724,472 @@ std::string NameMunger::Munge(string_view name) const {
 
 std::string others_label = "[Other]";
 
-class Rollup {
- public:
-  Rollup() {}
-
-  void AddSizes(const std::vector<std::string> names,
-                uint64_t size, bool is_vmsize) {
-    // We start at 1 to exclude the base map (see base_map_).
-    AddInternal(names, 1, size, is_vmsize);
+void Rollup::AddTotals(int64_t vmsize, int64_t filesize, bool is_base) {
+  if (is_base) {
+    CheckedAdd(&base_vm_total_, vmsize);
+    CheckedAdd(&base_file_total_, filesize);
+    CheckedAdd(&vm_total_, -vmsize);
+    CheckedAdd(&file_total_, -filesize);
+  } else {
+    CheckedAdd(&vm_total_, vmsize);
+    CheckedAdd(&file_total_, filesize);
   }
+}
 
-  // Prints a graphical representation of the rollup.
-  void CreateRollupOutput(const Options& options, RollupOutput* row) const {
-    CreateDiffModeRollupOutput(nullptr, options, row);
+void Rollup::AddInternal(const std::vector<std::string>& names, size_t i,
+                         uint64_t size, bool is_vmsize, bool is_base) {
+  int64_t signed_size = size;
+  if (signed_size < 0) {
+    THROW("integer overflow");
   }
-
-  void CreateDiffModeRollupOutput(Rollup* base, const Options& options,
-                                  RollupOutput* output) const {
-    RollupRow* row = &output->toplevel_row_;
-    row->vmsize = vm_total_;
-    row->filesize = file_total_;
-    row->vmpercent = 100;
-    row->filepercent = 100;
-    CreateRows(row, base, options, true);
+  AddTotals(is_vmsize ? signed_size : 0, is_vmsize ? 0 : signed_size, is_base);
+  if (i < names.size()) {
+    GetOrAddChild(names[i])->AddInternal(names, i + 1, size, is_vmsize,
+                                         is_base);
   }
+}
 
-  // Subtract the values in "other" from this.
-  void Subtract(const Rollup& other) {
-    vm_total_ -= other.vm_total_;
-    file_total_ -= other.file_total_;
-
-    for (const auto& other_child : other.children_) {
-      auto& child = children_[other_child.first];
-      if (child.get() == NULL) {
-        child.reset(new Rollup());
-      }
-      child->Subtract(*other_child.second);
-    }
+void Rollup::AddSamplesInternal(const std::vector<std::string>& names,
+                                size_t i, uint64_t samples,
+                                uint64_t hot_bytes) {
+  CheckedAdd(&samples_, static_cast<int64_t>(samples));
+  CheckedAdd(&hot_bytes_, static_cast<int64_t>(hot_bytes));
+  if (i < names.size()) {
+    GetOrAddChild(names[i])->AddSamplesInternal(names, i + 1, samples,
+                                                hot_bytes);
   }
+}
 
- private:
-  BLOATY_DISALLOW_COPY_AND_ASSIGN(Rollup);
-
-  int64_t vm_total_ = 0;
-  int64_t file_total_ = 0;
+void Rollup::AddResidentInternal(const std::vector<std::string>& names,
+                                 size_t i, uint64_t resident) {
+  CheckedAdd(&resident_, static_cast<int64_t>(resident));
+  if (i < names.size()) {
+    GetOrAddChild(names[i])->AddResidentInternal(names, i + 1, resident);
+  }
+}
 
-  // Putting Rollup by value seems to work on some compilers/libs but not
-  // others.
-  typedef std::unordered_map<std::string, std::unique_ptr<Rollup>> ChildMap;
-  ChildMap children_;
-  static Rollup* empty_;
+Rollup* Rollup::GetOrAddChild(const std::string& name) {
+  auto& child = children_[name];
+  if (child.get() == nullptr) {
+    child.reset(new Rollup());
+    CountMemory(MemoryUse::kRollups, StringHeapBytes(name));
+  }
+  return child.get();
+}
 
-  static Rollup* GetEmpty() {
-    if (!empty_) {
-      empty_ = new Rollup();
-    }
-    return empty_;
+Rollup::~Rollup() {
+  CountMemory(MemoryUse::kRollups, -static_cast<int64_t>(sizeof(Rollup)));
+  for (const auto& child : children_) {
+    CountMemory(MemoryUse::kRollups,
+                -static_cast<int64_t>(StringHeapBytes(child.first)));
   }
+}
 
-  // Adds "size" bytes to the rollup under the label names[i].
-  // If there are more entries names[i+1, i+2, etc] add them to sub-rollups.
-  void AddInternal(const std::vector<std::string> names, size_t i,
-                   uint64_t size, bool is_vmsize) {
-    if (is_vmsize) {
-      CheckedAdd(&vm_total_, size);
+static const std::string pruned_label = "[Pruned]";
+
+void Rollup::Prune(int64_t threshold) {
+  Rollup pruned;
+
+  for (auto it = children_.begin(); it != children_.end();) {
+    const Rollup* child = it->second.get();
+    if (it->first != pruned_label &&
+        std::abs(child->vm_total_) < threshold &&
+        std::abs(child->file_total_) < threshold &&
+        std::abs(child->base_vm_total_) < threshold &&
+        std::abs(child->base_file_total_) < threshold) {
+      CheckedAdd(&pruned.vm_total_, child->vm_total_);
+      CheckedAdd(&pruned.file_total_, child->file_total_);
+      CheckedAdd(&pruned.base_vm_total_, child->base_vm_total_);
+      CheckedAdd(&pruned.base_file_total_, child->base_file_total_);
+      CheckedAdd(&pruned.samples_, child->samples_);
+      CheckedAdd(&pruned.hot_bytes_, child->hot_bytes_);
+      CheckedAdd(&pruned.resident_, child->resident_);
+      CountMemory(MemoryUse::kRollups,
+                  -static_cast<int64_t>(StringHeapBytes(it->first)));
+      it = children_.erase(it);
     } else {
-      CheckedAdd(&file_total_, size);
-    }
-    if (i < names.size()) {
-      auto& child = children_[names[i]];
-      if (child.get() == nullptr) {
-        child.reset(new Rollup());
-      }
-      child->AddInternal(names, i + 1, size, is_vmsize);
+      it->second->Prune(threshold);
+      ++it;
     }
   }
 
-  static double Percent(ssize_t part, size_t whole) {
-    return static_cast<double>(part) / static_cast<double>(whole) * 100;
+  if (pruned.vm_total_ != 0 || pruned.file_total_ != 0 ||
+      pruned.base_vm_total_ != 0 || pruned.base_file_total_ != 0) {
+    Rollup* child = GetOrAddChild(pruned_label);
+    CheckedAdd(&child->vm_total_, pruned.vm_total_);
+    CheckedAdd(&child->file_total_, pruned.file_total_);
+    CheckedAdd(&child->base_vm_total_, pruned.base_vm_total_);
+    CheckedAdd(&child->base_file_total_, pruned.base_file_total_);
+    CheckedAdd(&child->samples_, pruned.samples_);
+    CheckedAdd(&child->hot_bytes_, pruned.hot_bytes_);
+    CheckedAdd(&child->resident_, pruned.resident_);
   }
+}
 
-  void CreateRows(RollupRow* row, const Rollup* base, const Options& options,
-                  bool is_toplevel) const;
-  void ComputeRows(RollupRow* row, std::vector<RollupRow>* children,
-                   const Rollup* base, const Options& options,
-                   bool is_toplevel) const;
-};
+void Rollup::CreateOutput(bool diff_mode, const Options& options,
+                          RollupOutput* output) const {
+  RollupRow* row = &output->toplevel_row_;
+  row->vmsize = vm_total_;
+  row->filesize = file_total_;
+  row->samples = samples_;
+  row->hot_bytes = hot_bytes_;
+  row->resident = resident_;
+  row->vmpercent = 100;
+  row->filepercent = 100;
+  CreateRows(row, diff_mode, options, true);
+}
 
-void Rollup::CreateRows(RollupRow* row, const Rollup* base,
-                        const Options& options, bool is_toplevel) const {
-  if (base) {
-    row->vmpercent = Percent(vm_total_, base->vm_total_);
-    row->filepercent = Percent(file_total_, base->file_total_);
+void Rollup::CreateRows(RollupRow* row, bool diff_mode, const Options& options,
+                        bool is_toplevel) const {
+  if (diff_mode) {
+    row->vmpercent = Percent(vm_total_, base_vm_total_);
+    row->filepercent = Percent(file_total_, base_file_total_);
     row->diff_mode = true;
   }
 
+  std::vector<ChildRef> sorted_children;
+  std::vector<ChildRef> shrinking;
+  std::vector<ChildRef> mixed;
+
   for (const auto& value : children_) {
-    std::vector<RollupRow>* row_to_append = &row->sorted_children;
+    std::vector<ChildRef>* ref_to_append = &sorted_children;
     int vm_sign = SignOf(value.second->vm_total_);
     int file_sign = SignOf(value.second->file_total_);
     if (vm_sign < 0 || file_sign < 0) {
-      assert(base);
+      assert(diff_mode);
     }
 
     if (vm_sign + file_sign < 0) {
-      row_to_append = &row->shrinking;
+      ref_to_append = &shrinking;
     } else if (vm_sign != file_sign && vm_sign + file_sign == 0) {
-      row_to_append = &row->mixed;
+      ref_to_append = &mixed;
     }
 
     if (value.second->vm_total_ != 0 || value.second->file_total_ != 0) {
-      row_to_append->push_back(RollupRow(value.first));
-      row_to_append->back().vmsize = value.second->vm_total_;
-      row_to_append->back().filesize = value.second->file_total_;
+      ref_to_append->push_back(ChildRef{&value.first, value.second.get()});
     }
   }
 
-  ComputeRows(row, &row->sorted_children, base, options, is_toplevel);
-  ComputeRows(row, &row->shrinking, base, options, is_toplevel);
-  ComputeRows(row, &row->mixed, base, options, is_toplevel);
+  ComputeRows(row, &sorted_children, &row->sorted_children, diff_mode,
+              options, is_toplevel);
+  ComputeRows(row, &shrinking, &row->shrinking, diff_mode, options,
+              is_toplevel);
+  ComputeRows(row, &mixed, &row->mixed, diff_mode, options, is_toplevel);
 }
 
-Rollup* Rollup::empty_;
+int64_t Rollup::RankValue(const Options& options, const Rollup& rollup) {
+  switch (options.sort_by()) {
+    case Options::SORTBY_VMSIZE:
+      return std::abs(rollup.vm_total_);
+    case Options::SORTBY_FILESIZE:
+      return std::abs(rollup.file_total_);
+    case Options::SORTBY_BOTH:
+      return std::max(std::abs(rollup.vm_total_),
+                      std::abs(rollup.file_total_));
+    case Options::SORTBY_SAMPLES:
+      return rollup.samples_;
+    case Options::SORTBY_RESIDENT:
+      return rollup.resident_;
+    default:
+      assert(false);
+      return -1;
+  }
+}
 
-void Rollup::ComputeRows(RollupRow* row, std::vector<RollupRow>* children,
-                         const Rollup* base, const Options& options,
-                         bool is_toplevel) const {
-  std::vector<RollupRow>& child_rows = *children;
+void Rollup::ComputeRows(RollupRow* row, std::vector<ChildRef>* refs,
+                         std::vector<RollupRow>* children, bool diff_mode,
+                         const Options& options, bool is_toplevel) const {
+  std::vector<ChildRef>& child_refs = *refs;
 
   // We don't want to output a solitary "[None]" or "[Unmapped]" row except at
   // the top level.
-  if (!is_toplevel && child_rows.size() == 1 &&
-      (child_rows[0].name == "[None]" || child_rows[0].name == "[Unmapped]")) {
-    child_rows.clear();
+  if (!is_toplevel && child_refs.size() == 1 &&
+      (*child_refs[0].name == "[None]" ||
+       *child_refs[0].name == "[Unmapped]")) {
+    child_refs.clear();
   }
 
   // We don't want to output a single row that has exactly the same size and
   // label as the parent.
-  if (child_rows.size() == 1 && child_rows[0].name == row->name) {
-    child_rows.clear();
+  if (child_refs.size() == 1 && *child_refs[0].name == row->name) {
+    child_refs.clear();
   }
 
-  if (child_rows.empty()) {
+  if (child_refs.empty()) {
     return;
   }
 
   // Our overall sorting rank.
-  auto rank = [options](const RollupRow& row) {
-    int64_t val_to_rank;
-    switch (options.sort_by()) {
-      case Options::SORTBY_VMSIZE:
-        val_to_rank = std::abs(row.vmsize);
-        break;
-      case Options::SORTBY_FILESIZE:
-        val_to_rank = std::abs(row.filesize);
-        break;
-      case Options::SORTBY_BOTH:
-        val_to_rank = std::max(std::abs(row.vmsize), std::abs(row.filesize));
-        break;
-      default:
-        assert(false);
-        val_to_rank = -1;
-        break;
-    }
+  auto rank = [options](const ChildRef& ref) {
+    int64_t val_to_rank = RankValue(options, *ref.rollup);
 
     // Reverse so that numerically we always sort high-to-low.
     int64_t numeric_rank = INT64_MAX - val_to_rank;
 
-    // Use name to break ties in numeric rank (names sort low-to-high).
-    return std::make_tuple(numeric_rank, row.name);
+    // Use name to break ties in numeric rank (names sort low-to-high).  The
+    // name is borrowed rather than copied, since this runs on every
+    // comparison.
+    return std::tuple<int64_t, const std::string&>(numeric_rank, *ref.name);
   };
 
   // Our sorting rank for the first pass, when we are deciding what to put in
   // [Other].  Certain things we don't want to put in [Other], so we rank them
   // highest.
   auto collapse_rank =
-      [rank](const RollupRow& row) {
-        bool top_name = (row.name != "[None]");
-        return std::make_tuple(top_name, rank(row));
+      [rank](const ChildRef& ref) {
+        bool top_name = (*ref.name != "[None]");
+        return std::make_tuple(top_name, rank(ref));
       };
 
-  std::sort(child_rows.begin(), child_rows.end(),
-            MakeRankComparator(collapse_rank));
-
-  RollupRow others_row(others_label);
   Rollup others_rollup;
-  Rollup others_base;
-
-  // Filter out everything but the top 'row_limit'.  Add rows that were filtered
-  // out to "others_row".
-  size_t i = child_rows.size() - 1;
-  while (i >= options.max_rows_per_level()) {
-    CheckedAdd(&others_row.vmsize, child_rows[i].vmsize);
-    CheckedAdd(&others_row.filesize, child_rows[i].filesize);
-    if (base) {
-      auto it = base->children_.find(child_rows[i].name);
-      if (it != base->children_.end()) {
-        CheckedAdd(&others_base.vm_total_, it->second->vm_total_);
-        CheckedAdd(&others_base.file_total_, it->second->file_total_);
-      }
+
+  // Filter out everything but the top 'row_limit' (0 means no limit).  We only
+  // need to know which children make the cut, not their order, so a selection
+  // is enough here; the survivors get sorted below.  Children that were
+  // filtered out are added to "others_rollup", without ever getting a row of
+  // their own.
+  size_t row_limit = options.max_rows_per_level();
+  if (row_limit > 0 && child_refs.size() > row_limit) {
+    auto first_other = child_refs.begin() + row_limit;
+    std::nth_element(child_refs.begin(), first_other, child_refs.end(),
+                     MakeRankComparator(collapse_rank));
+
+    for (auto it = first_other; it != child_refs.end(); ++it) {
+      const Rollup* other = it->rollup;
+      CheckedAdd(&others_rollup.vm_total_, other->vm_total_);
+      CheckedAdd(&others_rollup.file_total_, other->file_total_);
+      CheckedAdd(&others_rollup.base_vm_total_, other->base_vm_total_);
+      CheckedAdd(&others_rollup.base_file_total_, other->base_file_total_);
+      CheckedAdd(&others_rollup.samples_, other->samples_);
+      CheckedAdd(&others_rollup.hot_bytes_, other->hot_bytes_);
+      CheckedAdd(&others_rollup.resident_, other->resident_);
     }
 
-    child_rows.erase(child_rows.end() - 1);
-    i--;
+    child_refs.erase(first_other, child_refs.end());
   }
 
-  if (std::abs(others_row.vmsize) > 0 || std::abs(others_row.filesize) > 0) {
-    child_rows.push_back(others_row);
-    CheckedAdd(&others_rollup.vm_total_, others_row.vmsize);
-    CheckedAdd(&others_rollup.file_total_, others_row.filesize);
+  if (std::abs(others_rollup.vm_total_) > 0 ||
+      std::abs(others_rollup.file_total_) > 0) {
+    child_refs.push_back(ChildRef{&others_label, &others_rollup});
   }
 
   // Sort all rows (including "other") and include sort by name.
-  std::sort(child_rows.begin(), child_rows.end(), MakeRankComparator(rank));
+  std::sort(child_refs.begin(), child_refs.end(), MakeRankComparator(rank));
 
-  // Compute percents for all rows (including "Other")
-  if (!base) {
-    for (auto& child_row : child_rows) {
+  // Only now do we create rows, for exactly the children that will be output.
+  std::vector<RollupRow>& child_rows = *children;
+  child_rows.reserve(child_refs.size());
+  for (const auto& ref : child_refs) {
+    child_rows.emplace_back(*ref.name);
+    RollupRow& child_row = child_rows.back();
+    child_row.vmsize = ref.rollup->vm_total_;
+    child_row.filesize = ref.rollup->file_total_;
+    child_row.samples = ref.rollup->samples_;
+    child_row.hot_bytes = ref.rollup->hot_bytes_;
+    child_row.resident = ref.rollup->resident_;
+
+    // Compute percents for all rows (including "Other")
+    if (!diff_mode) {
       child_row.vmpercent = Percent(child_row.vmsize, row->vmsize);
       child_row.filepercent = Percent(child_row.filesize, row->filesize);
     }
   }
 
-  // Recurse into sub-rows, (except "Other", which isn't a real row).
-  for (auto& child_row : child_rows) {
-    const Rollup* child_rollup;
-    const Rollup* child_base = nullptr;
+  // Recurse into sub-rows.  "[Other]" has no children, but in diff mode this
+  // still computes its percentages.
+  for (size_t i = 0; i < child_refs.size(); i++) {
+    child_refs[i].rollup->CreateRows(&child_rows[i], diff_mode, options, false);
+  }
+}
+
 
-    if (child_row.name == others_label) {
-      child_rollup = &others_rollup;
-      if (base) {
-        child_base = &others_base;
-      }
-    } else {
-      auto it = children_.find(child_row.name);
-      if (it == children_.end()) {
-        THROWF("internal error, couldn't find name $0", child_row.name);
-      }
-      child_rollup = it->second.get();
-      assert(child_rollup);
-
-      if (base) {
-        auto it = base->children_.find(child_row.name);
-        if (it == base->children_.end()) {
-          child_base = GetEmpty();
-        } else {
-          child_base = it->second.get();
-        }
-      }
+// Rollup snapshots ////////////////////////////////////////////////////////////
+
+// A snapshot is the unpruned Rollup for a set of input files, written with
+// --save-rollup.  A snapshot can be passed anywhere an input or base file is
+// expected, which lets us diff or sum builds without scanning them again.
+//
+// All integers are fixed-width little-endian, and the snapshot is decoded
+// directly from the mapped file as it is added to the Rollup (which still
+// copies every label into the Rollup's own tree):
+//
+//   char[8]  magic ("BLOATYRS")
+//   uint32   format version (kRollupSnapshotVersion)
+//   uint32   number of data sources, then each one as:
+//              uint32 name length, name bytes, uint64 fingerprint
+//   node     the top-level Rollup, where a node is:
+//              int64 vmsize, int64 filesize, uint32 child count, then for
+//              each child: uint32 name length, name bytes, node
+//
+// Readers must reject versions they don't know; any change to the layout
+// needs a new version.
+
+static const char kRollupSnapshotMagic[] = "BLOATYRS";
+static const size_t kRollupSnapshotMagicSize = 8;
+static const uint32_t kRollupSnapshotVersion = 2;
+
+static uint64_t HashBytes(string_view bytes) {
+  // FNV-1a.
+  uint64_t hash = 14695981039346656037ULL;
+  for (char ch : bytes) {
+    hash ^= static_cast<uint8_t>(ch);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+template <class T>
+static void WriteSnapshotInt(T val, std::string* out) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out->push_back(static_cast<char>(static_cast<uint64_t>(val) >> (i * 8)));
+  }
+}
+
+static void WriteSnapshotString(string_view str, std::string* out) {
+  WriteSnapshotInt<uint32_t>(str.size(), out);
+  out->append(str.data(), str.size());
+}
+
+template <class T>
+static T ReadSnapshotInt(string_view* data) {
+  if (data->size() < sizeof(T)) {
+    THROW("rollup snapshot is truncated");
+  }
+  uint64_t val = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    val |= static_cast<uint64_t>(static_cast<uint8_t>((*data)[i])) << (i * 8);
+  }
+  data->remove_prefix(sizeof(T));
+  return static_cast<T>(val);
+}
+
+static string_view ReadSnapshotString(string_view* data) {
+  uint32_t size = ReadSnapshotInt<uint32_t>(data);
+  if (data->size() < size) {
+    THROW("rollup snapshot is truncated");
+  }
+  string_view ret = data->substr(0, size);
+  data->remove_prefix(size);
+  return ret;
+}
+
+void Rollup::WriteSnapshot(std::string* out) const {
+  WriteSnapshotInt<int64_t>(vm_total_, out);
+  WriteSnapshotInt<int64_t>(file_total_, out);
+  WriteSnapshotInt<uint32_t>(children_.size(), out);
+
+  // Write children in name order so that snapshots are reproducible.
+  std::vector<const ChildMap::value_type*> children;
+  children.reserve(children_.size());
+  for (const auto& child : children_) {
+    children.push_back(&child);
+  }
+  std::sort(children.begin(), children.end(),
+            [](const ChildMap::value_type* a, const ChildMap::value_type* b) {
+              return a->first < b->first;
+            });
+
+  for (auto child : children) {
+    WriteSnapshotString(child->first, out);
+    child->second->WriteSnapshot(out);
+  }
+}
+
+void Rollup::AddSnapshot(string_view* data, size_t levels, bool is_base) {
+  int64_t vmsize = ReadSnapshotInt<int64_t>(data);
+  int64_t filesize = ReadSnapshotInt<int64_t>(data);
+  AddTotals(vmsize, filesize, is_base);
+  uint32_t child_count = ReadSnapshotInt<uint32_t>(data);
+
+  if (child_count > 0 && levels == 0) {
+    THROW("rollup snapshot is deeper than its data sources");
+  }
+
+  for (uint32_t i = 0; i < child_count; i++) {
+    string_view name = ReadSnapshotString(data);
+    GetOrAddChild(std::string(name))->AddSnapshot(data, levels - 1, is_base);
+  }
+}
+
+bool IsRollupSnapshot(string_view data) {
+  return data.substr(0, kRollupSnapshotMagicSize) ==
+         string_view(kRollupSnapshotMagic, kRollupSnapshotMagicSize);
+}
+
+// Identifies the labels of one level of a snapshot.  The fingerprint is 0 for
+// built-in sources; for custom ones it is a hash of their base source and
+// rewrites, since the name alone says nothing about either.
+struct SnapshotSource {
+  std::string name;
+  uint64_t fingerprint;
+};
+
+static uint64_t CustomDataSourceFingerprint(const CustomDataSource& source) {
+  std::string buf;
+  WriteSnapshotString(source.base_data_source(), &buf);
+  for (const auto& regex : source.rewrite()) {
+    WriteSnapshotString(regex.pattern(), &buf);
+    WriteSnapshotString(regex.replacement(), &buf);
+  }
+  // Never 0, which is for built-in sources.
+  return HashBytes(buf) | 1;
+}
+
+void WriteRollupSnapshot(const Rollup& rollup,
+                         const std::vector<SnapshotSource>& sources,
+                         std::string* out) {
+  out->append(kRollupSnapshotMagic, kRollupSnapshotMagicSize);
+  WriteSnapshotInt<uint32_t>(kRollupSnapshotVersion, out);
+  WriteSnapshotInt<uint32_t>(sources.size(), out);
+  for (const auto& source : sources) {
+    WriteSnapshotString(source.name, out);
+    WriteSnapshotInt<uint64_t>(source.fingerprint, out);
+  }
+  rollup.WriteSnapshot(out);
+}
+
+void AddRollupSnapshot(const InputFile& file,
+                       const std::vector<SnapshotSource>& sources,
+                       bool is_base, Rollup* rollup) {
+  string_view data = file.data();
+  assert(IsRollupSnapshot(data));
+  data.remove_prefix(kRollupSnapshotMagicSize);
+
+  uint32_t version = ReadSnapshotInt<uint32_t>(&data);
+  if (version != kRollupSnapshotVersion) {
+    THROWF("rollup snapshot '$0' has unsupported version $1", file.filename(),
+           version);
+  }
+
+  // The tree is only meaningful for the exact data sources it was saved with.
+  std::vector<std::string> snapshot_names;
+  std::vector<uint64_t> snapshot_fingerprints;
+  uint32_t source_count = ReadSnapshotInt<uint32_t>(&data);
+  for (uint32_t i = 0; i < source_count; i++) {
+    snapshot_names.push_back(std::string(ReadSnapshotString(&data)));
+    snapshot_fingerprints.push_back(ReadSnapshotInt<uint64_t>(&data));
+  }
+
+  std::vector<std::string> names;
+  for (const auto& source : sources) {
+    names.push_back(source.name);
+  }
+  if (snapshot_names != names) {
+    THROWF("rollup snapshot '$0' was saved with data sources '$1', not '$2'",
+           file.filename(), absl::StrJoin(snapshot_names, ","),
+           absl::StrJoin(names, ","));
+  }
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (snapshot_fingerprints[i] != sources[i].fingerprint) {
+      THROWF("rollup snapshot '$0' was saved with a different definition of "
+             "data source '$1'", file.filename(), sources[i].name);
     }
+  }
 
-    child_rollup->CreateRows(&child_row, child_base, options, false);
+  rollup->AddSnapshot(&data, sources.size(), is_base);
+
+  if (!data.empty()) {
+    THROWF("rollup snapshot '$0' has trailing data", file.filename());
   }
 }
 
@@ -655,40 +1201,85 @@ void Rollup::ComputeRows(RollupRow* row, std::vector<RollupRow>* children,
 // data is in this format, we can print it to the screen (or verify the output
 // in unit tests).
 
-void PrintSpaces(size_t n, std::ostream* out) {
-  for (size_t i = 0; i < n; i++) {
-    *out << " ";
+// Collects output in one large buffer that is reused for the whole print, and
+// hands it to the ostream in big chunks.  With "-n 0" we can print tens of
+// millions of rows, so nothing on the per-field path here allocates.
+class OutputBuffer {
+ public:
+  OutputBuffer(std::ostream* out) : out_(out) { buf_.reserve(kFlushSize * 2); }
+  ~OutputBuffer() { Flush(); }
+
+  void Append(string_view str) { buf_.append(str.data(), str.size()); }
+  void Append(char ch) { buf_.push_back(ch); }
+  void AppendSpaces(size_t n) { buf_.append(n, ' '); }
+
+  // Appends "str" truncated or padded with spaces to exactly "width" chars.
+  void AppendFixedWidth(string_view str, size_t width) {
+    if (str.size() >= width) {
+      Append(str.substr(0, width));
+    } else {
+      Append(str);
+      AppendSpaces(width - str.size());
+    }
+  }
+
+  // Appends "str" right-aligned in "width" chars (never truncated).
+  void AppendLeftPadded(string_view str, size_t width) {
+    if (str.size() < width) {
+      AppendSpaces(width - str.size());
+    }
+    Append(str);
   }
-}
 
-std::string FixedWidthString(const std::string& input, size_t size) {
-  if (input.size() < size) {
-    std::string ret = input;
-    while (ret.size() < size) {
-      ret += " ";
+  void AppendInt(int64_t val) {
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    uint64_t abs_val = val < 0 ? 0 - static_cast<uint64_t>(val) : val;
+    do {
+      *--p = '0' + (abs_val % 10);
+      abs_val /= 10;
+    } while (abs_val);
+    if (val < 0) {
+      *--p = '-';
     }
-    return ret;
-  } else {
-    return input.substr(0, size);
+    Append(string_view(p, end - p));
   }
-}
 
-std::string LeftPad(const std::string& input, size_t size) {
-  std::string ret = input;
-  while (ret.size() < size) {
-    ret = " " + ret;
+  void AppendHex(uint64_t val) {
+    char buf[16];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    do {
+      *--p = "0123456789abcdef"[val & 0xf];
+      val >>= 4;
+    } while (val);
+    Append(string_view(p, end - p));
   }
 
-  return ret;
-}
+  void AppendCSVField(string_view str) { AppendCSVEscaped(str, &buf_); }
 
-std::string DoubleStringPrintf(const char *fmt, double d) {
-  char buf[1024];
-  snprintf(buf, sizeof(buf), fmt, d);
-  return std::string(buf);
-}
+  // Ends the current line, writing out the buffer if it has grown large.
+  void EndLine() {
+    Append('\n');
+    if (buf_.size() >= kFlushSize) {
+      Flush();
+    }
+  }
+
+  void Flush() {
+    out_->write(buf_.data(), buf_.size());
+    buf_.clear();
+  }
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 16;
+
+  std::ostream* out_;
+  std::string buf_;
+};
 
-std::string SiPrint(ssize_t size, bool force_sign) {
+void AppendSi(ssize_t size, bool force_sign, OutputBuffer* out) {
   const char *prefixes[] = {"", "Ki", "Mi", "Gi", "Ti"};
   size_t num_prefixes = 5;
   size_t n = 0;
@@ -698,72 +1289,87 @@ std::string SiPrint(ssize_t size, bool force_sign) {
     n++;
   }
 
-  std::string ret;
+  char buf[64];
+  int len;
 
   if (fabs(size_d) > 100 || n == 0) {
-    ret = std::to_string(static_cast<ssize_t>(size_d)) + prefixes[n];
-    if (force_sign && size > 0) {
-      ret = "+" + ret;
-    }
+    len = snprintf(buf, sizeof(buf), force_sign && size > 0 ? "+%zd%s" : "%zd%s",
+                   static_cast<ssize_t>(size_d), prefixes[n]);
   } else if (fabs(size_d) > 10) {
-    if (force_sign) {
-      ret = DoubleStringPrintf("%+0.1f", size_d) + prefixes[n];
-    } else {
-      ret = DoubleStringPrintf("%0.1f", size_d) + prefixes[n];
-    }
+    len = snprintf(buf, sizeof(buf), force_sign ? "%+0.1f%s" : "%0.1f%s",
+                   size_d, prefixes[n]);
   } else {
-    if (force_sign) {
-      ret = DoubleStringPrintf("%+0.2f", size_d) + prefixes[n];
-    } else {
-      ret = DoubleStringPrintf("%0.2f", size_d) + prefixes[n];
-    }
+    len = snprintf(buf, sizeof(buf), force_sign ? "%+0.2f%s" : "%0.2f%s",
+                   size_d, prefixes[n]);
   }
 
-  return LeftPad(ret, 7);
+  out->AppendLeftPadded(string_view(buf, len), 7);
 }
 
-std::string PercentString(double percent, bool diff_mode) {
+void AppendPercent(double percent, bool diff_mode, OutputBuffer* out) {
+  char buf[64];
+  int len;
+
   if (diff_mode) {
     if (percent == 0 || std::isnan(percent)) {
-      return " [ = ]";
+      out->Append(" [ = ]");
+      return;
     } else if (percent == -100) {
-      return " [DEL]";
+      out->Append(" [DEL]");
+      return;
     } else if (std::isinf(percent)) {
-      return " [NEW]";
-    } else {
-      // We want to keep this fixed-width even if the percent is very large.
-      std::string str;
-      if (percent > 1000) {
-        int digits = log10(percent) - 1;
-        str = DoubleStringPrintf("%+2.0f", percent / pow(10, digits)) + "e" +
-              std::to_string(digits) + "%";
-      } else if (percent > 10) {
-        str = DoubleStringPrintf("%+4.0f%%", percent);
-      } else {
-        str = DoubleStringPrintf("%+5.1F%%", percent);
-      }
+      out->Append(" [NEW]");
+      return;
+    }
 
-      return LeftPad(str, 6);
+    // We want to keep this fixed-width even if the percent is very large.
+    if (percent > 1000) {
+      int digits = log10(percent) - 1;
+      len = snprintf(buf, sizeof(buf), "%+2.0fe%d%%",
+                     percent / pow(10, digits), digits);
+    } else if (percent > 10) {
+      len = snprintf(buf, sizeof(buf), "%+4.0f%%", percent);
+    } else {
+      len = snprintf(buf, sizeof(buf), "%+5.1F%%", percent);
     }
+
+    out->AppendLeftPadded(string_view(buf, len), 6);
   } else {
-    return DoubleStringPrintf("%5.1F%%", percent);
+    len = snprintf(buf, sizeof(buf), "%5.1F%%", percent);
+    out->Append(string_view(buf, len));
   }
 }
 
 void RollupOutput::PrettyPrintRow(const RollupRow& row, size_t indent,
                                   size_t longest_label,
-                                  std::ostream* out) const {
-  *out << FixedWidthString("", indent) << " "
-       << PercentString(row.vmpercent, row.diff_mode) << " "
-       << SiPrint(row.vmsize, row.diff_mode) << " "
-       << FixedWidthString(row.name, longest_label) << " "
-       << SiPrint(row.filesize, row.diff_mode) << " "
-       << PercentString(row.filepercent, row.diff_mode) << "\n";
+                                  OutputBuffer* out) const {
+  out->AppendSpaces(indent);
+  out->Append(' ');
+  AppendPercent(row.vmpercent, row.diff_mode, out);
+  out->Append(' ');
+  AppendSi(row.vmsize, row.diff_mode, out);
+  out->Append(' ');
+  out->AppendFixedWidth(row.name, longest_label);
+  out->Append(' ');
+  AppendSi(row.filesize, row.diff_mode, out);
+  out->Append(' ');
+  AppendPercent(row.filepercent, row.diff_mode, out);
+  if (has_samples_) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), " %9" PRId64 " ", row.samples);
+    out->Append(string_view(buf, len));
+    AppendSi(row.hot_bytes, false, out);
+  }
+  if (has_resident_) {
+    out->Append("  ");
+    AppendSi(row.resident, false, out);
+  }
+  out->EndLine();
 }
 
 void RollupOutput::PrettyPrintTree(const RollupRow& row, size_t indent,
                                    size_t longest_label,
-                                   std::ostream* out) const {
+                                   OutputBuffer* out) const {
   // Rows are printed before their sub-rows.
   PrettyPrintRow(row, indent, longest_label, out);
 
@@ -828,111 +1434,327 @@ void RollupOutput::PrettyPrint(size_t max_label_len, std::ostream* out) const {
 
   longest_label = std::min(longest_label, max_label_len);
 
-  *out << "     VM SIZE    ";
-  PrintSpaces(longest_label, out);
-  *out << "    FILE SIZE";
-  *out << "\n";
+  OutputBuffer buf(out);
+
+  buf.Append("     VM SIZE    ");
+  buf.AppendSpaces(longest_label);
+  buf.Append("    FILE SIZE");
+  if (has_samples_) {
+    buf.Append("   SAMPLES     HOT");
+  }
+  if (has_resident_) {
+    buf.Append(" RESIDENT");
+  }
+  buf.EndLine();
 
   if (toplevel_row_.diff_mode) {
-    *out << " ++++++++++++++ ";
-    *out << FixedWidthString("GROWING", longest_label);
-    *out << " ++++++++++++++";
-    *out << "\n";
+    buf.Append(" ++++++++++++++ ");
+    buf.AppendFixedWidth("GROWING", longest_label);
+    buf.Append(" ++++++++++++++");
+    buf.EndLine();
   } else {
-    *out << " -------------- ";
-    PrintSpaces(longest_label, out);
-    *out << " --------------";
-    *out << "\n";
+    buf.Append(" -------------- ");
+    buf.AppendSpaces(longest_label);
+    buf.Append(" --------------");
+    if (has_samples_) {
+      buf.Append(" --------- -------");
+    }
+    if (has_resident_) {
+      buf.Append(" --------");
+    }
+    buf.EndLine();
   }
 
   for (const auto& child : toplevel_row_.sorted_children) {
-    PrettyPrintTree(child, 0, longest_label, out);
+    PrettyPrintTree(child, 0, longest_label, &buf);
   }
 
   if (toplevel_row_.diff_mode) {
     if (toplevel_row_.shrinking.size() > 0) {
-      *out << "\n";
-      *out << " -------------- ";
-      *out << FixedWidthString("SHRINKING", longest_label);
-      *out << " --------------";
-      *out << "\n";
+      buf.EndLine();
+      buf.Append(" -------------- ");
+      buf.AppendFixedWidth("SHRINKING", longest_label);
+      buf.Append(" --------------");
+      buf.EndLine();
       for (const auto& child : toplevel_row_.shrinking) {
-        PrettyPrintTree(child, 0, longest_label, out);
+        PrettyPrintTree(child, 0, longest_label, &buf);
       }
     }
 
     if (toplevel_row_.mixed.size() > 0) {
-      *out << "\n";
-      *out << " -+-+-+-+-+-+-+ ";
-      *out << FixedWidthString("MIXED", longest_label);
-      *out << " +-+-+-+-+-+-+-";
-      *out << "\n";
+      buf.EndLine();
+      buf.Append(" -+-+-+-+-+-+-+ ");
+      buf.AppendFixedWidth("MIXED", longest_label);
+      buf.Append(" +-+-+-+-+-+-+-");
+      buf.EndLine();
       for (const auto& child : toplevel_row_.mixed) {
-        PrettyPrintTree(child, 0, longest_label, out);
+        PrettyPrintTree(child, 0, longest_label, &buf);
       }
     }
 
     // Always output an extra row before "TOTAL".
-    *out << "\n";
+    buf.EndLine();
   }
 
   // The "TOTAL" row comes after all other rows.
-  PrettyPrintRow(toplevel_row_, 0, longest_label, out);
+  PrettyPrintRow(toplevel_row_, 0, longest_label, &buf);
 }
 
 void RollupOutput::PrintRowToCSV(const RollupRow& row,
                                  string_view parent_labels,
-                                 std::ostream* out) const {
-  if (parent_labels.size() > 0) {
-    *out << parent_labels << ",";
+                                 OutputBuffer* out) const {
+  // "parent_labels" already ends in a comma if it is non-empty.
+  out->Append(parent_labels);
+  out->AppendCSVField(row.name);
+  out->Append(',');
+  out->AppendInt(row.vmsize);
+  out->Append(',');
+  out->AppendInt(row.filesize);
+  if (has_samples_) {
+    out->Append(',');
+    out->AppendInt(row.samples);
+    out->Append(',');
+    out->AppendInt(row.hot_bytes);
   }
-
-  *out << absl::StrJoin(std::make_tuple(CSVEscape(row.name),
-                                        row.vmsize,
-                                        row.filesize),
-                        ",") << "\n";
+  if (has_resident_) {
+    out->Append(',');
+    out->AppendInt(row.resident);
+  }
+  out->EndLine();
 }
 
 void RollupOutput::PrintTreeToCSV(const RollupRow& row,
-                                  string_view parent_labels,
-                                  std::ostream* out) const {
+                                  std::string* parent_labels,
+                                  OutputBuffer* out) const {
   if (row.sorted_children.size() > 0 ||
       row.shrinking.size() > 0 ||
       row.mixed.size() > 0) {
-    std::string labels;
-    if (parent_labels.size() > 0) {
-      labels = absl::StrJoin(
-          std::make_tuple(parent_labels, CSVEscape(row.name)), ",");
-    } else {
-      labels = CSVEscape(row.name);
-    }
+    // The labels of all ancestors are kept in a single string that we push
+    // onto and pop from as we walk the tree.
+    size_t parent_size = parent_labels->size();
+    AppendCSVEscaped(row.name, parent_labels);
+    parent_labels->push_back(',');
     for (const auto& child_row : row.sorted_children) {
-      PrintTreeToCSV(child_row, labels, out);
+      PrintTreeToCSV(child_row, parent_labels, out);
     }
     for (const auto& child_row : row.shrinking) {
-      PrintTreeToCSV(child_row, labels, out);
+      PrintTreeToCSV(child_row, parent_labels, out);
     }
     for (const auto& child_row : row.mixed) {
-      PrintTreeToCSV(child_row, labels, out);
+      PrintTreeToCSV(child_row, parent_labels, out);
     }
+    parent_labels->resize(parent_size);
   } else {
-    PrintRowToCSV(row, parent_labels, out);
+    PrintRowToCSV(row, *parent_labels, out);
   }
 }
 
 void RollupOutput::PrintToCSV(std::ostream* out) const {
-  std::vector<std::string> names(source_names_);
-  names.push_back("vmsize");
-  names.push_back("filesize");
-  *out << absl::StrJoin(names, ",") << "\n";
+  OutputBuffer buf(out);
+  for (const auto& name : source_names_) {
+    buf.Append(name);
+    buf.Append(',');
+  }
+  buf.Append("vmsize,filesize");
+  if (has_samples_) {
+    buf.Append(",samples,hot_bytes");
+  }
+  if (has_resident_) {
+    buf.Append(",resident");
+  }
+  buf.EndLine();
+
+  std::string labels;
   for (const auto& child_row : toplevel_row_.sorted_children) {
-    PrintTreeToCSV(child_row, "", out);
+    PrintTreeToCSV(child_row, &labels, &buf);
   }
   for (const auto& child_row : toplevel_row_.shrinking) {
-    PrintTreeToCSV(child_row, "", out);
+    PrintTreeToCSV(child_row, &labels, &buf);
   }
   for (const auto& child_row : toplevel_row_.mixed) {
-    PrintTreeToCSV(child_row, "", out);
+    PrintTreeToCSV(child_row, &labels, &buf);
+  }
+}
+
+static void RowToProto(const RollupRow& row, const RollupOutput& output,
+                       ReportRow* proto) {
+  proto->set_name(row.name);
+  proto->set_vmsize(row.vmsize);
+  proto->set_filesize(row.filesize);
+  proto->set_vmpercent(row.vmpercent);
+  proto->set_filepercent(row.filepercent);
+  proto->set_diff_mode(row.diff_mode);
+  if (output.has_samples()) {
+    proto->set_samples(row.samples);
+    proto->set_hot_bytes(row.hot_bytes);
+  }
+  if (output.has_resident()) {
+    proto->set_resident(row.resident);
+  }
+  for (const auto& child : row.sorted_children) {
+    RowToProto(child, output, proto->add_sorted_children());
+  }
+  for (const auto& child : row.shrinking) {
+    RowToProto(child, output, proto->add_shrinking());
+  }
+  for (const auto& child : row.mixed) {
+    RowToProto(child, output, proto->add_mixed());
+  }
+}
+
+static void RowFromProto(const ReportRow& proto, RollupRow* row) {
+  row->name = proto.name();
+  row->vmsize = proto.vmsize();
+  row->filesize = proto.filesize();
+  row->vmpercent = proto.vmpercent();
+  row->filepercent = proto.filepercent();
+  row->diff_mode = proto.diff_mode();
+  row->samples = proto.samples();
+  row->hot_bytes = proto.hot_bytes();
+  row->resident = proto.resident();
+  for (const auto& child : proto.sorted_children()) {
+    row->sorted_children.emplace_back(child.name());
+    RowFromProto(child, &row->sorted_children.back());
+  }
+  for (const auto& child : proto.shrinking()) {
+    row->shrinking.emplace_back(child.name());
+    RowFromProto(child, &row->shrinking.back());
+  }
+  for (const auto& child : proto.mixed()) {
+    row->mixed.emplace_back(child.name());
+    RowFromProto(child, &row->mixed.back());
+  }
+}
+
+void RollupOutput::ToProto(Report* report) const {
+  report->Clear();
+  for (const auto& name : source_names_) {
+    report->add_data_source(name);
+  }
+  if (has_samples_) {
+    report->set_has_samples(true);
+  }
+  if (has_resident_) {
+    report->set_has_resident(true);
+  }
+  RowToProto(toplevel_row_, *this, report->mutable_toplevel_row());
+}
+
+void RollupOutput::FromProto(const Report& report) {
+  source_names_.assign(report.data_source().begin(),
+                       report.data_source().end());
+  toplevel_row_ = RollupRow("TOTAL");
+  has_samples_ = report.has_samples();
+  has_resident_ = report.has_resident();
+  RowFromProto(report.toplevel_row(), &toplevel_row_);
+}
+
+// Writes "message" preceded by its size.  Returns false without writing
+// anything if the message is too big for protobuf to serialize (or for its
+// size to fit in the prefix).
+static bool WriteDelimited(const google::protobuf::MessageLite& message,
+                           google::protobuf::io::CodedOutputStream* stream) {
+  // ByteSizeLong() also caches the sizes of submessages for serialization.
+  size_t size = message.ByteSizeLong();
+  if (size > INT_MAX) {
+    return false;
+  }
+  stream->WriteVarint32(size);
+  message.SerializeWithCachedSizes(stream);
+  return true;
+}
+
+// Reads a message written by WriteDelimited().  Returns false at the end of
+// the stream or if the message is malformed.
+static bool ReadDelimited(google::protobuf::io::ZeroCopyInputStream* in,
+                          google::protobuf::MessageLite* message) {
+  // Any bytes it reads past the message are given back to "in" when it is
+  // destroyed.
+  google::protobuf::io::CodedInputStream stream(in);
+  uint32_t size;
+  if (!stream.ReadVarint32(&size) || size > INT_MAX) {
+    return false;
+  }
+  stream.PushLimit(size);
+  return message->ParseFromCodedStream(&stream) &&
+         stream.ConsumedEntireMessage();
+}
+
+// Print() has no way to return an error, so a report too big for protobuf
+// is reported here and leaves the stream in a failed state.
+static void ReportTooLarge(std::ostream* out) {
+  fprintf(stderr, "bloaty: report is too large to write as protobuf\n");
+  out->setstate(std::ios::failbit);
+}
+
+void RollupOutput::PrintToProto(bool delimited, std::ostream* out) const {
+  google::protobuf::io::OstreamOutputStream ostream(out);
+  google::protobuf::io::CodedOutputStream stream(&ostream);
+
+  if (!delimited) {
+    Report report;
+    ToProto(&report);
+    if (report.ByteSizeLong() > INT_MAX) {
+      ReportTooLarge(out);
+      return;
+    }
+    report.SerializeToCodedStream(&stream);
+    return;
+  }
+
+  // The first message has everything but the rows beneath "TOTAL".
+  Report report;
+  for (const auto& name : source_names_) {
+    report.add_data_source(name);
+  }
+  ReportRow* toplevel = report.mutable_toplevel_row();
+  toplevel->set_name(toplevel_row_.name);
+  toplevel->set_vmsize(toplevel_row_.vmsize);
+  toplevel->set_filesize(toplevel_row_.filesize);
+  toplevel->set_vmpercent(toplevel_row_.vmpercent);
+  toplevel->set_filepercent(toplevel_row_.filepercent);
+  toplevel->set_diff_mode(toplevel_row_.diff_mode);
+  if (has_samples_) {
+    report.set_has_samples(true);
+    toplevel->set_samples(toplevel_row_.samples);
+    toplevel->set_hot_bytes(toplevel_row_.hot_bytes);
+  }
+  if (has_resident_) {
+    report.set_has_resident(true);
+    toplevel->set_resident(toplevel_row_.resident);
+  }
+  if (!WriteDelimited(report, &stream)) {
+    ReportTooLarge(out);
+    return;
+  }
+
+  // Then one message per top-level row, so readers never need to hold more
+  // than one of these subtrees at once.
+  Report chunk;
+  for (const auto& child : toplevel_row_.sorted_children) {
+    chunk.Clear();
+    RowToProto(child, *this,
+               chunk.mutable_toplevel_row()->add_sorted_children());
+    if (!WriteDelimited(chunk, &stream)) {
+      ReportTooLarge(out);
+      return;
+    }
+  }
+  for (const auto& child : toplevel_row_.shrinking) {
+    chunk.Clear();
+    RowToProto(child, *this, chunk.mutable_toplevel_row()->add_shrinking());
+    if (!WriteDelimited(chunk, &stream)) {
+      ReportTooLarge(out);
+      return;
+    }
+  }
+  for (const auto& child : toplevel_row_.mixed) {
+    chunk.Clear();
+    RowToProto(child, *this, chunk.mutable_toplevel_row()->add_mixed());
+    if (!WriteDelimited(chunk, &stream)) {
+      ReportTooLarge(out);
+      return;
+    }
   }
 }
 
@@ -977,6 +1799,16 @@ RangeMap::Map::const_iterator RangeMap::FindContaining(uint64_t addr) const {
   }
 }
 
+RangeMap::Map::iterator RangeMap::FindContainingOrAfter(uint64_t addr) {
+  auto after = mappings_.upper_bound(addr);
+  auto it = after;
+  if (it != mappings_.begin() && (--it, EntryContains(it, addr))) {
+    return it;  // Containing
+  } else {
+    return after;  // May be end().
+  }
+}
+
 RangeMap::Map::const_iterator RangeMap::FindContainingOrAfter(
     uint64_t addr) const {
   auto after = mappings_.upper_bound(addr);
@@ -998,6 +1830,36 @@ bool RangeMap::Translate(uint64_t addr, uint64_t* translated) const {
   }
 }
 
+void RangeMap::LookupSorted(const std::vector<uint64_t>& sorted_addrs,
+                            std::vector<const std::string*>* labels) const {
+  // When the addresses are far apart relative to the map, a search is cheaper
+  // than stepping over every entry between them.
+  const int kMaxSteps = 16;
+
+  labels->resize(sorted_addrs.size());
+  auto iter = mappings_.begin();
+  for (size_t i = 0; i < sorted_addrs.size(); i++) {
+    uint64_t addr = sorted_addrs[i];
+    assert(i == 0 || sorted_addrs[i - 1] <= addr);
+
+    int steps = 0;
+    while (!IterIsEnd(iter) && RangeEnd(iter) <= addr) {
+      stats.map_iterations++;
+      if (++steps > kMaxSteps) {
+        iter = FindContainingOrAfter(addr);
+        break;
+      }
+      ++iter;
+    }
+
+    if (IterIsEnd(iter) || iter->first > addr) {
+      (*labels)[i] = nullptr;
+    } else {
+      (*labels)[i] = &iter->second.label;
+    }
+  }
+}
+
 void RangeMap::AddRange(uint64_t addr, uint64_t size, const std::string& val) {
   AddDualRange(addr, size, UINT64_MAX, val);
 }
@@ -1006,13 +1868,29 @@ void RangeMap::AddDualRange(uint64_t addr, uint64_t size, uint64_t otheraddr,
                             const std::string& val) {
   if (size == 0) return;
 
+  // Scanning gets the half of the budget that the results don't (see
+  // Bloaty::FitRollupInMemoryBudget()), so whether a file fits doesn't depend
+  // on how big the results happen to be at the time.
+  if (max_memory &&
+      stats.total_memory_in_use -
+              stats.memory_in_use[static_cast<int>(MemoryUse::kRollups)] >
+          static_cast<int64_t>(max_memory - max_memory / 2)) {
+    THROWF("scanning used more than --max-memory ($0 bytes)", max_memory);
+  }
+
+  stats.ranges_added++;
   const uint64_t base = addr;
   uint64_t end = addr + size;
   auto it = FindContainingOrAfter(addr);
 
 
   while (1) {
-    while (it != mappings_.end() && EntryContains(it, addr)) {
+    auto run = it;
+    int run_length = 0;
+    while (it != mappings_.end() && addr < end && EntryContains(it, addr)) {
+      stats.map_iterations++;
+      stats.overlaps_trimmed++;
+      run_length++;
       if (verbose_level > 1) {
         fprintf(stderr,
                 "WARN: adding mapping [%" PRIx64 "x, %" PRIx64 "x] for label"
@@ -1021,8 +1899,24 @@ void RangeMap::AddDualRange(uint64_t addr, uint64_t size, uint64_t otheraddr,
                 addr, end, val.c_str(), it->first, it->second.end,
                 it->second.label.c_str());
       }
-      addr = it->second.end;
-      ++it;
+      if (it->second.covered_end > it->second.end) {
+        addr = it->second.covered_end;
+        it = mappings_.lower_bound(addr);
+      } else {
+        addr = it->second.end;
+        ++it;
+      }
+    }
+
+    // Record how far the run we just skipped goes, so that ranges added over
+    // it later don't have to step through it entry by entry again.
+    if (run_length > 1) {
+      while (run != it) {
+        bool jump = run->second.covered_end > run->second.end;
+        uint64_t next = run->second.covered_end;
+        run->second.covered_end = addr;
+        run = jump ? mappings_.lower_bound(next) : std::next(run);
+      }
     }
 
     if (addr >= end) {
@@ -1032,6 +1926,7 @@ void RangeMap::AddDualRange(uint64_t addr, uint64_t size, uint64_t otheraddr,
     uint64_t this_end = end;
     if (it != mappings_.end() && end > it->first) {
       this_end = std::min(end, it->first);
+      stats.overlaps_trimmed++;
       if (verbose_level > 1) {
         fprintf(stderr,
                 "WARN(2): adding mapping [%" PRIx64 ", %" PRIx64 "] for label "
@@ -1044,6 +1939,7 @@ void RangeMap::AddDualRange(uint64_t addr, uint64_t size, uint64_t otheraddr,
 
     uint64_t other =
         (otheraddr == UINT64_MAX) ? UINT64_MAX : addr - base + otheraddr;
+    stats.map_iterations++;
     mappings_.insert(it, std::make_pair(addr, Entry(val, this_end, other)));
     addr = this_end;
   }
@@ -1070,6 +1966,7 @@ void RangeMap::AddRangeWithTranslation(uint64_t addr, uint64_t size,
   // cases this would be a bug (ie. symbols VM->file).  In other cases it's
   // totally normal (ie. archive members file->VM).
   while (it != translator.mappings_.end() && it->first < end) {
+    stats.map_iterations++;
     uint64_t this_addr;
     uint64_t this_size;
     if (translator.TranslateAndTrimRangeWithEntry(it, addr, end, &this_addr,
@@ -1121,6 +2018,7 @@ void RangeMap::ComputeRollup(const std::vector<const RangeMap*>& range_maps,
     uint64_t next_break = UINTPTR_MAX;
     bool have_data = false;
     keys.clear();
+    stats.map_iterations++;
     size_t i;
 
     for (i = 0; i < iters.size(); i++) {
@@ -1179,18 +2077,27 @@ void RangeMap::ComputeRollup(const std::vector<const RangeMap*>& range_maps,
   }
 }
 
+// For callers outside this file, which can't instantiate the template above.
+template void RangeMap::ComputeRollup(
+    const std::vector<const RangeMap*>& range_maps, const std::string& filename,
+    int filename_position, RangeMap::RollupFunc func);
 
-// DualMap /////////////////////////////////////////////////////////////////////
 
-// Contains a RangeMap for VM space and file space for a given file.
-
-struct DualMap {
-  RangeMap vm_map;
-  RangeMap file_map;
-};
+// MmapInputFile ///////////////////////////////////////////////////////////////
 
+// An in-memory copy of a file, for when we scan something other than the
+// file's actual contents.
+class StringInputFile : public InputFile {
+ public:
+  StringInputFile(const std::string& filename, std::string&& data)
+      : InputFile(filename), storage_(std::move(data)) {
+    data_ = storage_;
+  }
 
-// MmapInputFile ///////////////////////////////////////////////////////////////
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(StringInputFile);
+  const std::string storage_;
+};
 
 class MmapInputFile : public InputFile {
  public:
@@ -1253,6 +2160,58 @@ std::unique_ptr<InputFile> MmapInputFileFactory::OpenFile(
   return absl::make_unique<MmapInputFile>(filename);
 }
 
+// A file that is shared with a CachingInputFileFactory, which keeps it open
+// for as long as either of them is using it.
+class SharedInputFile : public InputFile {
+ public:
+  SharedInputFile(std::shared_ptr<InputFile> file)
+      : InputFile(file->filename()), file_(std::move(file)) {
+    data_ = file_->data();
+  }
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(SharedInputFile);
+  std::shared_ptr<InputFile> file_;
+};
+
+std::unique_ptr<InputFile> CachingInputFileFactory::OpenFile(
+    const std::string& filename) const {
+  struct stat buf;
+  if (stat(filename.c_str(), &buf) < 0) {
+    // Let the underlying factory report the error.
+    return factory_.OpenFile(filename);
+  }
+
+#ifdef __APPLE__
+  int64_t mtime_nsec = buf.st_mtimespec.tv_nsec;
+#else
+  int64_t mtime_nsec = buf.st_mtim.tv_nsec;
+#endif
+  Key key(filename, buf.st_dev, buf.st_ino, buf.st_size, buf.st_mtime,
+          mtime_nsec);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = files_.begin(); it != files_.end(); ++it) {
+      if (it->first == key) {
+        files_.splice(files_.begin(), files_, it);
+        return absl::make_unique<SharedInputFile>(it->second);
+      }
+    }
+  }
+
+  // Opened without the lock, so a slow open doesn't hold up other threads.
+  // If two threads open the same file at once, both are cached until the
+  // older one falls off the end.
+  std::shared_ptr<InputFile> file(factory_.OpenFile(filename));
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.emplace_front(key, file);
+  if (files_.size() > max_files_) {
+    files_.pop_back();
+  }
+  return absl::make_unique<SharedInputFile>(file);
+}
+
 
 // RangeSink ///////////////////////////////////////////////////////////////////
 
@@ -1334,21 +2293,274 @@ void RangeSink::AddRange(string_view name, uint64_t vmaddr, uint64_t vmsize,
 }
 
 
+// Profile samples /////////////////////////////////////////////////////////////
+
+// Parses an address as given to --lookup or in a sample file: a VM address, or
+// a file offset if it starts with "file:", in hex if it starts with "0x" and
+// decimal otherwise.
+static bool ParseAddress(const char* str, uint64_t* addr, bool* file_offset) {
+  *file_offset = strncmp(str, "file:", 5) == 0;
+  if (*file_offset) {
+    str += 5;
+  }
+  int base = 10;
+  if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    str += 2;
+    base = 16;
+  }
+  if (!isxdigit(static_cast<unsigned char>(*str))) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  *addr = strtoull(str, &end, base);
+  return errno == 0 && *end == '\0';
+}
+
+// Addresses and how many samples each had, sorted by address.
+typedef std::vector<std::pair<uint64_t, uint64_t>> SampleList;
+
+// Reads a sample file (see Options.sample_file).  Blank lines and lines
+// starting with '#' are skipped.
+static void ReadSamples(const std::string& filename, SampleList* vm_samples,
+                        SampleList* file_samples) {
+  std::ifstream in(filename);
+  if (!in) {
+    THROWF("couldn't open sample file $0", filename);
+  }
+
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#') {
+      continue;
+    }
+    line.resize(line.find_last_not_of(" \t\r") + 1);
+
+    uint64_t count = 1;
+    size_t space = line.find_first_of(" \t", start);
+    if (space != std::string::npos) {
+      const char* count_str =
+          line.c_str() + line.find_first_not_of(" \t", space);
+      char* end;
+      errno = 0;
+      count = strtoull(count_str, &end, 10);
+      if (!isdigit(static_cast<unsigned char>(*count_str)) || errno != 0 ||
+          *end != '\0') {
+        THROWF("$0:$1: invalid sample count: $2", filename, line_number,
+               count_str);
+      }
+      line[space] = '\0';
+    }
+
+    const char* str = line.c_str() + start;
+    uint64_t addr;
+    bool file_offset;
+    if (!ParseAddress(str, &addr, &file_offset)) {
+      THROWF("$0:$1: invalid address: $2", filename, line_number, str);
+    }
+    (file_offset ? file_samples : vm_samples)->emplace_back(addr, count);
+  }
+
+  std::sort(vm_samples->begin(), vm_samples->end());
+  std::sort(file_samples->begin(), file_samples->end());
+}
+
+
+// Pages ///////////////////////////////////////////////////////////////////////
+
+// Every page is its own label, so a crafted file whose segments claim a huge
+// address space could make us add ranges without end.  Real binaries have far
+// fewer rows than this, since pages with no file data are collapsed (see
+// AddPages()); more than it means a bigger --page-size is needed.
+static uint64_t MaxPages(const InputFile& file) {
+  return 1024 + file.data().size() / 8;
+}
+
+static std::string PageLabel(bool file_offsets, uint64_t page) {
+  char label[32];
+  snprintf(label, sizeof(label), "%s0x%" PRIx64, file_offsets ? "file:" : "",
+           page);
+  return label;
+}
+
+// Labels each range in |map| with the page it is on, which is named by its
+// start: "0x1000" for VM pages or "file:0x1000" for file pages, like --lookup
+// addresses.  Ranges that span pages are split between them.  VM pages with no
+// file data (like most of .bss) are all alike, so a run of whole ones is one
+// row, named by its start and end: "0x2000-0x400000".
+static void AddPages(const InputFile& file, const RangeMap& map,
+                     bool file_offsets, uint64_t page_size, RangeSink* sink) {
+  uint64_t rows = 0;
+  auto add = [&](const std::string& label, uint64_t start, uint64_t size) {
+    if (++rows > MaxPages(file)) {
+      THROWF("'$0' has more than $1 pages; try a larger --page-size",
+             file.filename(), MaxPages(file));
+    }
+    if (file_offsets) {
+      sink->AddRange(label, 0, 0, start, size);
+    } else {
+      sink->AddRange(label, start, size, 0, 0);
+    }
+  };
+
+  auto add_pages = [&](uint64_t addr, uint64_t end) {
+    if (addr == end) {
+      return;
+    }
+    uint64_t page = addr - addr % page_size;
+    while (true) {
+      uint64_t start = std::max(addr, page);
+      uint64_t size = std::min(end - page, page_size) - (start - page);
+      add(PageLabel(file_offsets, page), start, size);
+      if (end - page <= page_size) {
+        break;
+      }
+      page += page_size;
+    }
+  };
+
+  RangeMap::ComputeRollup(
+      {&map}, "", -1,
+      [&](const std::vector<std::string>& /* keys */, uint64_t addr,
+          uint64_t end) {
+        uint64_t translated;
+        if (!file_offsets && !map.Translate(addr, &translated)) {
+          uint64_t first = addr + (page_size - addr % page_size) % page_size;
+          uint64_t last = end - end % page_size;
+          if (first >= addr && last > first && last - first > page_size) {
+            add_pages(addr, first);
+            add(PageLabel(false, first) + "-" + PageLabel(false, last), first,
+                last - first);
+            add_pages(last, end);
+            return;
+          }
+        }
+        add_pages(addr, end);
+      });
+}
+
+// Residency ///////////////////////////////////////////////////////////////////
+
+// Sorted, disjoint [start, end) ranges of file offsets.
+typedef std::vector<std::pair<uint64_t, uint64_t>> FileRanges;
+
+#ifdef __linux__
+
+// Reads which pages of |file| are resident in process |pid| (see Options.pid)
+// into |ranges|.  Mappings are found in /proc/PID/maps by the file's device and
+// inode, so any path to the file works, and their pages are looked up in
+// /proc/PID/pagemap.  When Bloaty looks at itself, its own mapping of |file|
+// is skipped, since scanning it would make it resident.
+static void ReadResidentRanges(int pid, const InputFile& file,
+                               FileRanges* ranges) {
+  struct stat file_stat;
+  if (stat(file.filename().c_str(), &file_stat) < 0) {
+    THROWF("couldn't stat file '$0': $1", file.filename(), strerror(errno));
+  }
+
+  std::string proc = "/proc/" + std::to_string(pid);
+  std::ifstream maps(proc + "/maps");
+  if (!maps) {
+    THROWF("couldn't open '$0/maps'", proc);
+  }
+  FileDescriptor pagemap(open((proc + "/pagemap").c_str(), O_RDONLY));
+  if (pagemap.fd() < 0) {
+    THROWF("couldn't open '$0/pagemap': $1", proc, strerror(errno));
+  }
+
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  bool mapped = false;
+  std::vector<uint64_t> entries;
+  std::string line;
+  while (std::getline(maps, line)) {
+    uint64_t start, end, offset, inode;
+    unsigned int dev_major, dev_minor;
+    if (sscanf(line.c_str(),
+               "%" SCNx64 "-%" SCNx64 " %*s %" SCNx64 " %x:%x %" SCNu64,
+               &start, &end, &offset, &dev_major, &dev_minor, &inode) != 6) {
+      THROWF("couldn't parse '$0/maps' line: $1", proc, line);
+    }
+    if (inode != file_stat.st_ino || dev_major != major(file_stat.st_dev) ||
+        dev_minor != minor(file_stat.st_dev)) {
+      continue;
+    }
+    if (pid == getpid() &&
+        start == reinterpret_cast<uintptr_t>(file.data().data())) {
+      continue;
+    }
+    mapped = true;
+
+    // One entry per page, whose top bit is set if the page is present.
+    entries.resize((end - start) / page_size);
+    size_t bytes = entries.size() * sizeof(uint64_t);
+    if (pread(pagemap.fd(), entries.data(), bytes,
+              start / page_size * sizeof(uint64_t)) !=
+        static_cast<ssize_t>(bytes)) {
+      THROWF("couldn't read '$0/pagemap': $1", proc, strerror(errno));
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (entries[i] >> 63) {
+        uint64_t page = offset + i * page_size;
+        ranges->emplace_back(page, page + page_size);
+      }
+    }
+  }
+
+  if (!mapped) {
+    THROWF("'$0' isn't mapped in process $1", file.filename(), pid);
+  }
+
+  // The same part of the file can be mapped more than once.
+  std::sort(ranges->begin(), ranges->end());
+  size_t n = 0;
+  for (const auto& range : *ranges) {
+    if (n > 0 && range.first <= (*ranges)[n - 1].second) {
+      (*ranges)[n - 1].second = std::max((*ranges)[n - 1].second, range.second);
+    } else {
+      (*ranges)[n++] = range;
+    }
+  }
+  ranges->resize(n);
+}
+
+#else
+
+static void ReadResidentRanges(int /* pid */, const InputFile& /* file */,
+                               FileRanges* /* ranges */) {
+  THROW("residency (--pid) is only supported on Linux");
+}
+
+#endif
+
+
 // Bloaty //////////////////////////////////////////////////////////////////////
 
 // Represents a program execution and associated state.
 
 struct ConfiguredDataSource {
   ConfiguredDataSource(const DataSourceDefinition& definition_)
-      : definition(definition_), munger(new NameMunger()) {}
+      : definition(definition_),
+        name(definition_.name),
+        munger(std::make_shared<NameMunger>()) {}
 
+  // For a custom source, "definition" is its base source's, while "name" is
+  // its own and "fingerprint" identifies its rewrites (see SnapshotSource).
   const DataSourceDefinition& definition;
-  std::unique_ptr<NameMunger> munger;
+  std::string name;
+  uint64_t fingerprint = 0;
+  std::shared_ptr<NameMunger> munger;
 };
 
+struct DualMaps;
+
 class Bloaty {
  public:
-  Bloaty(const InputFileFactory& factory);
+  // "demangler" is used for every file.  If "munger_cache" is non-NULL,
+  // custom data sources are looked up in it before being compiled, and added
+  // to it after.
+  Bloaty(const InputFileFactory& factory, Demangler* demangler,
+         MungerCache* munger_cache);
 
   void AddFilename(const std::string& filename, bool base_file);
 
@@ -1359,8 +2571,16 @@ class Bloaty {
   void DefineCustomDataSource(const CustomDataSource& source);
 
   void AddDataSource(const std::string& name);
+  void SetPageSize(uint64_t page_size) { page_size_ = page_size; }
   void ScanAndRollup(const Options& options, RollupOutput* output);
 
+  // Writes the labels of each address (a file offset where |file_offsets| is
+  // set, otherwise a VM address) in the one input file to |out| as CSV, one
+  // row per address in the order given.
+  void LookupAddresses(const std::vector<uint64_t>& addrs,
+                       const std::vector<bool>& file_offsets,
+                       std::ostream* out);
+
  private:
   BLOATY_DISALLOW_COPY_AND_ASSIGN(Bloaty);
 
@@ -1373,9 +2593,35 @@ class Bloaty {
     }
   }
 
-  void ScanAndRollupFile(const InputFile& file, Rollup* rollup);
+  void ScanFile(const InputFile& file, DualMaps* maps);
+  void ScanAndRollupFile(const InputFile& file, bool is_base, Rollup* rollup);
+  void PruneUnchangedMembers(Rollup* rollup);
+  void FitRollupInMemoryBudget(Rollup* rollup, bool can_prune);
+
+  // All selected sources, including "inputfiles" (which is not in sources_),
+  // one per level of the rollup.
+  std::vector<SnapshotSource> GetSnapshotSources() const {
+    std::vector<SnapshotSource> ret;
+    for (auto source : sources_) {
+      ret.push_back({source->name, source->fingerprint});
+    }
+    if (filename_position_ >= 0) {
+      ret.insert(ret.begin() + filename_position_ - 1, {"inputfiles", 0});
+    }
+    return ret;
+  }
+
+  std::vector<std::string> GetSourceNames() const {
+    std::vector<std::string> ret;
+    for (const auto& source : GetSnapshotSources()) {
+      ret.push_back(source.name);
+    }
+    return ret;
+  }
 
   const InputFileFactory& file_factory_;
+  Demangler* demangler_;
+  MungerCache* munger_cache_;
 
   // All data sources, indexed by name.
   // Contains both built-in sources and custom sources.
@@ -1389,10 +2635,29 @@ class Bloaty {
   std::vector<std::unique_ptr<InputFile>> input_files_;
   std::vector<std::unique_ptr<InputFile>> base_files_;
   int filename_position_;
+
+  // The size below which rows are merged into "[Pruned]", or 0 if they
+  // haven't been.  See FitRollupInMemoryBudget().
+  int64_t prune_threshold_ = 0;
+
+  uint64_t page_size_ = 4096;
+
+  // From Options.sample_file, if it was given.
+  bool has_samples_ = false;
+  SampleList vm_samples_;
+  SampleList file_samples_;
+
+  // From Options.pid, if it was given.
+  bool has_resident_ = false;
+  FileRanges resident_;
 };
 
-Bloaty::Bloaty(const InputFileFactory& factory)
-    : file_factory_(factory), filename_position_(-1) {
+Bloaty::Bloaty(const InputFileFactory& factory, Demangler* demangler,
+               MungerCache* munger_cache)
+    : file_factory_(factory),
+      demangler_(demangler),
+      munger_cache_(munger_cache),
+      filename_position_(-1) {
   AddBuiltInSources(data_sources);
 }
 
@@ -1418,12 +2683,33 @@ void Bloaty::DefineCustomDataSource(const CustomDataSource& source) {
            source.name(), source.base_data_source());
   }
 
-  all_known_sources_[source.name()] =
+  auto configured =
       absl::make_unique<ConfiguredDataSource>(iter->second->definition);
-  NameMunger* munger = all_known_sources_[source.name()]->munger.get();
+  configured->name = source.name();
+  configured->fingerprint = CustomDataSourceFingerprint(source);
+
+  // The munger only depends on the rewrites, so sources that differ only in
+  // name (or base source) can share one.
+  std::string key;
+  if (munger_cache_) {
+    CustomDataSource rewrites;
+    *rewrites.mutable_rewrite() = source.rewrite();
+    key = rewrites.SerializeAsString();
+    auto cached = munger_cache_->find(key);
+    if (cached != munger_cache_->end()) {
+      configured->munger = cached->second;
+      all_known_sources_[source.name()] = std::move(configured);
+      return;
+    }
+  }
+
   for (const auto& regex : source.rewrite()) {
-    munger->AddRegex(regex.pattern(), regex.replacement());
+    configured->munger->AddRegex(regex.pattern(), regex.replacement());
   }
+  if (munger_cache_) {
+    (*munger_cache_)[key] = configured->munger;
+  }
+  all_known_sources_[source.name()] = std::move(configured);
 }
 
 void Bloaty::AddDataSource(const std::string& name) {
@@ -1454,17 +2740,18 @@ struct DualMaps {
   }
 
   void ComputeRollup(const std::string& filename, int filename_position,
-                     Rollup* rollup) {
+                     bool is_base, Rollup* rollup) {
     RangeMap::ComputeRollup(VmMaps(), filename, filename_position,
                             [=](const std::vector<std::string>& keys,
                                 uint64_t addr, uint64_t end) {
-                              return rollup->AddSizes(keys, end - addr, true);
+                              return rollup->AddSizes(keys, end - addr, true,
+                                                      is_base);
                             });
     RangeMap::ComputeRollup(FileMaps(), filename, filename_position,
                             [=](const std::vector<std::string>& keys,
                                 uint64_t addr, uint64_t end) {
                               return rollup->AddSizes(keys, end - addr,
-                                                      false);
+                                                      false, is_base);
                             });
   }
 
@@ -1510,6 +2797,76 @@ struct DualMaps {
 
   DualMap* base_map() { return maps_[0].get(); }
 
+  // Adds |samples| to |rollup| under the labels of the ranges they fall in,
+  // looking in the file maps if |file_offsets| is set and in the VM maps
+  // otherwise.  Both are walked in address order, so this is a single merge.
+  // Samples outside of every range aren't counted.
+  void AddSamples(const SampleList& samples, bool file_offsets,
+                  const std::string& filename, int filename_position,
+                  Rollup* rollup) const {
+    if (samples.empty()) {
+      return;
+    }
+    size_t i = 0;
+    RangeMap::ComputeRollup(
+        file_offsets ? FileMaps() : VmMaps(), filename, filename_position,
+        [&](const std::vector<std::string>& keys, uint64_t addr,
+            uint64_t end) {
+          while (i < samples.size() && samples[i].first < addr) {
+            i++;
+          }
+          uint64_t count = 0;
+          for (; i < samples.size() && samples[i].first < end; i++) {
+            count += samples[i].second;
+          }
+          if (count > 0) {
+            rollup->AddSamples(keys, count, end - addr);
+          }
+        });
+  }
+
+  // Adds the bytes of |resident| to |rollup| under the labels of the file
+  // ranges they overlap.  Like AddSamples(), this is a single merge.
+  void AddResident(const FileRanges& resident, const std::string& filename,
+                   int filename_position, Rollup* rollup) const {
+    if (resident.empty()) {
+      return;
+    }
+    size_t i = 0;
+    RangeMap::ComputeRollup(
+        FileMaps(), filename, filename_position,
+        [&](const std::vector<std::string>& keys, uint64_t addr,
+            uint64_t end) {
+          while (i < resident.size() && resident[i].second <= addr) {
+            i++;
+          }
+          uint64_t bytes = 0;
+          for (size_t j = i; j < resident.size() && resident[j].first < end;
+               j++) {
+            bytes += std::min(end, resident[j].second) -
+                     std::max(addr, resident[j].first);
+          }
+          if (bytes > 0) {
+            rollup->AddResident(keys, bytes);
+          }
+        });
+  }
+
+  // Sets (*labels)[i] to the labels that the data source maps (every map but
+  // the base map) give |sorted_addrs[i]|, looking in the file maps if
+  // |file_offsets| is set and in the VM maps otherwise.  Missing labels are
+  // NULL.
+  void LookupSorted(
+      bool file_offsets, const std::vector<uint64_t>& sorted_addrs,
+      std::vector<std::vector<const std::string*>>* labels) const {
+    labels->resize(maps_.size() - 1);
+    for (size_t i = 1; i < maps_.size(); i++) {
+      const DualMap& map = *maps_[i];
+      const RangeMap& range_map = file_offsets ? map.file_map : map.vm_map;
+      range_map.LookupSorted(sorted_addrs, &(*labels)[i - 1]);
+    }
+  }
+
  private:
   std::vector<const RangeMap*> VmMaps() const {
     std::vector<const RangeMap*> ret;
@@ -1530,47 +2887,243 @@ struct DualMaps {
   std::vector<std::unique_ptr<DualMap>> maps_;
 };
 
-void Bloaty::ScanAndRollupFile(const InputFile& file, Rollup* rollup) {
+void Bloaty::ScanFile(const InputFile& file, DualMaps* maps) {
   const std::string& filename = file.filename();
-  auto file_handler = TryOpenELFFile(file);
+  std::unique_ptr<FileHandler> file_handler;
+  {
+    StatsTimer timer(filename, "open");
+    file_handler = TryOpenELFFile(file, file_factory_, demangler_);
 
-  if (!file_handler.get()) {
-    file_handler = TryOpenMachOFile(file);
+    if (!file_handler.get()) {
+      file_handler = TryOpenMachOFile(file);
+    }
   }
 
   if (!file_handler.get()) {
     THROWF("unknown file type for file '$0'", filename.c_str());
   }
 
-  DualMaps maps;
   RangeSink sink(&file, DataSource::kSegments, nullptr);
   NameMunger empty_munger;
-  sink.AddOutput(maps.base_map(), &empty_munger);
-  file_handler->ProcessBaseMap(&sink);
-  maps.base_map()->file_map.AddRange(0, file.data().size(), "[None]");
+  sink.AddOutput(maps->base_map(), &empty_munger);
+  {
+    StatsTimer timer(filename, "base map");
+    file_handler->ProcessBaseMap(&sink);
+    maps->base_map()->file_map.AddRange(0, file.data().size(), "[None]");
+  }
 
   std::vector<std::unique_ptr<RangeSink>> sinks;
   std::vector<RangeSink*> sink_ptrs;
 
   for (auto source : sources_) {
     sinks.push_back(absl::make_unique<RangeSink>(
-        &file, source->definition.number, maps.base_map()));
-    sinks.back()->AddOutput(maps.AppendMap(), source->munger.get());
-    sink_ptrs.push_back(sinks.back().get());
+        &file, source->definition.number, maps->base_map()));
+    sinks.back()->AddOutput(maps->AppendMap(), source->munger.get());
+
+    // Pages come straight from the base map, the same way for every file
+    // type, so file handlers never see this source.  Files without real VM
+    // addresses (like relocatable objects) only have file pages.
+    if (source->definition.number == DataSource::kPages) {
+      StatsTimer timer(filename, "pages");
+      const DualMap& base_map = *maps->base_map();
+      if (file_handler->HasVMAddresses(file)) {
+        AddPages(file, base_map.vm_map, false, page_size_,
+                 sinks.back().get());
+      }
+      AddPages(file, base_map.file_map, true, page_size_, sinks.back().get());
+    } else {
+      sink_ptrs.push_back(sinks.back().get());
+    }
+  }
+
+  {
+    BLOATY_TRACE_SPAN("ProcessFile", filename);
+    file_handler->ProcessFile(sink_ptrs);
   }
+}
+
+void Bloaty::ScanAndRollupFile(const InputFile& file, bool is_base,
+                               Rollup* rollup) {
+  const std::string& filename = file.filename();
 
-  file_handler->ProcessFile(sink_ptrs);
+  BLOATY_TRACE_SPAN(filename, filename);
 
-  maps.ComputeRollup(filename, filename_position_, rollup);
+  if (IsRollupSnapshot(file.data())) {
+    if (has_samples_) {
+      THROWF("can't add samples to rollup snapshot '$0'", filename);
+    } else if (has_resident_) {
+      THROWF("can't add residency to rollup snapshot '$0'", filename);
+    }
+    StatsTimer timer(filename, "load snapshot");
+    AddRollupSnapshot(file, GetSnapshotSources(), is_base, rollup);
+    return;
+  }
+
+  DualMaps maps;
+  ScanFile(file, &maps);
+
+  {
+    StatsTimer timer(filename, "rollup");
+    maps.ComputeRollup(filename, filename_position_, is_base, rollup);
+    maps.AddSamples(vm_samples_, false, filename, filename_position_, rollup);
+    maps.AddSamples(file_samples_, true, filename, filename_position_,
+                    rollup);
+    maps.AddResident(resident_, filename, filename_position_, rollup);
+  }
   if (verbose_level > 0) {
     fprintf(stderr, "FILE MAP:\n");
     maps.PrintFileMaps(filename, filename_position_);
     fprintf(stderr, "VM MAP:\n");
     maps.PrintVMMaps(filename, filename_position_);
+    fprintf(stderr, "MEMORY:\n");
+    for (int i = 0; i < kNumMemoryUses; i++) {
+      fprintf(stderr, "  %s: %" PRId64 " bytes (peak %" PRId64 ")\n",
+              memory_use_names[i], stats.memory_in_use[i],
+              stats.memory_peak[i]);
+    }
   }
 }
 
-void Bloaty::ScanAndRollup(const Options& options, RollupOutput* output) {
+// With --max-memory, the rollup gets half of the budget, which leaves the rest
+// for scanning the next file.  When it goes over, we prune it with a threshold
+// that only ever goes up, so each file's rows are pruned the same way.  Rows
+// that can't be pruned (see ScanAndRollup()) just have to fit.
+void Bloaty::FitRollupInMemoryBudget(Rollup* rollup, bool can_prune) {
+  int64_t budget = max_memory / 2;
+  auto rollup_memory = [] {
+    return stats.memory_in_use[static_cast<int>(MemoryUse::kRollups)];
+  };
+
+  if (max_memory == 0) {
+    return;
+  }
+
+  if (!can_prune) {
+    if (rollup_memory() > budget) {
+      THROWF("results used more than half of --max-memory ($0 bytes), and "
+             "can't be pruned in diff mode or with --save-rollup",
+             max_memory);
+    }
+    return;
+  }
+
+  if (prune_threshold_ > 0) {
+    rollup->Prune(prune_threshold_);
+  }
+
+  int64_t old_threshold = prune_threshold_;
+  while (rollup_memory() > budget && prune_threshold_ < INT64_MAX / 2) {
+    prune_threshold_ = prune_threshold_ > 0 ? prune_threshold_ * 2 : 1;
+    rollup->Prune(prune_threshold_);
+  }
+
+  if (prune_threshold_ != old_threshold) {
+    fprintf(stderr,
+            "bloaty: results are using more than half of --max-memory, so "
+            "rows under %" PRId64 " bytes are merged into [Pruned]\n",
+            prune_threshold_);
+  }
+}
+
+// Finds archive members that are identical between the input and base files,
+// and replaces every file that has any with a copy that leaves them out.  Each
+// removed member's sizes go straight into the rollup (on its own side) under
+// "[Unchanged Members]", so the two sides still cancel out exactly.
+void Bloaty::PruneUnchangedMembers(Rollup* rollup) {
+  struct FileMembers {
+    std::unique_ptr<InputFile>* file;
+    bool is_base;
+    std::vector<ArchiveMember> members;
+    std::vector<bool> unchanged;
+  };
+
+  std::vector<FileMembers> files;
+  for (auto* list : {&input_files_, &base_files_}) {
+    for (auto& file : *list) {
+      FileMembers entry;
+      entry.file = &file;
+      entry.is_base = (list == &base_files_);
+      if (ReadArchiveMembers(*file, &entry.members)) {
+        entry.unchanged.resize(entry.members.size());
+        files.push_back(std::move(entry));
+      }
+    }
+  }
+
+  // Base members that haven't been paired up yet, by hash.
+  std::unordered_multimap<uint64_t, std::pair<FileMembers*, size_t>> base;
+  for (auto& entry : files) {
+    if (entry.is_base) {
+      for (size_t i = 0; i < entry.members.size(); i++) {
+        base.emplace(HashBytes(entry.members[i].contents),
+                     std::make_pair(&entry, i));
+      }
+    }
+  }
+
+  size_t pruned = 0;
+  for (auto& entry : files) {
+    if (entry.is_base) {
+      continue;
+    }
+
+    for (size_t i = 0; i < entry.members.size(); i++) {
+      const ArchiveMember& member = entry.members[i];
+      auto range = base.equal_range(HashBytes(member.contents));
+      for (auto it = range.first; it != range.second; ++it) {
+        FileMembers* base_entry = it->second.first;
+        const ArchiveMember& base_member =
+            base_entry->members[it->second.second];
+        if (base_member.filename == member.filename &&
+            base_member.contents == member.contents) {
+          entry.unchanged[i] = true;
+          base_entry->unchanged[it->second.second] = true;
+          base.erase(it);
+          pruned++;
+          break;
+        }
+      }
+    }
+  }
+
+  if (verbose_level > 0) {
+    fprintf(stderr, "Pruned %zu unchanged archive members.\n", pruned);
+  }
+
+  // Index 0 is the base map, which AddSizes() skips.
+  std::vector<std::string> names(GetSourceNames().size() + 1);
+
+  for (auto& entry : files) {
+    const InputFile& file = **entry.file;
+    string_view data = file.data();
+    std::string pruned_data;
+    const char* copied_to = data.data();
+
+    for (size_t i = 0; i < entry.members.size(); i++) {
+      if (!entry.unchanged[i]) {
+        continue;
+      }
+
+      const ArchiveMember& member = entry.members[i];
+      pruned_data.append(copied_to, member.extent.data() - copied_to);
+      copied_to = member.extent.data() + member.extent.size();
+
+      for (size_t j = 1; j < names.size(); j++) {
+        names[j] = "[Unchanged Members]";
+      }
+      rollup->AddSizes(names, member.extent.size(), false, entry.is_base);
+      rollup->AddSizes(names, member.vmsize, true, entry.is_base);
+    }
+
+    if (copied_to != data.data()) {
+      pruned_data.append(copied_to, data.data() + data.size() - copied_to);
+      entry.file->reset(
+          new StringInputFile(file.filename(), std::move(pruned_data)));
+    }
+  }
+}
+
+void Bloaty::ScanAndRollup(const Options& options, RollupOutput* output) {
   if (input_files_.empty()) {
     THROW("no filename specified");
   }
@@ -1579,26 +3132,166 @@ void Bloaty::ScanAndRollup(const Options& options, RollupOutput* output) {
     output->AddDataSourceName(source->definition.name);
   }
 
+  if (options.has_sample_file()) {
+    if (!base_files_.empty()) {
+      THROW("samples can't be used in diff mode");
+    } else if (input_files_.size() != 1) {
+      THROW("samples can only be given for one input file");
+    } else if (options.has_save_rollup()) {
+      THROW("samples can't be saved in a rollup snapshot");
+    }
+    StatsTimer timer("", "read samples");
+    ReadSamples(options.sample_file(), &vm_samples_, &file_samples_);
+    has_samples_ = true;
+    output->set_has_samples(true);
+  } else if (options.sort_by() == Options::SORTBY_SAMPLES) {
+    THROW("sorting by samples requires a sample file");
+  }
+
+  if (options.has_pid()) {
+    if (!base_files_.empty()) {
+      THROW("residency can't be used in diff mode");
+    } else if (input_files_.size() != 1) {
+      THROW("residency can only be given for one input file");
+    } else if (options.has_save_rollup()) {
+      THROW("residency can't be saved in a rollup snapshot");
+    }
+    StatsTimer timer("", "read residency");
+    ReadResidentRanges(options.pid(), *input_files_[0], &resident_);
+    has_resident_ = true;
+    output->set_has_resident(true);
+  } else if (options.sort_by() == Options::SORTBY_RESIDENT) {
+    THROW("sorting by resident bytes requires a pid");
+  }
+
   Rollup rollup;
 
+  // Unchanged members only cancel out if they get the same labels on both
+  // sides, which isn't the case with "inputfiles".  And a snapshot should have
+  // the full results for the input files.
+  if (options.prune_unchanged() && !base_files_.empty() &&
+      filename_position_ < 0 && !options.has_save_rollup()) {
+    StatsTimer timer("", "prune unchanged");
+    PruneUnchangedMembers(&rollup);
+  }
+
+  // Pruning a row before both of its sides are in would give it the wrong
+  // delta, and a snapshot has to be unpruned, so in those cases the results
+  // can't be pruned at all.
+  bool can_prune = base_files_.empty() && !options.has_save_rollup();
+
   for (const auto& file : input_files_) {
-    ScanAndRollupFile(*file, &rollup);
+    ScanAndRollupFile(*file, false, &rollup);
+    FitRollupInMemoryBudget(&rollup, can_prune);
   }
 
-  if (!base_files_.empty()) {
-    Rollup base;
+  // This has to happen before any base files are added to the rollup.
+  if (options.has_save_rollup()) {
+    std::string snapshot;
+    WriteRollupSnapshot(rollup, GetSnapshotSources(), &snapshot);
+    std::ofstream out(options.save_rollup(), std::ios::out | std::ios::binary);
+    out.write(snapshot.data(), snapshot.size());
+    if (!out) {
+      THROWF("couldn't write rollup snapshot to $0", options.save_rollup());
+    }
+  }
 
+  if (!base_files_.empty()) {
     for (const auto& base_file : base_files_) {
-      ScanAndRollupFile(*base_file, &base);
+      ScanAndRollupFile(*base_file, true, &rollup);
+      FitRollupInMemoryBudget(&rollup, can_prune);
     }
 
-    rollup.Subtract(base);
-    rollup.CreateDiffModeRollupOutput(&base, options, output);
+    StatsTimer timer("", "rows");
+    rollup.CreateDiffModeRollupOutput(options, output);
   } else {
+    StatsTimer timer("", "rows");
     rollup.CreateRollupOutput(options, output);
   }
 }
 
+void Bloaty::LookupAddresses(const std::vector<uint64_t>& addrs,
+                             const std::vector<bool>& file_offsets,
+                             std::ostream* out) {
+  if (input_files_.size() != 1 || !base_files_.empty()) {
+    THROW("looking up addresses takes exactly one file");
+  }
+
+  const InputFile& file = *input_files_[0];
+  const std::string& filename = file.filename();
+  if (IsRollupSnapshot(file.data())) {
+    THROWF("can't look up addresses in rollup snapshot '$0'", filename);
+  }
+
+  DualMaps maps;
+  ScanFile(file, &maps);
+
+  // Sorting the addresses lets each map be walked once for the whole batch,
+  // rather than searched once per address.  VM addresses and file offsets
+  // are looked up in different maps, so they're sorted separately.
+  StatsTimer timer(filename, "lookup");
+  std::vector<std::pair<uint64_t, size_t>> sorted[2];
+  for (size_t i = 0; i < addrs.size(); i++) {
+    sorted[file_offsets[i]].emplace_back(addrs[i], i);
+  }
+
+  // labels[i][j] is the label for source i of the j'th address.
+  std::vector<std::vector<const std::string*>> labels(sources_.size());
+  for (auto& column : labels) {
+    column.resize(addrs.size());
+  }
+
+  for (int file_offset = 0; file_offset < 2; file_offset++) {
+    auto& batch = sorted[file_offset];
+    std::sort(batch.begin(), batch.end(),
+              [](const std::pair<uint64_t, size_t>& a,
+                 const std::pair<uint64_t, size_t>& b) {
+                return a.first < b.first;
+              });
+    std::vector<uint64_t> sorted_addrs;
+    sorted_addrs.reserve(batch.size());
+    for (const auto& pair : batch) {
+      sorted_addrs.push_back(pair.first);
+    }
+
+    std::vector<std::vector<const std::string*>> batch_labels;
+    maps.LookupSorted(file_offset, sorted_addrs, &batch_labels);
+    for (size_t i = 0; i < sources_.size(); i++) {
+      for (size_t j = 0; j < batch.size(); j++) {
+        labels[i][batch[j].second] = batch_labels[i][j];
+      }
+    }
+  }
+
+  // Columns are in the same order as rollup levels, including "inputfiles".
+  const std::string none = "[None]";
+  OutputBuffer buf(out);
+  buf.Append("address");
+  for (const auto& name : GetSourceNames()) {
+    buf.Append(',');
+    buf.AppendCSVField(name);
+  }
+  buf.EndLine();
+
+  for (size_t j = 0; j < addrs.size(); j++) {
+    buf.Append(file_offsets[j] ? "file:0x" : "0x");
+    buf.AppendHex(addrs[j]);
+    for (size_t i = 0; i < sources_.size(); i++) {
+      if (static_cast<int>(i + 1) == filename_position_) {
+        buf.Append(',');
+        buf.AppendCSVField(filename);
+      }
+      buf.Append(',');
+      buf.AppendCSVField(labels[i][j] ? *labels[i][j] : none);
+    }
+    if (static_cast<int>(sources_.size() + 1) == filename_position_) {
+      buf.Append(',');
+      buf.AppendCSVField(filename);
+    }
+    buf.EndLine();
+  }
+}
+
 const char usage[] = R"(Bloaty McBloatface: a size profiler for binaries.
 
 USAGE: bloaty [options] file... [-- base_file...]
@@ -1606,6 +3299,13 @@ USAGE: bloaty [options] file... [-- base_file...]
 Options:
 
   --csv            Output in CSV format instead of human-readable.
+  --output-format=<format>
+                   Output format.  Possible values are:
+                     pretty (the default): human-readable.
+                     csv: same as --csv.
+                     proto: a serialized bloaty.Report message.
+                     proto-stream: a series of length-delimited
+                       bloaty.Report messages (see bloaty.proto).
   -c <file>        Load configuration from <file>.
   -d <sources>     Comma-separated list of sources to scan.
   -n <num>         How many rows to show per level before collapsing
@@ -1616,8 +3316,69 @@ Options:
                      -s vm
                      -s file
                      -s both (the default: sorts by max(vm, file)).
+                     -s samples (with --samples).
+                     -s resident (with --pid).
+  --prune-unchanged
+                   In diff mode, skip archive members that are identical
+                   in the input and base files.  Much faster when few
+                   members changed; sizes and deltas are unaffected, but
+                   percentages only count the members that were scanned.
+  --page-size=<size>
+                   The page size for the "pages" data source (default
+                   4096; a k, M or G suffix may be used, as in 2M).
+  --max-memory=<size>
+                   Keep Bloaty's own data structures under <size> bytes
+                   (a k, M or G suffix may be used).  Results that would
+                   go over half of it are pruned: rows under some size are
+                   merged into '[Pruned]' rows.  In diff mode or with
+                   --save-rollup, results can't be pruned, so going over
+                   half is an error.  Scanning a single file with more
+                   than the other half is an error too.
+  --batch <manifest>
+                   Instead of scanning the files on the command line,
+                   scan the ones on each line of <manifest>, which are
+                   given like "file... [-- base_file...] output_file".
+                   Each line's results are written to its output_file,
+                   and lines are run in parallel.  A line that fails is
+                   reported and doesn't stop the others.
+  --lookup <file>  Instead of a size profile, print the labels that each
+                   data source gives the addresses in <file> (or stdin if
+                   <file> is '-'), as CSV with one row per address.  Each
+                   line of <file> is a VM address, or a file offset if it
+                   starts with "file:", in hex if it starts with "0x".
+  --serve <socket> Instead of scanning files, answer requests on the Unix
+                   socket <socket> until killed.  Each request is a
+                   length-delimited bloaty.Options message, and each
+                   answer a length-delimited bloaty.ServeResponse (see
+                   bloaty.proto).  Files are kept open between requests.
+                   Requests can't use save_rollup or pid.
+  --samples <file> Weight the output by a profile of the input file.  Each
+                   line of <file> is an address (as for --lookup) and
+                   optionally a sample count (default 1).  Each row then
+                   also shows how many samples fell in it and how many of
+                   its bytes were hit by any sample.
+  --pid <pid>      Also show how many of each row's file bytes are
+                   resident in memory in the running process <pid>,
+                   which must have the (one) input file mapped.  Uses
+                   /proc/<pid>/pagemap, so Linux only.
+  --save-rollup <file>
+                   Save the unpruned results for the input files (not
+                   the base files) to <file>.  The saved file can be
+                   given in place of input or base files in later runs
+                   that use the same data sources, to diff or combine
+                   results without scanning the binaries again.
+  --stats[=<format>]
+                   After the output, print the time spent in each phase
+                   of each file, counts of the work done and the peak
+                   memory of each kind of data structure to stderr.
+                   <format> is pretty (the default) or csv, which prints
+                   one "kind,file,name,value" row per number.
+  --trace=<file>   Write a timeline of each file's phases to <file> as
+                   Chrome trace events (open it in chrome://tracing or
+                   Perfetto).  Requires building with tracing enabled.
   -v               Verbose output.  Dumps warnings encountered during
-                   processing and full VM/file maps at the end.
+                   processing, and full VM/file maps and memory use after
+                   each file.
                    Add more v's (-vv, -vvv) for even more.
   -w               Wide output; don't truncate long labels.
   --help           Display this message and exit.
@@ -1630,6 +3391,40 @@ void CheckNextArg(int i, int argc, const char *option) {
   }
 }
 
+// Parses a number of bytes with an optional k, M or G suffix, given for
+// |flag| (which is only used for errors).
+uint64_t ParseMemorySize(const char* flag, const char* str) {
+  // strtoull() would accept (and negate) a leading '-'.
+  if (!isdigit(static_cast<unsigned char>(*str))) {
+    THROWF("invalid size for $0: $1", flag, str);
+  }
+  char* end;
+  errno = 0;
+  uint64_t size = strtoull(str, &end, 10);
+  uint64_t multiplier = 1;
+  switch (*end) {
+    case 'k':
+    case 'K':
+      multiplier = 1 << 10;
+      end++;
+      break;
+    case 'm':
+    case 'M':
+      multiplier = 1 << 20;
+      end++;
+      break;
+    case 'g':
+    case 'G':
+      multiplier = 1 << 30;
+      end++;
+      break;
+  }
+  if (*end != '\0' || errno != 0 || size > UINT64_MAX / multiplier) {
+    THROWF("invalid size for $0: $1", flag, str);
+  }
+  return size * multiplier;
+}
+
 void Split(const std::string& str, char delim, std::vector<std::string>* out) {
   std::stringstream stream(str);
   std::string item;
@@ -1650,6 +3445,19 @@ bool DoParseOptions(int argc, char* argv[], Options* options,
       saw_separator = true;
     } else if (strcmp(argv[i], "--csv") == 0) {
       output_options->output_format = OutputFormat::kCSV;
+    } else if (strncmp(argv[i], "--output-format=", 16) == 0) {
+      const char* format = argv[i] + 16;
+      if (strcmp(format, "pretty") == 0) {
+        output_options->output_format = OutputFormat::kPrettyPrint;
+      } else if (strcmp(format, "csv") == 0) {
+        output_options->output_format = OutputFormat::kCSV;
+      } else if (strcmp(format, "proto") == 0) {
+        output_options->output_format = OutputFormat::kProto;
+      } else if (strcmp(format, "proto-stream") == 0) {
+        output_options->output_format = OutputFormat::kProtoStream;
+      } else {
+        THROWF("unknown value for --output-format: $0", format);
+      }
     } else if (strcmp(argv[i], "-c") == 0) {
       CheckNextArg(i, argc, "-c");
       std::string filename(argv[++i]);
@@ -1680,9 +3488,62 @@ bool DoParseOptions(int argc, char* argv[], Options* options,
         options->set_sort_by(Options::SORTBY_FILESIZE);
       } else if (strcmp(argv[i], "both") == 0) {
         options->set_sort_by(Options::SORTBY_BOTH);
+      } else if (strcmp(argv[i], "samples") == 0) {
+        options->set_sort_by(Options::SORTBY_SAMPLES);
+      } else if (strcmp(argv[i], "resident") == 0) {
+        options->set_sort_by(Options::SORTBY_RESIDENT);
       } else {
         THROWF("unknown value for -s: $0", argv[i]);
       }
+    } else if (strcmp(argv[i], "--prune-unchanged") == 0) {
+      options->set_prune_unchanged(true);
+    } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+      options->set_page_size(ParseMemorySize("--page-size", argv[i] + 12));
+    } else if (strncmp(argv[i], "--max-memory=", 13) == 0) {
+      options->set_max_memory(ParseMemorySize("--max-memory", argv[i] + 13));
+    } else if (strcmp(argv[i], "--samples") == 0) {
+      CheckNextArg(i, argc, "--samples");
+      options->set_sample_file(argv[++i]);
+    } else if (strcmp(argv[i], "--pid") == 0) {
+      CheckNextArg(i, argc, "--pid");
+      const char* pid = argv[++i];
+      char* end;
+      errno = 0;
+      long value = strtol(pid, &end, 10);
+      if (!isdigit(static_cast<unsigned char>(*pid)) || *end != '\0' ||
+          errno != 0 || value <= 0 || value > INT32_MAX) {
+        THROWF("invalid value for --pid: $0", pid);
+      }
+      options->set_pid(value);
+    } else if (strcmp(argv[i], "--save-rollup") == 0) {
+      CheckNextArg(i, argc, "--save-rollup");
+      options->set_save_rollup(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      CheckNextArg(i, argc, "--batch");
+      output_options->batch_manifest = argv[++i];
+    } else if (strcmp(argv[i], "--lookup") == 0) {
+      CheckNextArg(i, argc, "--lookup");
+      output_options->lookup_file = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      CheckNextArg(i, argc, "--serve");
+      output_options->serve_socket = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      output_options->stats_format = StatsFormat::kPretty;
+    } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+      const char* format = argv[i] + 8;
+      if (strcmp(format, "pretty") == 0) {
+        output_options->stats_format = StatsFormat::kPretty;
+      } else if (strcmp(format, "csv") == 0) {
+        output_options->stats_format = StatsFormat::kCSV;
+      } else {
+        THROWF("unknown value for --stats: $0", format);
+      }
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+#ifdef BLOATY_ENABLE_TRACING
+      output_options->trace_file = argv[i] + 8;
+#else
+      THROW("--trace requires building with BLOATY_ENABLE_TRACING");
+#endif
     } else if (strcmp(argv[i], "-v") == 0) {
       options->set_verbose_level(1);
     } else if (strcmp(argv[i], "-vv") == 0) {
@@ -1716,6 +3577,37 @@ bool DoParseOptions(int argc, char* argv[], Options* options,
     options->add_data_source("sections");
   }
 
+  // The server only listens; everything else comes from each request, and
+  // results go back to the client.
+  if (!output_options->serve_socket.empty()) {
+    if (options->filename_size() > 0 || options->base_filename_size() > 0) {
+      THROW("--serve doesn't take any files; each request names its own");
+    } else if (output_options->stats_format != StatsFormat::kNone) {
+      THROW("--stats can't be used with --serve");
+    } else if (!output_options->trace_file.empty()) {
+      THROW("--trace can't be used with --serve");
+    } else if (output_options->output_format != OutputFormat::kPrettyPrint) {
+      THROW("--serve doesn't print results; clients choose their own format");
+    } else if (!output_options->batch_manifest.empty()) {
+      THROW("--batch can't be used with --serve");
+    } else if (!output_options->lookup_file.empty()) {
+      THROW("--lookup can't be used with --serve");
+    }
+  }
+
+  if (!output_options->lookup_file.empty() &&
+      (options->filename_size() != 1 || options->base_filename_size() > 0)) {
+    THROW("--lookup takes exactly one file");
+  }
+
+  if (!output_options->batch_manifest.empty()) {
+    if (options->filename_size() > 0 || options->base_filename_size() > 0) {
+      THROW("--batch doesn't take any files; the manifest lists them");
+    } else if (output_options->stats_format != StatsFormat::kNone) {
+      THROW("--stats can't be used with --batch");
+    }
+  }
+
   return true;
 }
 
@@ -1729,43 +3621,55 @@ bool ParseOptions(int argc, char* argv[], Options* options,
   }
 }
 
-void BloatyDoMain(const Options& options, const InputFileFactory& file_factory,
-                  RollupOutput* output) {
-  bloaty::Bloaty bloaty(file_factory);
-
+// Gives |bloaty| the files, sources and settings from |options|.
+static void ConfigureBloaty(const Options& options, Bloaty* bloaty) {
   if (options.filename_size() == 0) {
     THROW("must specify at least one file");
   }
 
-  if (options.max_rows_per_level() < 1) {
-    THROW("max_rows_per_level must be at least 1");
+  if (options.max_rows_per_level() < 0) {
+    THROW("max_rows_per_level must be non-negative");
+  }
+
+  if (options.page_size() == 0) {
+    THROW("page_size must be positive");
   }
+  bloaty->SetPageSize(options.page_size());
 
   for (auto& filename : options.filename()) {
-    bloaty.AddFilename(filename, false);
+    bloaty->AddFilename(filename, false);
   }
 
   for (auto& base_filename : options.base_filename()) {
-    bloaty.AddFilename(base_filename, true);
+    bloaty->AddFilename(base_filename, true);
   }
 
   for (const auto& custom_data_source : options.custom_data_source()) {
-    bloaty.DefineCustomDataSource(custom_data_source);
+    bloaty->DefineCustomDataSource(custom_data_source);
   }
 
   for (const auto& data_source : options.data_source()) {
-    bloaty.AddDataSource(data_source);
+    bloaty->AddDataSource(data_source);
   }
 
   verbose_level = options.verbose_level();
+  max_memory = options.max_memory();
+}
 
+void BloatyDoMain(const Options& options, const InputFileFactory& file_factory,
+                  Demangler* demangler, MungerCache* munger_cache,
+                  RollupOutput* output) {
+  ResetStats();
+  bloaty::Bloaty bloaty(file_factory, demangler, munger_cache);
+  ConfigureBloaty(options, &bloaty);
   bloaty.ScanAndRollup(options, output);
 }
 
 bool BloatyMain(const Options& options, const InputFileFactory& file_factory,
                 RollupOutput* output, std::string* error) {
   try {
-    BloatyDoMain(options, file_factory, output);
+    Demangler demangler;
+    BloatyDoMain(options, file_factory, &demangler, nullptr, output);
     return true;
   } catch (const bloaty::Error& e) {
     error->assign(e.what());
@@ -1773,4 +3677,491 @@ bool BloatyMain(const Options& options, const InputFileFactory& file_factory,
   }
 }
 
+static void DoLookupAddresses(const Options& options,
+                              const InputFileFactory& file_factory,
+                              std::istream* in, std::ostream* out) {
+  ResetStats();
+  Demangler demangler;
+  bloaty::Bloaty bloaty(file_factory, &demangler, nullptr);
+  ConfigureBloaty(options, &bloaty);
+
+  std::vector<uint64_t> addrs;
+  std::vector<bool> file_offsets;
+  std::string line;
+  for (int line_number = 1; std::getline(*in, line); line_number++) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+      continue;
+    }
+    line.resize(line.find_last_not_of(" \t\r") + 1);
+    const char* str = line.c_str() + start;
+    uint64_t addr;
+    bool file_offset;
+    if (!ParseAddress(str, &addr, &file_offset)) {
+      THROWF("line $0: invalid address: $1", line_number, str);
+    }
+    addrs.push_back(addr);
+    file_offsets.push_back(file_offset);
+  }
+
+  bloaty.LookupAddresses(addrs, file_offsets, out);
+}
+
+bool LookupAddresses(const Options& options,
+                     const InputFileFactory& file_factory, std::istream* in,
+                     std::ostream* out, std::string* error) {
+  try {
+    DoLookupAddresses(options, file_factory, in, out);
+    return true;
+  } catch (const bloaty::Error& e) {
+    error->assign(e.what());
+    return false;
+  }
+}
+
+Session::Session(const InputFileFactory& file_factory)
+    : file_factory_(file_factory) {}
+
+Session::~Session() {}
+
+bool Session::Analyze(const Options& options, RollupOutput* output,
+                      std::string* error) {
+  try {
+    BloatyDoMain(options, file_factory_, &demangler_, &munger_cache_, output);
+    return true;
+  } catch (const bloaty::Error& e) {
+    error->assign(e.what());
+    return false;
+  }
+}
+
+bool Session::Analyze(const Options& options, Report* report,
+                      std::string* error) {
+  RollupOutput output;
+  if (!Analyze(options, &output, error)) {
+    return false;
+  }
+  output.ToProto(report);
+  return true;
+}
+
+// Batch mode //////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct BatchEntry {
+  int line;
+  std::vector<std::string> filenames;
+  std::vector<std::string> base_filenames;
+  std::string output_filename;
+};
+
+}  // namespace
+
+// Parses one line of a --batch manifest, returning false (with "error" set)
+// if it's malformed.
+static bool ParseBatchEntry(const std::string& line, BatchEntry* entry,
+                            std::string* error) {
+  std::istringstream words(line);
+  std::vector<std::string> files;
+  std::string word;
+  bool saw_separator = false;
+
+  while (words >> word) {
+    if (word == "--") {
+      saw_separator = true;
+    } else if (saw_separator) {
+      entry->base_filenames.push_back(word);
+    } else {
+      entry->filenames.push_back(word);
+    }
+  }
+
+  // The last word is the output file.
+  auto* last = saw_separator ? &entry->base_filenames : &entry->filenames;
+  if (!last->empty()) {
+    entry->output_filename = last->back();
+    last->pop_back();
+  }
+
+  if (entry->filenames.empty() || entry->output_filename.empty() ||
+      (saw_separator && entry->base_filenames.empty())) {
+    *error = "expected \"file... [-- base_file...] output_file\"";
+    return false;
+  }
+  return true;
+}
+
+bool RunBatch(const std::string& manifest, const Options& options,
+              const OutputOptions& output_options,
+              const InputFileFactory& file_factory, int threads,
+              std::string* error) {
+  // Every entry would write the same snapshot.
+  if (options.has_save_rollup()) {
+    *error = "--save-rollup can't be used with --batch";
+    return false;
+  }
+
+  std::ifstream in(manifest);
+  if (!in) {
+    *error = absl::Substitute("couldn't open manifest $0: $1", manifest,
+                              strerror(errno));
+    return false;
+  }
+
+  std::vector<BatchEntry> entries;
+  std::atomic<int> failed(0);
+  int malformed = 0;
+  std::string line;
+  int line_number = 0;
+
+  auto report = [&](int entry_line, const std::string& message) {
+    fprintf(stderr, "bloaty: %s:%d: %s\n", manifest.c_str(), entry_line,
+            message.c_str());
+    failed++;
+  };
+
+  while (std::getline(in, line)) {
+    line_number++;
+    if (line.find_first_not_of(" \t") == std::string::npos || line[0] == '#') {
+      continue;
+    }
+    BatchEntry entry;
+    std::string parse_error;
+    entry.line = line_number;
+    if (ParseBatchEntry(line, &entry, &parse_error)) {
+      entries.push_back(std::move(entry));
+    } else {
+      report(line_number, parse_error);
+      malformed++;
+    }
+  }
+
+  // Each thread takes the next entry as it finishes the last one.  Entries'
+  // files are closed (and unmapped) as soon as they're done, so memory only
+  // depends on the entries in progress.
+  std::atomic<size_t> next(0);
+  auto work = [&] {
+    Session session(file_factory);
+    for (size_t i = next++; i < entries.size(); i = next++) {
+      const BatchEntry& entry = entries[i];
+      Options entry_options = options;
+      for (const auto& filename : entry.filenames) {
+        entry_options.add_filename(filename);
+      }
+      for (const auto& filename : entry.base_filenames) {
+        entry_options.add_base_filename(filename);
+      }
+
+      RollupOutput output;
+      std::string entry_error;
+      if (!session.Analyze(entry_options, &output, &entry_error)) {
+        report(entry.line, entry_error);
+        continue;
+      }
+
+      std::ofstream out(entry.output_filename,
+                        std::ios::out | std::ios::binary);
+      output.Print(output_options, &out);
+      out.close();
+      if (!out) {
+        report(entry.line, "couldn't write " + entry.output_filename);
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  if (failed > 0) {
+    *error = absl::Substitute("$0 of $1 entries in $2 failed", failed.load(),
+                              entries.size() + malformed, manifest);
+    return false;
+  }
+  return true;
+}
+
+
+// Server //////////////////////////////////////////////////////////////////////
+
+static bool MakeSocketAddress(const std::string& path, struct sockaddr_un* addr,
+                              std::string* error) {
+  if (path.size() >= sizeof(addr->sun_path)) {
+    *error = "socket path is too long: " + path;
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// A worker could be starting c++filt at any moment, and if that inherited a
+// connection, the other end's hangup would never be seen.  So sockets are
+// marked close-on-exec atomically where we can.
+static int CreateSocket() {
+#ifdef SOCK_CLOEXEC
+  return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    SetCloseOnExec(fd);
+  }
+  return fd;
+#endif
+}
+
+static int AcceptConnection(int listen_fd) {
+#ifdef SOCK_CLOEXEC
+  return accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  int fd = accept(listen_fd, nullptr, nullptr);
+  if (fd >= 0) {
+    SetCloseOnExec(fd);
+  }
+  return fd;
+#endif
+}
+
+Server::Server(int threads, size_t cached_files)
+    : file_factory_(mmap_factory_, cached_files),
+      threads_(std::max(threads, 1)) {}
+
+Server::~Server() {
+  for (int fd : {listen_fd_, wake_fds_[0], wake_fds_[1]}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (!socket_path_.empty()) {
+    unlink(socket_path_.c_str());
+  }
+}
+
+bool Server::Listen(const std::string& socket_path, std::string* error) {
+  struct sockaddr_un addr;
+  if (!MakeSocketAddress(socket_path, &addr, error)) {
+    return false;
+  }
+
+  // A socket left behind by an earlier server is replaced, but nothing else
+  // at the path is.
+  struct stat st;
+  if (lstat(socket_path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      *error = absl::Substitute(
+          "couldn't listen on $0: address in use by something other than a "
+          "socket", socket_path);
+      return false;
+    }
+    unlink(socket_path.c_str());
+  }
+
+  listen_fd_ = CreateSocket();
+  if (listen_fd_ < 0 || pipe(wake_fds_) < 0) {
+    *error = absl::Substitute("couldn't create socket: $0", strerror(errno));
+    return false;
+  }
+  SetCloseOnExec(wake_fds_[0]);
+  SetCloseOnExec(wake_fds_[1]);
+
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) < 0 ||
+      listen(listen_fd_, SOMAXCONN) < 0) {
+    *error = absl::Substitute("couldn't listen on $0: $1", socket_path,
+                              strerror(errno));
+    return false;
+  }
+  socket_path_ = socket_path;
+
+  // A client that hangs up before its answer is written shouldn't take the
+  // whole server down.
+  signal(SIGPIPE, SIG_IGN);
+  return true;
+}
+
+void Server::Run() {
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads_; i++) {
+    workers.emplace_back(&Server::Work, this);
+  }
+
+  while (true) {
+    struct pollfd fds[2];
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds_[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "bloaty: error calling poll(): %s\n", strerror(errno));
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      break;
+    } else if (fds[0].revents == 0) {
+      continue;
+    }
+
+    int fd = AcceptConnection(listen_fd_);
+    if (fd < 0) {
+      continue;
+    }
+
+    // Queueing more than one connection per worker would only move the wait
+    // from the kernel's backlog to ours.
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return stopping_ || pending_.size() < threads_; });
+    if (stopping_) {
+      close(fd);
+      break;
+    }
+    pending_.push_back(fd);
+    cv_.notify_all();
+  }
+
+  Stop();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (int fd : pending_) {
+    close(fd);
+  }
+  pending_.clear();
+}
+
+void Server::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stopping_) {
+    return;
+  }
+  stopping_ = true;
+
+  // Workers waiting for a request notice this as the end of the connection.
+  for (int fd : connections_) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  cv_.notify_all();
+
+  char ch = 0;
+  if (write(wake_fds_[1], &ch, 1) < 0) {
+    fprintf(stderr, "bloaty: error calling write(): %s\n", strerror(errno));
+  }
+}
+
+void Server::Work() {
+  Session session(file_factory_);
+
+  while (true) {
+    int fd;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      fd = pending_.front();
+      pending_.pop_front();
+      connections_.insert(fd);
+      cv_.notify_all();
+    }
+
+    ServeConnection(&session, fd);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      connections_.erase(fd);
+    }
+    close(fd);
+  }
+}
+
+void Server::ServeConnection(Session* session, int fd) {
+  google::protobuf::io::FileInputStream in(fd);
+  google::protobuf::io::FileOutputStream out(fd);
+  Options options;
+
+  while (ReadDelimited(&in, &options)) {
+    if (options.data_source_size() == 0) {
+      options.add_data_source("sections");
+    }
+
+    // Any process that can connect can send a request, so it mustn't be able
+    // to make the server write files or read another process's pagemap.
+    ServeResponse response;
+    std::string error;
+    if (options.has_save_rollup() || options.has_pid()) {
+      response.set_error("save_rollup and pid can't be used through a server");
+    } else if (!session->Analyze(options, response.mutable_report(), &error)) {
+      response.clear_report();
+      response.set_error(error);
+    }
+
+    {
+      google::protobuf::io::CodedOutputStream stream(&out);
+      if (!WriteDelimited(response, &stream)) {
+        response.clear_report();
+        response.set_error("report is too large to send");
+        WriteDelimited(response, &stream);
+      }
+    }
+    if (!out.Flush()) {
+      return;
+    }
+  }
+}
+
+bool QueryServer(const std::string& socket_path, const Options& options,
+                 RollupOutput* output, std::string* error) {
+  struct sockaddr_un addr;
+  if (!MakeSocketAddress(socket_path, &addr, error)) {
+    return false;
+  }
+
+  FileDescriptor fd(CreateSocket());
+  if (fd.fd() < 0 ||
+      connect(fd.fd(), reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) < 0) {
+    *error = absl::Substitute("couldn't connect to $0: $1", socket_path,
+                              strerror(errno));
+    return false;
+  }
+
+  google::protobuf::io::FileOutputStream out(fd.fd());
+  {
+    google::protobuf::io::CodedOutputStream stream(&out);
+    if (!WriteDelimited(options, &stream)) {
+      *error = "options are too large to send";
+      return false;
+    }
+  }
+  if (!out.Flush()) {
+    *error = absl::Substitute("couldn't write to $0: $1", socket_path,
+                              strerror(out.GetErrno()));
+    return false;
+  }
+
+  google::protobuf::io::FileInputStream in(fd.fd());
+  ServeResponse response;
+  if (!ReadDelimited(&in, &response)) {
+    *error = "no answer from server at " + socket_path;
+    return false;
+  } else if (response.has_error()) {
+    *error = response.error();
+    return false;
+  }
+
+  output->FromProto(response.report());
+  return true;
+}
+
 }  // namespace bloaty
@@ -23,9 +23,17 @@
 #define __STDC_LIMIT_MACROS
 #include <stdint.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -51,9 +59,11 @@
 
 namespace bloaty {
 
-class DualMap;
+struct DualMap;
+class Demangler;
 class NameMunger;
 class Options;
+class Report;
 
 enum class DataSource {
   kArchiveMembers,
@@ -61,11 +71,15 @@ enum class DataSource {
   kCppSymbolsStripped,
   kCompileUnits,
   kInlines,
+  kPages,
   kSections,
   kSegments,
   kSymbols,
 };
 
+// The name of a built-in data source, like "symbols".
+const char* GetDataSourceLabel(DataSource source);
+
 class Error : public std::runtime_error {
  public:
   Error(const char* msg, const char* file, int line)
@@ -112,6 +126,32 @@ class MmapInputFileFactory : public InputFileFactory {
       const std::string& filename) const override;
 };
 
+// Keeps the last "max_files" files opened through another factory open, so
+// opening one again costs nothing (not even page faults) as long as it hasn't
+// changed.  Files are identified by path, device, inode, size and mtime.  Safe
+// to use from several threads at once.
+class CachingInputFileFactory : public InputFileFactory {
+ public:
+  CachingInputFileFactory(const InputFileFactory& factory, size_t max_files)
+      : factory_(factory), max_files_(max_files) {}
+
+  std::unique_ptr<InputFile> OpenFile(
+      const std::string& filename) const override;
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(CachingInputFileFactory);
+
+  typedef std::tuple<std::string, uint64_t, uint64_t, int64_t, int64_t,
+                     int64_t>
+      Key;
+
+  const InputFileFactory& factory_;
+  size_t max_files_;
+  mutable std::mutex mutex_;
+  // Most recently opened first.
+  mutable std::list<std::pair<Key, std::shared_ptr<InputFile>>> files_;
+};
+
 // NOTE: all sizes are uint64, even on 32-bit platforms:
 //   - 32-bit platforms can have files >4GB in some cases.
 //   - for object files (not executables/shared libs) we pack both a section
@@ -196,13 +236,100 @@ class FileHandler {
   // Process this file, pushing data to |sinks| as appropriate for each data
   // source.
   virtual void ProcessFile(const std::vector<RangeSink*>& sinks) = 0;
+
+  // Whether |file|'s VM addresses are real addresses, which the "pages" data
+  // source can group into pages.
+  virtual bool HasVMAddresses(const InputFile& /* file */) const {
+    return true;
+  }
 };
 
-std::unique_ptr<FileHandler> TryOpenELFFile(const InputFile& file);
+std::unique_ptr<FileHandler> TryOpenELFFile(const InputFile& file,
+                                            const InputFileFactory& file_factory,
+                                            Demangler* demangler);
 std::unique_ptr<FileHandler> TryOpenMachOFile(const InputFile& file);
 
+// A regular member of a .a file.  In diff mode we use these to find members
+// that are identical between the input and base files, so we can skip them.
+struct ArchiveMember {
+  absl::string_view filename;
+  absl::string_view contents;
+  absl::string_view extent;  // The member's header and contents.
+  uint64_t vmsize;           // Sum of its SHF_ALLOC sections, if ELF.
+};
+
+// If |file| is a .a file, fills |members| with its regular members in order
+// and returns true.
+bool ReadArchiveMembers(const InputFile& file,
+                        std::vector<ArchiveMember>* members);
+
+// The structures whose memory we count, for --stats and --max-memory.
+enum class MemoryUse {
+  kRangeMaps,     // RangeMap entries, not counting their labels.
+  kLabels,        // The labels of RangeMap entries.
+  kRollups,       // Rollup nodes, including their names.
+  kSymbolTables,  // SymbolTables.
+  kDwarf,         // Abbreviation tables and ActionBufs.
+};
+
+const int kNumMemoryUses = 5;
+
+// Adds |bytes| (negative when memory is freed) to the count for |use|.
+void CountMemory(MemoryUse use, int64_t bytes);
+
+// How much heap |str| uses, or 0 if it is short enough to live inline.
+size_t StringHeapBytes(const std::string& str);
+
+// An allocator that counts what it allocates under |kUse|.  Containers that
+// use it are counted without any bookkeeping at the places that fill them.
+template <class T, MemoryUse kUse>
+class CountingAllocator {
+ public:
+  typedef T value_type;
+
+  template <class U>
+  struct rebind {
+    typedef CountingAllocator<U, kUse> other;
+  };
+
+  CountingAllocator() {}
+  template <class U>
+  CountingAllocator(const CountingAllocator<U, kUse>&) {}
+
+  T* allocate(size_t n) {
+    CountMemory(kUse, n * sizeof(T));
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    CountMemory(kUse, -static_cast<int64_t>(n * sizeof(T)));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <class U>
+  bool operator==(const CountingAllocator<U, kUse>&) const { return true; }
+  template <class U>
+  bool operator!=(const CountingAllocator<U, kUse>&) const { return false; }
+};
+
 namespace dwarf {
 
+struct File;
+
+// With split DWARF (-gsplit-dwarf), the main binary only contains skeleton
+// units, and the DIEs themselves live in .dwo files or a .dwp package.  Object
+// file modules implement this to find and open them.
+class SplitDwarfLoader {
+ public:
+  virtual ~SplitDwarfLoader() {}
+
+  // Returns the split DWARF for the skeleton unit with this dwo id, or nullptr
+  // if it could not be found.  The returned File must remain valid for the
+  // lifetime of the loader.
+  virtual const File* GetSplitUnit(uint64_t dwo_id, absl::string_view comp_dir,
+                                   absl::string_view dwo_name) = 0;
+};
+
 struct File {
   absl::string_view debug_info;
   absl::string_view debug_types;
@@ -210,11 +337,43 @@ struct File {
   absl::string_view debug_abbrev;
   absl::string_view debug_aranges;
   absl::string_view debug_line;
+  absl::string_view debug_ranges;
+
+  // DWARF 5 only.
+  absl::string_view debug_str_offsets;
+  absl::string_view debug_addr;
+  absl::string_view debug_rnglists;
+  absl::string_view debug_line_str;
+
+  // Name indexes.  Either may be present, and are optional.
+  absl::string_view debug_names;
+  absl::string_view gdb_index;
+
+  // Only in .dwp packages.
+  absl::string_view debug_cu_index;
+
+  // If set, skeleton units are resolved to their split units with this.
+  SplitDwarfLoader* split_loader = nullptr;
 };
 
+// Provided by dwarf.cc.  Reads a LEB128 value from the front of |data| and
+// removes it.  Only exposed here for benchmarking.
+uint64_t ReadLEB128Internal(bool is_signed, absl::string_view* data);
+
+// Provided by dwarf.cc.  Reads the .debug_cu_index of a .dwp package, adding a
+// File for each unit in the package (keyed by dwo id) whose sections are just
+// that unit's contributions.
+void ReadDWPUnits(const File& dwp, std::unordered_map<uint64_t, File>* units);
+
 }  // namespace dwarf
 
-typedef std::map<absl::string_view, std::pair<uint64_t, uint64_t>> SymbolTable;
+typedef std::map<
+    absl::string_view, std::pair<uint64_t, uint64_t>,
+    std::less<absl::string_view>,
+    CountingAllocator<
+        std::pair<const absl::string_view, std::pair<uint64_t, uint64_t>>,
+        MemoryUse::kSymbolTables>>
+    SymbolTable;
 
 // Provided by dwarf.cc.  To use these, a module should fill in a dwarf::File
 // and then call these functions.
@@ -223,6 +382,13 @@ void ReadDWARFCompileUnits(const dwarf::File& file, const SymbolTable& symtab,
 void ReadDWARFInlines(const dwarf::File& file, RangeSink* sink,
                       bool include_line);
 
+// Like calling both of the above (with include_line=true), but only makes one
+// pass over the DWARF units.
+void ReadDWARFCompileUnitsAndInlines(const dwarf::File& file,
+                                     const SymbolTable& symtab,
+                                     RangeSink* compileunits_sink,
+                                     RangeSink* inlines_sink);
+
 
 // LineReader //////////////////////////////////////////////////////////////////
 
@@ -323,6 +489,10 @@ inline absl::string_view StripName(absl::string_view name) {
 //
 // We can't use LineReader or popen() because we need to both read and write to
 // the subprocess.  So we need to roll our own.
+//
+// The subprocess is only started by the first call to Demangle(), and results
+// are cached, so one Demangler can be shared by every file in a run (or in a
+// Session).
 
 class Demangler {
  public:
@@ -334,9 +504,154 @@ class Demangler {
  private:
   BLOATY_DISALLOW_COPY_AND_ASSIGN(Demangler);
 
+  void Start();
+
   FILE* write_file_;
   std::unique_ptr<LineReader> reader_;
   pid_t child_pid_;
+  std::unordered_map<std::string, std::string> cache_;
+};
+
+
+// Tracing /////////////////////////////////////////////////////////////////////
+
+// Scoped spans for --trace, which are written out as Chrome trace events (for
+// chrome://tracing or Perfetto).  With tracing off at runtime a span costs one
+// branch; without BLOATY_ENABLE_TRACING, BLOATY_TRACE_SPAN() compiles to
+// nothing.
+
+#ifdef BLOATY_ENABLE_TRACING
+
+extern bool trace_enabled;
+
+class TraceSpan {
+ public:
+  TraceSpan(absl::string_view name, absl::string_view file) : active_(false) {
+    if (trace_enabled) Begin(name, file);
+  }
+  ~TraceSpan() {
+    if (active_) End();
+  }
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(TraceSpan);
+
+  void Begin(absl::string_view name, absl::string_view file);
+  void End();
+
+  bool active_;
+  std::string name_;
+  std::string file_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define BLOATY_TRACE_CONCAT2(a, b) a##b
+#define BLOATY_TRACE_CONCAT(a, b) BLOATY_TRACE_CONCAT2(a, b)
+
+// Traces the rest of the enclosing scope as a span called |name|, which was
+// spent on input file |file| (or "" if it wasn't any one file).
+#define BLOATY_TRACE_SPAN(name, file)                                  \
+  ::bloaty::TraceSpan BLOATY_TRACE_CONCAT(bloaty_trace_span_, __LINE__)( \
+      name, file)
+
+#else
+
+#define BLOATY_TRACE_SPAN(name, file) do {} while (false)
+
+#endif  // BLOATY_ENABLE_TRACING
+
+// Starts recording spans.  Does nothing if Bloaty was built without tracing,
+// which ParseOptions() already rejects --trace for.
+void StartTrace();
+
+// Writes the spans recorded since StartTrace() to |filename| as JSON, returning
+// false if the file couldn't be written.
+bool WriteTrace(const std::string& filename);
+
+
+// Stats ///////////////////////////////////////////////////////////////////////
+
+// Counters and phase timings for --stats.  The counters are always collected;
+// they are plain integers bumped from the parsers, which costs next to nothing
+// next to the work they count.
+
+struct Stats {
+  uint64_t ranges_added = 0;
+  uint64_t overlaps_trimmed = 0;
+  uint64_t map_iterations = 0;  // Steps over RangeMap entries.
+  uint64_t dies_decoded = 0;
+  uint64_t leb128_reads = 0;
+  uint64_t abbrev_tables_built = 0;
+  uint64_t demangle_calls = 0;
+  uint64_t munge_calls = 0;
+
+  // Bytes allocated now and at most, indexed by MemoryUse (see
+  // CountMemory()).
+  int64_t memory_in_use[kNumMemoryUses] = {};
+  int64_t memory_peak[kNumMemoryUses] = {};
+  int64_t total_memory_in_use = 0;
+
+  // The work done in the parsers and maps, which should grow linearly with the
+  // size of the input.  tests/fuzz_target.cc fails inputs where it doesn't.
+  uint64_t WorkUnits() const {
+    return map_iterations + dies_decoded + leb128_reads;
+  }
+};
+
+// Per thread, like the rest of a run's state.
+extern thread_local Stats stats;
+
+// Adds the wall and CPU time between its construction and destruction to the
+// timings for |phase| of |file|.  Phases that aren't tied to any one file use
+// an empty |file|.  Each phase is also a trace span.
+class StatsTimer {
+ public:
+  StatsTimer(absl::string_view file, absl::string_view phase);
+  ~StatsTimer();
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(StatsTimer);
+
+  std::string file_;
+  std::string phase_;
+  std::chrono::steady_clock::time_point wall_start_;
+  std::clock_t cpu_start_;
+#ifdef BLOATY_ENABLE_TRACING
+  TraceSpan span_;
+#endif
+};
+
+enum class StatsFormat {
+  kNone,
+  kPretty,
+  kCSV,  // One "kind,file,name,value" row per number, for tracking over time.
+};
+
+// Clears all counters and timings.  BloatyMain() calls this when it starts.
+void ResetStats();
+
+void PrintStats(StatsFormat format, std::ostream* out);
+
+
+// NameMunger //////////////////////////////////////////////////////////////////
+
+// Use to transform input names according to the user's configuration.
+// For example, the user can use regexes.
+class NameMunger {
+ public:
+  NameMunger() {}
+
+  // Adds a regex that will be applied to all names.  All regexes will be
+  // applied in sequence.
+  void AddRegex(const std::string& regex, const std::string& replacement);
+
+  std::string Munge(absl::string_view name) const;
+
+  bool IsEmpty() const { return regexes_.empty(); }
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(NameMunger);
+  std::vector<std::pair<std::unique_ptr<RE2>, std::string>> regexes_;
 };
 
 
@@ -385,6 +700,19 @@ class RangeMap {
   // successful.
   bool Translate(uint64_t addr, uint64_t *translated) const;
 
+  // Sets (*labels)[i] to the label of the range containing |sorted_addrs[i]|,
+  // or to NULL if there is none.  The addresses must be sorted; this walks the
+  // map alongside them instead of searching it for each one.  The labels are
+  // owned by this map.
+  void LookupSorted(const std::vector<uint64_t>& sorted_addrs,
+                    std::vector<const std::string*>* labels) const;
+
+  // Calls |func| with the labels from each of |range_maps| for every range
+  // over which none of them change.  Outside bloaty.cc, only Func=RollupFunc
+  // is available.
+  typedef std::function<void(const std::vector<std::string>&, uint64_t,
+                             uint64_t)>
+      RollupFunc;
   template <class Func>
   static void ComputeRollup(const std::vector<const RangeMap*>& range_maps,
                             const std::string& filename, int filename_position,
@@ -397,15 +725,43 @@ class RangeMap {
 
   struct Entry {
     Entry(const std::string& label_, uint64_t end_, uint64_t other_)
-        : label(label_), end(end_), other_start(other_) {}
+        : label(label_), end(end_), other_start(other_), covered_end(end_) {
+      CountMemory(MemoryUse::kLabels, StringHeapBytes(label));
+    }
+    Entry(const Entry& other)
+        : label(other.label),
+          end(other.end),
+          other_start(other.other_start),
+          covered_end(other.covered_end) {
+      CountMemory(MemoryUse::kLabels, StringHeapBytes(label));
+    }
+    // The moved-from label is left empty, so it has nothing left to count.
+    Entry(Entry&& other)
+        : label(std::move(other.label)),
+          end(other.end),
+          other_start(other.other_start),
+          covered_end(other.covered_end) {}
+    ~Entry() {
+      CountMemory(MemoryUse::kLabels,
+                  -static_cast<int64_t>(StringHeapBytes(label)));
+    }
+
     std::string label;
     uint64_t end;
     uint64_t other_start;  // UINT64_MAX if there is no mapping.
 
+    // [start, covered_end) is known to be covered by this entry and the ones
+    // after it with no gaps.  Ranges are never removed, so this only grows; it
+    // lets AddDualRange() skip over long runs of existing entries.
+    uint64_t covered_end;
+
     bool HasTranslation() const { return other_start != UINT64_MAX; }
   };
 
-  typedef std::map<uint64_t, Entry> Map;
+  typedef std::map<uint64_t, Entry, std::less<uint64_t>,
+                   CountingAllocator<std::pair<const uint64_t, Entry>,
+                                     MemoryUse::kRangeMaps>>
+      Map;
   Map mappings_;
 
   template <class T>
@@ -433,6 +789,7 @@ class RangeMap {
   // mappings_.end().
   Map::iterator FindContaining(uint64_t addr);
   Map::const_iterator FindContaining(uint64_t addr) const;
+  Map::iterator FindContainingOrAfter(uint64_t addr);
   Map::const_iterator FindContainingOrAfter(uint64_t addr) const;
 
   Entry* TryGet(uint64_t addr, uint64_t* start, uint64_t* size) const;
@@ -440,10 +797,22 @@ class RangeMap {
 };
 
 
+// DualMap /////////////////////////////////////////////////////////////////////
+
+// Contains a RangeMap for VM space and file space for a given file.
+
+struct DualMap {
+  RangeMap vm_map;
+  RangeMap file_map;
+};
+
+
 // Top-level API ///////////////////////////////////////////////////////////////
 
-// This should only be used by main.cc and unit tests.
+// This should only be used by main.cc, unit tests, and programs that embed
+// Bloaty through Session.
 
+class OutputBuffer;
 class Rollup;
 
 struct RollupRow {
@@ -454,6 +823,9 @@ struct RollupRow {
   int64_t filesize = 0;
   double vmpercent;
   double filepercent;
+  int64_t samples = 0;    // Only with Options.sample_file.
+  int64_t hot_bytes = 0;  // Likewise.
+  int64_t resident = 0;   // Only with Options.pid.
   std::vector<RollupRow> sorted_children;
   std::vector<RollupRow> shrinking;
   std::vector<RollupRow> mixed;
@@ -470,11 +842,18 @@ struct RollupRow {
 enum class OutputFormat {
   kPrettyPrint,
   kCSV,
+  kProto,        // A single serialized Report (see bloaty.proto).
+  kProtoStream,  // A series of length-delimited Report messages.
 };
 
 struct OutputOptions {
   OutputFormat output_format = OutputFormat::kPrettyPrint;
   size_t max_label_len = 80;
+  StatsFormat stats_format = StatsFormat::kNone;
+  std::string trace_file;      // Empty if not tracing.
+  std::string serve_socket;    // Empty unless --serve was given.
+  std::string batch_manifest;  // Empty unless --batch was given.
+  std::string lookup_file;     // Empty unless --lookup was given.
 };
 
 struct RollupOutput {
@@ -486,6 +865,19 @@ struct RollupOutput {
     source_names_.emplace_back(std::string(name));
   }
 
+  // Whether rows have samples and hot bytes, which are then printed.
+  bool has_samples() const { return has_samples_; }
+  void set_has_samples(bool has_samples) { has_samples_ = has_samples; }
+
+  // Whether rows have resident bytes, which are then printed.
+  bool has_resident() const { return has_resident_; }
+  void set_has_resident(bool has_resident) { has_resident_ = has_resident; }
+
+  // Converts to/from the Report message in bloaty.proto.  FromProto() replaces
+  // any existing contents.
+  void ToProto(Report* report) const;
+  void FromProto(const Report& report);
+
   void Print(const OutputOptions& options, std::ostream* out) {
     switch (options.output_format) {
       case bloaty::OutputFormat::kPrettyPrint:
@@ -494,6 +886,12 @@ struct RollupOutput {
       case bloaty::OutputFormat::kCSV:
         PrintToCSV(out);
         break;
+      case bloaty::OutputFormat::kProto:
+        PrintToProto(false, out);
+        break;
+      case bloaty::OutputFormat::kProtoStream:
+        PrintToProto(true, out);
+        break;
       default:
         BLOATY_UNREACHABLE();
     }
@@ -505,18 +903,21 @@ struct RollupOutput {
 
   std::vector<std::string> source_names_;
   RollupRow toplevel_row_;
+  bool has_samples_ = false;
+  bool has_resident_ = false;
 
   void PrettyPrint(size_t max_label_len, std::ostream* out) const;
   void PrintToCSV(std::ostream* out) const;
+  void PrintToProto(bool delimited, std::ostream* out) const;
   size_t CalculateLongestLabel(const RollupRow& row, int indent) const;
   void PrettyPrintRow(const RollupRow& row, size_t indent, size_t longest_row,
-                      std::ostream* out) const;
+                      OutputBuffer* out) const;
   void PrettyPrintTree(const RollupRow& row, size_t indent, size_t longest_row,
-                       std::ostream* out) const;
+                       OutputBuffer* out) const;
   void PrintRowToCSV(const RollupRow& row, absl::string_view parent_labels,
-                     std::ostream* out) const;
-  void PrintTreeToCSV(const RollupRow& row, absl::string_view parent_labels,
-                      std::ostream* out) const;
+                     OutputBuffer* out) const;
+  void PrintTreeToCSV(const RollupRow& row, std::string* parent_labels,
+                      OutputBuffer* out) const;
 };
 
 bool ParseOptions(int argc, char* argv[], Options* options,
@@ -524,6 +925,226 @@ bool ParseOptions(int argc, char* argv[], Options* options,
 bool BloatyMain(const Options& options, const InputFileFactory& file_factory,
                 RollupOutput* output, std::string* error);
 
+// Instead of a size profile, writes the labels that each of "options"' data
+// sources gives the addresses read from "in", for "options"' one input file,
+// as CSV with one row per address.  Each line of "in" is a VM address, or a
+// file offset if it starts with "file:", in hex if it starts with "0x" and
+// decimal otherwise.  The addresses are sorted and looked up in one pass over
+// each map, so large batches (like the samples of a profile) are cheap.
+bool LookupAddresses(const Options& options,
+                     const InputFileFactory& file_factory, std::istream* in,
+                     std::ostream* out, std::string* error);
+
+// Compiled custom data sources, keyed by their rewrite rules.
+typedef std::unordered_map<std::string, std::shared_ptr<NameMunger>>
+    MungerCache;
+
+// For programs that run Bloaty many times, like a service that analyzes
+// binaries as they are built.  Each Analyze() call is like a BloatyMain() call,
+// but the demangler (a c++filt subprocess, along with the names it has
+// demangled) and the compiled regexes of custom data sources are kept for the
+// next call instead of being rebuilt.
+//
+// A session must only be used by one thread at a time, but sessions on
+// different threads can run at once, since all of Bloaty's per-run state
+// (stats, flags) is thread_local.
+class Session {
+ public:
+  explicit Session(const InputFileFactory& file_factory);
+  ~Session();
+
+  bool Analyze(const Options& options, RollupOutput* output,
+               std::string* error);
+
+  // Like the above, but returns the results as a Report (see bloaty.proto).
+  bool Analyze(const Options& options, Report* report, std::string* error);
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(Session);
+
+  const InputFileFactory& file_factory_;
+  Demangler demangler_;
+  MungerCache munger_cache_;
+};
+
+// Runs "options" once for each line of the --batch manifest "manifest", with
+// that line's files, and writes the output to the line's output file.  The
+// lines are run on "threads" threads, each with its own Session.  Lines that
+// fail are reported on stderr without stopping the others, and then make this
+// return false.
+bool RunBatch(const std::string& manifest, const Options& options,
+              const OutputOptions& output_options,
+              const InputFileFactory& file_factory, int threads,
+              std::string* error);
+
+// Answers requests on a Unix socket, for "bloaty --serve SOCKET".  The protocol
+// is described with ServeResponse in bloaty.proto; a client may send any
+// number of requests on one connection.
+//
+// Each of "threads" workers has its own Session and handles one connection at
+// a time.  Input files are opened through a CachingInputFileFactory that keeps
+// "cached_files" files open.
+class Server {
+ public:
+  Server(int threads, size_t cached_files);
+  ~Server();
+
+  // Creates the socket, replacing a socket that is already at "socket_path"
+  // (say, from an earlier server).  Anything else there is an error.
+  bool Listen(const std::string& socket_path, std::string* error);
+
+  // Accepts connections until Stop() is called from another thread.
+  void Run();
+  void Stop();
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(Server);
+
+  void Work();
+  void ServeConnection(Session* session, int fd);
+
+  MmapInputFileFactory mmap_factory_;
+  CachingInputFileFactory file_factory_;
+  size_t threads_;
+  std::string socket_path_;
+  int listen_fd_ = -1;
+  int wake_fds_[2] = {-1, -1};  // Written to by Stop() to end Run().
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  std::deque<int> pending_;   // Accepted, but not picked up by a worker yet.
+  std::set<int> connections_;  // Being served by a worker.
+};
+
+// Sends one request to a server started with "bloaty --serve" and waits for the
+// answer.
+bool QueryServer(const std::string& socket_path, const Options& options,
+                 RollupOutput* output, std::string* error);
+
+
+// Rollup //////////////////////////////////////////////////////////////////////
+
+// The tree of sizes that all input files are added to, before any output
+// massaging (see bloaty.cc).
+//
+// This type is only exposed in the .h file for benchmarking purposes.
+
+class Rollup {
+ public:
+  Rollup() { CountMemory(MemoryUse::kRollups, sizeof(Rollup)); }
+  ~Rollup();
+
+  // Adds sizes from an input file, or from a base file when "is_base" is true.
+  // Base sizes are subtracted from the totals (which then become deltas) and
+  // also tallied separately, so a diff is built in this one tree without
+  // ever having a separate tree for the base.
+  void AddSizes(const std::vector<std::string>& names,
+                uint64_t size, bool is_vmsize, bool is_base) {
+    // We start at 1 to exclude the base map (see base_map_).
+    AddInternal(names, 1, size, is_vmsize, is_base);
+  }
+
+  // Adds "samples" profile samples, which fell in "hot_bytes" bytes, under
+  // the labels "names".
+  void AddSamples(const std::vector<std::string>& names, uint64_t samples,
+                  uint64_t hot_bytes) {
+    AddSamplesInternal(names, 1, samples, hot_bytes);
+  }
+
+  // Adds "resident" bytes that are resident in memory under the labels
+  // "names".
+  void AddResident(const std::vector<std::string>& names, uint64_t resident) {
+    AddResidentInternal(names, 1, resident);
+  }
+
+  // Prints a graphical representation of the rollup.
+  void CreateRollupOutput(const Options& options, RollupOutput* row) const {
+    CreateOutput(false, options, row);
+  }
+
+  // Like CreateRollupOutput(), but for a rollup that base sizes were added
+  // to.
+  void CreateDiffModeRollupOutput(const Options& options,
+                                  RollupOutput* output) const {
+    CreateOutput(true, options, output);
+  }
+
+  // Appends the full tree (no pruning or sorting by size) to "out" in the
+  // snapshot node format, or adds a tree in that format that was read from
+  // "data" into this one.  See "Rollup snapshots" below.  "levels" is the
+  // number of levels the tree in "data" may have beneath this one.
+  void WriteSnapshot(std::string* out) const;
+  void AddSnapshot(absl::string_view* data, size_t levels, bool is_base);
+
+  // Saves memory by merging every child (at all levels) whose sizes are all
+  // smaller than "threshold" into a "[Pruned]" child, which has no children.
+  // The totals of every remaining row stay the same.
+  void Prune(int64_t threshold);
+
+ private:
+  BLOATY_DISALLOW_COPY_AND_ASSIGN(Rollup);
+
+  int64_t vm_total_ = 0;
+  int64_t file_total_ = 0;
+
+  // Only used in diff mode, where the totals above are (input - base).  These
+  // are the base totals on their own, which we need for percentages.
+  int64_t base_vm_total_ = 0;
+  int64_t base_file_total_ = 0;
+
+  // Profile samples (see AddSamples()), which are never in diff mode.
+  int64_t samples_ = 0;
+  int64_t hot_bytes_ = 0;
+
+  // Resident bytes (see AddResident()), which are likewise never in diff mode.
+  int64_t resident_ = 0;
+
+  // Putting Rollup by value seems to work on some compilers/libs but not
+  // others.
+  typedef std::unordered_map<
+      std::string, std::unique_ptr<Rollup>, std::hash<std::string>,
+      std::equal_to<std::string>,
+      CountingAllocator<std::pair<const std::string, std::unique_ptr<Rollup>>,
+                        MemoryUse::kRollups>>
+      ChildMap;
+  ChildMap children_;
+
+  void AddTotals(int64_t vmsize, int64_t filesize, bool is_base);
+  Rollup* GetOrAddChild(const std::string& name);
+
+  // Adds "size" bytes to the rollup under the label names[i].
+  // If there are more entries names[i+1, i+2, etc] add them to sub-rollups.
+  void AddInternal(const std::vector<std::string>& names, size_t i,
+                   uint64_t size, bool is_vmsize, bool is_base);
+  void AddSamplesInternal(const std::vector<std::string>& names, size_t i,
+                          uint64_t samples, uint64_t hot_bytes);
+  void AddResidentInternal(const std::vector<std::string>& names, size_t i,
+                           uint64_t resident);
+
+  static double Percent(ssize_t part, size_t whole) {
+    return static_cast<double>(part) / static_cast<double>(whole) * 100;
+  }
+
+  // A child that is a candidate for being output as a row.  We rank and
+  // collapse children in this form so that RollupRow objects (and copies of
+  // their names) are only created for children that will actually be output.
+  struct ChildRef {
+    const std::string* name;
+    const Rollup* rollup;
+  };
+
+  static int64_t RankValue(const Options& options, const Rollup& rollup);
+
+  void CreateOutput(bool diff_mode, const Options& options,
+                    RollupOutput* output) const;
+  void CreateRows(RollupRow* row, bool diff_mode, const Options& options,
+                  bool is_toplevel) const;
+  void ComputeRows(RollupRow* row, std::vector<ChildRef>* refs,
+                   std::vector<RollupRow>* children, bool diff_mode,
+                   const Options& options, bool is_toplevel) const;
+};
+
 // Endianness utilities ////////////////////////////////////////////////////////
 
 inline bool IsLittleEndian() {
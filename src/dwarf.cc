@@ -18,6 +18,7 @@
 #include <algorithm>
 #include <initializer_list>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <stack>
 #include <unordered_map>
@@ -25,6 +26,7 @@
 #include <vector>
 
 #include "absl/base/attributes.h"
+#include "absl/strings/match.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/substitute.h"
 #include "bloaty.h"
@@ -125,6 +127,7 @@ void SkipNullTerminated(string_view* data) {
 // to signed values, this isn't actually tested/exercised right now.
 
 uint64_t ReadLEB128Internal(bool is_signed, string_view* data) {
+  stats.leb128_reads++;
   uint64_t ret = 0;
   int shift = 0;
   int maxshift = 70;
@@ -160,6 +163,7 @@ T ReadLEB128(string_view* data) {
 }
 
 void SkipLEB128(string_view* data) {
+  stats.leb128_reads++;
   size_t limit =
       std::min(static_cast<size_t>(data->size()), static_cast<size_t>(10));
   for (size_t i = 0; i < limit; i++) {
@@ -172,6 +176,18 @@ void SkipLEB128(string_view* data) {
   THROW("corrupt DWARF data, unterminated LEB128");
 }
 
+// Reads a fixed-length unsigned integer of |N| bytes.  DWARF 5 added some
+// 3-byte forms (DW_FORM_strx3, DW_FORM_addrx3) that don't correspond to any C
+// type, so we can't just use ReadMemcpy<>() for these.
+template <size_t N>
+uint64_t ReadFixedUnsigned(string_view* data) {
+  static_assert(N <= sizeof(uint64_t), "too many bytes");
+  uint64_t ret = 0;
+  string_view bytes = ReadPiece(N, data);
+  memcpy(&ret, bytes.data(), N);
+  return ret;
+}
+
 // Some size information attached to each compilation unit.  The size of an
 // address or offset in the DWARF data depends on this state which is parsed
 // from the header.
@@ -182,12 +198,19 @@ struct CompilationUnitSizes {
   // The size of addresses.
   uint8_t address_size;
 
+  // The DWARF version of this unit.  A few forms (like DW_FORM_ref_addr) change
+  // size depending on the version.
+  uint16_t dwarf_version = 0;
+
   // To allow this as the key in a map.
   bool operator<(const CompilationUnitSizes& rhs) const {
-    return std::tie(dwarf64, address_size) <
-           std::tie(rhs.dwarf64, rhs.address_size);
+    return std::tie(dwarf64, address_size, dwarf_version) <
+           std::tie(rhs.dwarf64, rhs.address_size, rhs.dwarf_version);
   }
 
+  // The size of a DWARF offset in this unit.
+  uint8_t offset_size() const { return dwarf64 ? 8 : 4; }
+
   // Reads a DWARF offset based on whether we are reading dwarf32 or dwarf64
   // format.
   uint64_t ReadDWARFOffset(string_view* data) const {
@@ -249,15 +272,28 @@ struct CompilationUnitSizes {
 // The abbreviations are an internal detail of the DWARF format and users should
 // not need to care about them.
 
+// Abbreviation tables and ActionBufs count their memory under kDwarf.
+template <class T>
+using DwarfAllocator = CountingAllocator<T, MemoryUse::kDwarf>;
+
+template <class K, class V>
+using DwarfMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                    DwarfAllocator<std::pair<const K, V>>>;
+
 class AbbrevTable {
  public:
-  // Reads abbreviations until a terminating abbreviation is seen.
-  void ReadAbbrevs(string_view data);
+  // Reads abbreviations until a terminating abbreviation is seen, leaving
+  // |data| just past it.
+  void ReadAbbrevs(string_view* data);
 
   // In a DWARF abbreviation, each attribute has a name and a form.
   struct Attribute {
     uint16_t name;
-    uint8_t form;
+    uint16_t form;
+
+    // Only for DW_FORM_implicit_const, where the value lives in the
+    // abbreviation instead of the DIE.
+    int64_t implicit_const;
   };
 
   // The representation of a single abbreviation.
@@ -265,7 +301,7 @@ class AbbrevTable {
     uint32_t code;
     uint16_t tag;
     bool has_child;
-    std::vector<Attribute> attr;
+    std::vector<Attribute, DwarfAllocator<Attribute>> attr;
   };
 
   bool IsEmpty() const { return abbrev_.empty(); }
@@ -286,12 +322,13 @@ class AbbrevTable {
   // Keyed by abbreviation code.
   // Generally we expect these to be small, so we could almost use a vector<>.
   // But you never know what crazy input data is going to do...
-  std::unordered_map<uint32_t, Abbrev> abbrev_;
+  DwarfMap<uint32_t, Abbrev> abbrev_;
 };
 
-void AbbrevTable::ReadAbbrevs(string_view data) {
+void AbbrevTable::ReadAbbrevs(string_view* data) {
+  stats.abbrev_tables_built++;
   while (true) {
-    uint32_t code = ReadLEB128<uint32_t>(&data);
+    uint32_t code = ReadLEB128<uint32_t>(data);
 
     if (code == 0) {
       return;  // Terminator entry.
@@ -306,8 +343,8 @@ void AbbrevTable::ReadAbbrevs(string_view data) {
     uint8_t has_child;
 
     abbrev.code = code;
-    abbrev.tag = ReadLEB128<uint16_t>(&data);
-    has_child = ReadMemcpy<uint8_t>(&data);
+    abbrev.tag = ReadLEB128<uint16_t>(data);
+    has_child = ReadMemcpy<uint8_t>(data);
 
     switch (has_child) {
       case DW_children_yes:
@@ -322,13 +359,18 @@ void AbbrevTable::ReadAbbrevs(string_view data) {
 
     while (true) {
       Attribute attr;
-      attr.name = ReadLEB128<uint16_t>(&data);
-      attr.form = ReadLEB128<uint8_t>(&data);
+      attr.name = ReadLEB128<uint16_t>(data);
+      attr.form = ReadLEB128<uint16_t>(data);
+      attr.implicit_const = 0;
 
       if (attr.name == 0 && attr.form == 0) {
         break;  // End of this abbrev
       }
 
+      if (attr.form == DW_FORM_implicit_const) {
+        attr.implicit_const = ReadLEB128<int64_t>(data);
+      }
+
       abbrev.attr.push_back(attr);
     }
   }
@@ -434,6 +476,296 @@ bool AddressRanges::NextUnit() {
 }
 
 
+// NameIndex ///////////////////////////////////////////////////////////////////
+
+// Code for reading the name indexes that linkers and compilers can add to
+// speed up debuggers: .gdb_index (from "-Wl,--gdb-index") and DWARF 5's
+// .debug_names.  Both list the compilation units and the names that each one
+// defines, which lets us attribute symbols to compilation units without
+// visiting every DIE.
+
+class NameIndex {
+ public:
+  // Each returns false if the index is in a version we don't understand.
+  bool ReadGdbIndex(string_view data);
+  bool ReadDebugNames(string_view data, string_view debug_str);
+
+  struct AddressRange {
+    uint64_t low;
+    uint64_t high;
+    uint32_t unit;
+  };
+
+  // .debug_info offsets of all compilation units, indexed by unit number.
+  const std::vector<uint64_t>& unit_offsets() const { return unit_offsets_; }
+
+  // Code ranges for each unit number.  Only .gdb_index has these.
+  const std::vector<AddressRange>& address_ranges() const {
+    return address_ranges_;
+  }
+
+  // Functions and variables, and the number of the unit that defines them.
+  // Names that are defined in more than one unit (like static functions with
+  // the same name) are left out, since we can't tell which symbol is which.
+  const std::vector<std::pair<string_view, uint32_t>>& names() const {
+    return names_;
+  }
+
+  // The numbers of the units that define the names left out of names().
+  const std::vector<uint32_t>& ambiguous_units() const {
+    return ambiguous_units_;
+  }
+
+ private:
+  static string_view Slice(string_view data, uint64_t begin, uint64_t end);
+  static uint64_t ReadIndexAttribute(uint16_t form, string_view* data);
+
+  // Records that |name| is defined in |unit|.
+  void AddName(string_view name, const std::vector<uint32_t>& units);
+
+  std::vector<uint64_t> unit_offsets_;
+  std::vector<AddressRange> address_ranges_;
+  std::vector<std::pair<string_view, uint32_t>> names_;
+  std::vector<uint32_t> ambiguous_units_;
+};
+
+string_view NameIndex::Slice(string_view data, uint64_t begin, uint64_t end) {
+  if (begin > end) {
+    THROW("name index table has negative size");
+  }
+  SkipBytes(begin, &data);
+  return ReadPiece(end - begin, &data);
+}
+
+void NameIndex::AddName(string_view name, const std::vector<uint32_t>& units) {
+  if (units.empty()) {
+    return;
+  }
+
+  for (uint32_t unit : units) {
+    if (unit != units[0]) {
+      ambiguous_units_.insert(ambiguous_units_.end(), units.begin(),
+                              units.end());
+      return;
+    }
+  }
+
+  names_.push_back(std::make_pair(name, units[0]));
+}
+
+bool NameIndex::ReadGdbIndex(string_view data) {
+  string_view header = data;
+  uint32_t version = ReadMemcpy<uint32_t>(&header);
+
+  // Versions before 7 don't say what kind of symbol each name is.
+  if (version < 7 || version > 8) {
+    return false;
+  }
+
+  uint32_t cu_list_offset = ReadMemcpy<uint32_t>(&header);
+  uint32_t types_offset = ReadMemcpy<uint32_t>(&header);
+  uint32_t address_offset = ReadMemcpy<uint32_t>(&header);
+  uint32_t symbol_offset = ReadMemcpy<uint32_t>(&header);
+  uint32_t pool_offset = ReadMemcpy<uint32_t>(&header);
+
+  string_view cu_list = Slice(data, cu_list_offset, types_offset);
+  string_view addresses = Slice(data, address_offset, symbol_offset);
+  string_view symbols = Slice(data, symbol_offset, pool_offset);
+  string_view pool = Slice(data, pool_offset, data.size());
+
+  while (!cu_list.empty()) {
+    unit_offsets_.push_back(ReadMemcpy<uint64_t>(&cu_list));
+    ReadMemcpy<uint64_t>(&cu_list);  // Length.
+  }
+
+  while (!addresses.empty()) {
+    AddressRange range;
+    range.low = ReadMemcpy<uint64_t>(&addresses);
+    range.high = ReadMemcpy<uint64_t>(&addresses);
+    range.unit = ReadMemcpy<uint32_t>(&addresses);
+    if (range.unit < unit_offsets_.size() && range.high > range.low) {
+      address_ranges_.push_back(range);
+    }
+  }
+
+  std::vector<uint32_t> units;
+
+  while (!symbols.empty()) {
+    uint32_t name_offset = ReadMemcpy<uint32_t>(&symbols);
+    uint32_t vector_offset = ReadMemcpy<uint32_t>(&symbols);
+
+    if (name_offset == 0 && vector_offset == 0) {
+      continue;  // Empty hash table slot.
+    }
+
+    string_view name = pool;
+    SkipBytes(name_offset, &name);
+    name = ReadNullTerminated(&name);
+
+    string_view vec = pool;
+    SkipBytes(vector_offset, &vec);
+    uint32_t count = ReadMemcpy<uint32_t>(&vec);
+    units.clear();
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t entry = ReadMemcpy<uint32_t>(&vec);
+      uint32_t unit = entry & 0xffffff;
+      uint32_t kind = (entry >> 28) & 7;
+
+      // Kinds are 0 (unknown, which is all that gold writes), 1 (type),
+      // 2 (variable), 3 (function) and 4 (other).  Units past the end of the
+      // CU list are type units.
+      if ((kind == 0 || kind == 2 || kind == 3) &&
+          unit < unit_offsets_.size()) {
+        units.push_back(unit);
+      }
+    }
+
+    AddName(name, units);
+  }
+
+  return true;
+}
+
+uint64_t NameIndex::ReadIndexAttribute(uint16_t form, string_view* data) {
+  switch (form) {
+    case DW_FORM_flag_present:
+      return 1;
+    case DW_FORM_flag:
+    case DW_FORM_data1:
+    case DW_FORM_ref1:
+      return ReadMemcpy<uint8_t>(data);
+    case DW_FORM_data2:
+    case DW_FORM_ref2:
+      return ReadMemcpy<uint16_t>(data);
+    case DW_FORM_data4:
+    case DW_FORM_ref4:
+      return ReadMemcpy<uint32_t>(data);
+    case DW_FORM_data8:
+    case DW_FORM_ref8:
+    case DW_FORM_ref_sig8:
+      return ReadMemcpy<uint64_t>(data);
+    case DW_FORM_udata:
+    case DW_FORM_ref_udata:
+      return ReadLEB128<uint64_t>(data);
+    default:
+      THROWF("unexpected form $0 in .debug_names", form);
+  }
+}
+
+bool NameIndex::ReadDebugNames(string_view data, string_view debug_str) {
+  StringTable strings(debug_str);
+  std::vector<uint32_t> units;
+
+  struct Abbrev {
+    uint64_t tag;
+    std::vector<std::pair<uint64_t, uint16_t>> attributes;
+  };
+  std::unordered_map<uint64_t, Abbrev> abbrevs;
+
+  // There may be one index for the whole binary, or (if the linker didn't merge
+  // them) one per compilation unit.
+  while (!data.empty()) {
+    CompilationUnitSizes sizes;
+    string_view unit = sizes.ReadInitialLength(&data);
+
+    if (ReadMemcpy<uint16_t>(&unit) != 5) {
+      return false;
+    }
+
+    ReadMemcpy<uint16_t>(&unit);  // Padding.
+    uint32_t cu_count = ReadMemcpy<uint32_t>(&unit);
+    uint32_t local_tu_count = ReadMemcpy<uint32_t>(&unit);
+    uint32_t foreign_tu_count = ReadMemcpy<uint32_t>(&unit);
+    uint32_t bucket_count = ReadMemcpy<uint32_t>(&unit);
+    uint32_t name_count = ReadMemcpy<uint32_t>(&unit);
+    uint32_t abbrev_table_size = ReadMemcpy<uint32_t>(&unit);
+    uint32_t augmentation_size = ReadMemcpy<uint32_t>(&unit);
+    SkipBytes(augmentation_size, &unit);
+
+    uint32_t unit_base = unit_offsets_.size();
+    for (uint32_t i = 0; i < cu_count; i++) {
+      unit_offsets_.push_back(sizes.ReadDWARFOffset(&unit));
+    }
+
+    uint64_t offset_size = sizes.offset_size();
+    SkipBytes(local_tu_count * offset_size, &unit);
+    SkipBytes(foreign_tu_count * 8, &unit);
+    SkipBytes(bucket_count * 4, &unit);
+    if (bucket_count > 0) {
+      SkipBytes(name_count * 4, &unit);  // Hashes.
+    }
+
+    string_view string_offsets = ReadPiece(name_count * offset_size, &unit);
+    string_view entry_offsets = ReadPiece(name_count * offset_size, &unit);
+    string_view abbrev_data = ReadPiece(abbrev_table_size, &unit);
+    string_view entry_pool = unit;
+
+    abbrevs.clear();
+    while (true) {
+      uint64_t code = ReadLEB128<uint64_t>(&abbrev_data);
+      if (code == 0) {
+        break;
+      }
+
+      Abbrev& abbrev = abbrevs[code];
+      abbrev.tag = ReadLEB128<uint64_t>(&abbrev_data);
+      while (true) {
+        uint64_t index = ReadLEB128<uint64_t>(&abbrev_data);
+        uint16_t form = ReadLEB128<uint16_t>(&abbrev_data);
+        if (index == 0 && form == 0) {
+          break;
+        }
+        abbrev.attributes.push_back(std::make_pair(index, form));
+      }
+    }
+
+    for (uint32_t i = 0; i < name_count; i++) {
+      string_view name =
+          strings.ReadEntry(sizes.ReadDWARFOffset(&string_offsets));
+      string_view entries = entry_pool;
+      SkipBytes(sizes.ReadDWARFOffset(&entry_offsets), &entries);
+      units.clear();
+
+      while (true) {
+        uint64_t code = ReadLEB128<uint64_t>(&entries);
+        if (code == 0) {
+          break;
+        }
+
+        auto it = abbrevs.find(code);
+        if (it == abbrevs.end()) {
+          THROW("unknown abbreviation code in .debug_names");
+        }
+
+        // With a single CU, entries can leave out DW_IDX_compile_unit.
+        uint64_t cu = cu_count == 1 ? 0 : cu_count;
+        bool type_unit = false;
+
+        for (const auto& attr : it->second.attributes) {
+          uint64_t value = ReadIndexAttribute(attr.second, &entries);
+          if (attr.first == DW_IDX_compile_unit) {
+            cu = value;
+          } else if (attr.first == DW_IDX_type_unit) {
+            type_unit = true;
+          }
+        }
+
+        uint64_t tag = it->second.tag;
+        if ((tag == DW_TAG_subprogram || tag == DW_TAG_variable) &&
+            !type_unit && cu < cu_count) {
+          units.push_back(unit_base + cu);
+        }
+      }
+
+      AddName(name, units);
+    }
+  }
+
+  return true;
+}
+
+
 // DIEReader ///////////////////////////////////////////////////////////////////
 
 // Reads a sequence of DWARF DIE's (Debugging Information Entries) from the
@@ -496,6 +828,42 @@ class DIEReader {
   CompilationUnitSizes unit_sizes() const { return unit_sizes_; }
   uint32_t abbrev_version() const { return abbrev_version_; }
 
+  // The offset of the current unit's header within its section, as used by
+  // SeekToCompilationUnit() and name indexes.
+  uint64_t unit_offset() const { return unit_offset_; }
+
+  // The DW_UT_* type of the current unit.  Pre-DWARF 5 units are reported as
+  // DW_UT_compile or DW_UT_type depending on which section they came from.
+  uint8_t unit_type() const { return unit_type_; }
+
+  // Lookups into the DWARF 5 indexed tables, relative to the bases that the
+  // current unit's root DIE specified (DW_AT_str_offsets_base, etc).  These
+  // are what allow DW_FORM_strx, DW_FORM_addrx and DW_FORM_rnglistx to be
+  // resolved in constant time.
+  string_view ReadIndexedString(uint64_t index) const;
+  uint64_t ReadIndexedAddress(uint64_t index) const;
+  uint64_t ReadIndexedRangeListOffset(uint64_t index) const;
+
+  // Split DWARF.  Skeleton units (in the main binary) and split units (in a
+  // .dwo file or .dwp package) share a dwo id, which is in the unit header in
+  // DWARF 5 and in a DW_AT_GNU_dwo_id attribute before that.  Both are zero
+  // for ordinary units.
+  uint64_t unit_dwo_id() const { return unit_dwo_id_; }
+  string_view unit_dwo_name() const { return unit_dwo_name_; }
+  string_view unit_comp_dir() const { return unit_comp_dir_; }
+
+  // For reading split units: takes the parts of each unit's context that come
+  // from the skeleton unit, namely its .debug_addr base and (for the GNU
+  // extension that predates DWARF 5) its .debug_ranges base.  Must be called
+  // before seeking.
+  void SetSkeleton(const DIEReader& skeleton) {
+    skeleton_addr_base_ = skeleton.addr_base_;
+    skeleton_ranges_base_ = skeleton.gnu_ranges_base_;
+  }
+
+  // The base that pre-DWARF 5 DW_AT_ranges offsets are relative to.
+  uint64_t ranges_base() const { return skeleton_ranges_base_; }
+
  private:
   BLOATY_DISALLOW_COPY_AND_ASSIGN(DIEReader);
 
@@ -527,6 +895,8 @@ class DIEReader {
 
   bool ReadCompilationUnitHeader();
   bool ReadCode();
+  void ReadUnitAttributes();
+  void ReadUnitAttributesPass(bool strings);
 
   enum class State {
     kReadyToReadAttributes,
@@ -554,12 +924,16 @@ class DIEReader {
 
   // All of the AbbrevTables we've read from .debug_abbrev, indexed by their
   // offset within .debug_abbrev.
-  std::unordered_map<uint64_t, AbbrevTable> abbrev_tables_;
+  DwarfMap<uint64_t, AbbrevTable> abbrev_tables_;
+
+  // The [start, end) offsets of each of |abbrev_tables_| within .debug_abbrev.
+  std::map<uint64_t, uint64_t> abbrev_table_ends_;
 
   // Whether we are in .debug_types or .debug_info.
   Section section_;
 
   // Information about the current compilation unit.
+  uint64_t unit_offset_;
   CompilationUnitSizes unit_sizes_;
   AbbrevTable* unit_abbrev_;
 
@@ -572,9 +946,27 @@ class DIEReader {
   std::map<std::pair<AbbrevTable*, CompilationUnitSizes>, uint32_t>
       abbrev_versions_;
 
-  // Only for .debug_types
+  // DW_UT_* value for the current unit.
+  uint8_t unit_type_;
+
+  // Bases for the DWARF 5 indexed forms, read from the root DIE of each unit.
+  uint64_t str_offsets_base_;
+  uint64_t addr_base_;
+  uint64_t rnglists_base_;
+  uint64_t gnu_ranges_base_;
+
+  // Set by SetSkeleton() when reading split units.
+  uint64_t skeleton_addr_base_ = 0;
+  uint64_t skeleton_ranges_base_ = 0;
+
+  // Only for type units (.debug_types, or DW_UT_type in DWARF 5).
   uint64_t unit_type_signature_;
   uint64_t unit_type_offset_;
+
+  // Only for skeleton and split units.
+  uint64_t unit_dwo_id_;
+  string_view unit_dwo_name_;
+  string_view unit_comp_dir_;
 };
 
 bool DIEReader::ReadCode() {
@@ -590,6 +982,7 @@ bool DIEReader::ReadCode() {
   if (!unit_abbrev_->GetAbbrev(code, &current_abbrev_)) {
     THROW("couldn't find abbreviation for code");
   }
+  stats.dies_decoded++;
   state_ = State::kReadyToReadAttributes;
   sibling_offset_ = 0;
   return true;
@@ -623,15 +1016,57 @@ bool DIEReader::ReadCompilationUnitHeader() {
     return false;
   }
 
+  string_view section = section_ == Section::kDebugInfo ? dwarf_.debug_info
+                                                        : dwarf_.debug_types;
+  unit_offset_ = next_unit_.data() - section.data();
   remaining_ = unit_sizes_.ReadInitialLength(&next_unit_);
 
   uint16_t version = ReadMemcpy<uint16_t>(&remaining_);
 
-  if (version > 4) {
+  if (version > 5) {
     THROW("Data is in new DWARF format we don't understand");
   }
 
-  uint64_t debug_abbrev_offset = unit_sizes_.ReadDWARFOffset(&remaining_);
+  unit_sizes_.dwarf_version = version;
+  unit_dwo_id_ = 0;
+  uint64_t debug_abbrev_offset;
+
+  if (version >= 5) {
+    // DWARF 5 moved address_size before the abbrev offset and added a unit
+    // type, which determines what (if anything) follows.
+    unit_type_ = ReadMemcpy<uint8_t>(&remaining_);
+    unit_sizes_.address_size = ReadMemcpy<uint8_t>(&remaining_);
+    debug_abbrev_offset = unit_sizes_.ReadDWARFOffset(&remaining_);
+
+    switch (unit_type_) {
+      case DW_UT_compile:
+      case DW_UT_partial:
+        break;
+      case DW_UT_skeleton:
+      case DW_UT_split_compile:
+        unit_dwo_id_ = ReadMemcpy<uint64_t>(&remaining_);
+        break;
+      case DW_UT_type:
+      case DW_UT_split_type:
+        unit_type_signature_ = ReadMemcpy<uint64_t>(&remaining_);
+        unit_type_offset_ = unit_sizes_.ReadDWARFOffset(&remaining_);
+        break;
+      default:
+        THROWF("unknown DWARF unit type: $0", unit_type_);
+    }
+  } else {
+    debug_abbrev_offset = unit_sizes_.ReadDWARFOffset(&remaining_);
+    unit_sizes_.address_size = ReadMemcpy<uint8_t>(&remaining_);
+
+    if (section_ == Section::kDebugTypes) {
+      unit_type_ = DW_UT_type;
+      unit_type_signature_ = ReadMemcpy<uint64_t>(&remaining_);
+      unit_type_offset_ = unit_sizes_.ReadDWARFOffset(&remaining_);
+    } else {
+      unit_type_ = DW_UT_compile;
+    }
+  }
+
   unit_abbrev_ = &abbrev_tables_[debug_abbrev_offset];
 
   // If we haven't already read abbreviations for this debug_abbrev_offset, we
@@ -639,14 +1074,24 @@ bool DIEReader::ReadCompilationUnitHeader() {
   if (unit_abbrev_->IsEmpty()) {
     string_view abbrev_data = dwarf_.debug_abbrev;
     SkipBytes(debug_abbrev_offset, &abbrev_data);
-    unit_abbrev_->ReadAbbrevs(abbrev_data);
-  }
 
-  unit_sizes_.address_size = ReadMemcpy<uint8_t>(&remaining_);
+    // Units can point anywhere in .debug_abbrev, so a table could start in
+    // the middle of one we've already read; each unit would then read the
+    // rest of that table again.  Compilers never emit this, so don't allow it.
+    auto next = abbrev_table_ends_.upper_bound(debug_abbrev_offset);
+    if (next != abbrev_table_ends_.begin() &&
+        std::prev(next)->first != debug_abbrev_offset &&
+        std::prev(next)->second > debug_abbrev_offset) {
+      THROW("DWARF abbreviation tables overlap");
+    }
+    if (next != abbrev_table_ends_.end()) {
+      abbrev_data = abbrev_data.substr(0, next->first - debug_abbrev_offset);
+    }
 
-  if (section_ == Section::kDebugTypes) {
-    unit_type_signature_ = ReadMemcpy<uint64_t>(&remaining_);
-    unit_type_offset_ = unit_sizes_.ReadDWARFOffset(&remaining_);
+    size_t size = abbrev_data.size();
+    unit_abbrev_->ReadAbbrevs(&abbrev_data);
+    abbrev_table_ends_[debug_abbrev_offset] =
+        debug_abbrev_offset + size - abbrev_data.size();
   }
 
   auto abbrev_id = std::make_pair(unit_abbrev_, unit_sizes_);
@@ -657,7 +1102,118 @@ bool DIEReader::ReadCompilationUnitHeader() {
   // was one.
   abbrev_version_ = insert_pair.first->second;
 
-  return ReadCode();
+  if (!ReadCode()) {
+    return false;
+  }
+
+  ReadUnitAttributes();
+  return true;
+}
+
+// Positions |data| at entry |index| of a table of |entry_size|-byte entries
+// that begins at offset |base|.
+static void SkipToIndexedEntry(uint64_t base, uint64_t index,
+                               size_t entry_size, string_view* data) {
+  SkipBytes(base, data);
+  if (index >= data->size() / entry_size) {
+    THROW("DWARF index out of range");
+  }
+  SkipBytes(index * entry_size, data);
+}
+
+string_view DIEReader::ReadIndexedString(uint64_t index) const {
+  string_view data = dwarf_.debug_str_offsets;
+  SkipToIndexedEntry(str_offsets_base_, index, unit_sizes_.offset_size(),
+                     &data);
+  StringTable table(dwarf_.debug_str);
+  return table.ReadEntry(unit_sizes_.ReadDWARFOffset(&data));
+}
+
+uint64_t DIEReader::ReadIndexedAddress(uint64_t index) const {
+  string_view data = dwarf_.debug_addr;
+  SkipToIndexedEntry(addr_base_, index, unit_sizes_.address_size, &data);
+  return unit_sizes_.ReadAddress(&data);
+}
+
+uint64_t DIEReader::ReadIndexedRangeListOffset(uint64_t index) const {
+  // Offsets in the table are relative to the base itself.
+  string_view data = dwarf_.debug_rnglists;
+  SkipToIndexedEntry(rnglists_base_, index, unit_sizes_.offset_size(), &data);
+  return rnglists_base_ + unit_sizes_.ReadDWARFOffset(&data);
+}
+
+// Calls func(address, size) for every range in the range list at |offset|,
+// which is in .debug_rnglists for DWARF 5 units and in .debug_ranges for
+// earlier ones.  |base_address| is the unit's DW_AT_low_pc.
+template <class Func>
+void ReadRangeList(const DIEReader& die_reader, uint64_t base_address,
+                   uint64_t offset, Func func) {
+  CompilationUnitSizes sizes = die_reader.unit_sizes();
+
+  if (sizes.dwarf_version < 5) {
+    string_view data = die_reader.dwarf().debug_ranges;
+    SkipBytes(die_reader.ranges_base() + offset, &data);
+    uint64_t max_address = sizes.address_size == 8 ? UINT64_MAX : UINT32_MAX;
+
+    while (true) {
+      uint64_t start = sizes.ReadAddress(&data);
+      uint64_t end = sizes.ReadAddress(&data);
+      if (start == 0 && end == 0) {
+        return;
+      } else if (start == max_address) {
+        base_address = end;
+      } else if (end > start) {
+        func(base_address + start, end - start);
+      }
+    }
+  }
+
+  string_view data = die_reader.dwarf().debug_rnglists;
+  SkipBytes(offset, &data);
+
+  while (true) {
+    uint8_t kind = ReadMemcpy<uint8_t>(&data);
+    uint64_t start;
+    uint64_t end;
+
+    switch (kind) {
+      case DW_RLE_end_of_list:
+        return;
+      case DW_RLE_base_addressx:
+        base_address =
+            die_reader.ReadIndexedAddress(ReadLEB128<uint64_t>(&data));
+        continue;
+      case DW_RLE_base_address:
+        base_address = sizes.ReadAddress(&data);
+        continue;
+      case DW_RLE_startx_endx:
+        start = die_reader.ReadIndexedAddress(ReadLEB128<uint64_t>(&data));
+        end = die_reader.ReadIndexedAddress(ReadLEB128<uint64_t>(&data));
+        break;
+      case DW_RLE_startx_length:
+        start = die_reader.ReadIndexedAddress(ReadLEB128<uint64_t>(&data));
+        end = start + ReadLEB128<uint64_t>(&data);
+        break;
+      case DW_RLE_offset_pair:
+        start = base_address + ReadLEB128<uint64_t>(&data);
+        end = base_address + ReadLEB128<uint64_t>(&data);
+        break;
+      case DW_RLE_start_end:
+        start = sizes.ReadAddress(&data);
+        end = sizes.ReadAddress(&data);
+        break;
+      case DW_RLE_start_length:
+        start = sizes.ReadAddress(&data);
+        end = start + ReadLEB128<uint64_t>(&data);
+        break;
+      default:
+        THROWF("unknown DWARF range list entry kind: $0", kind);
+    }
+
+    if (end > start) {
+      func(start, end - start);
+    }
+  }
 }
 
 
@@ -683,7 +1239,7 @@ typedef string_view FormDecodeFunc(const DIEReader& reader, string_view data,
 
 // Helper to get decoding function as a function pointer.
 template <class T>
-FormDecodeFunc* GetFormDecodeFunc(uint8_t form, CompilationUnitSizes sizes) {
+FormDecodeFunc* GetFormDecodeFunc(uint16_t form, CompilationUnitSizes sizes) {
   FormDecodeFunc* func = nullptr;
   FormReader<T>::GetFunctionForForm(sizes, form, [&func](FormDecodeFunc* f) {
     func = f;
@@ -748,7 +1304,7 @@ class FormReader<string_view> : public FormReaderBase<FormReader<string_view>> {
       : Base(reader, data), val_(val) {}
 
   template <class Func>
-  static void GetFunctionForForm(CompilationUnitSizes sizes, uint8_t form,
+  static void GetFunctionForForm(CompilationUnitSizes sizes, uint16_t form,
                                  Func func) {
     switch (form) {
       case DW_FORM_block1:
@@ -774,6 +1330,29 @@ class FormReader<string_view> : public FormReaderBase<FormReader<string_view>> {
           func(&ReadAttr<&FormReader::ReadIndirectString<uint32_t>>);
         }
         return;
+      case DW_FORM_line_strp:
+        if (sizes.dwarf64) {
+          func(&ReadAttr<&FormReader::ReadLineString<uint64_t>>);
+        } else {
+          func(&ReadAttr<&FormReader::ReadLineString<uint32_t>>);
+        }
+        return;
+      case DW_FORM_strx:
+      case DW_FORM_GNU_str_index:
+        func(&ReadAttr<&FormReader::ReadVariableIndexedString>);
+        return;
+      case DW_FORM_strx1:
+        func(&ReadAttr<&FormReader::ReadIndexedString<1>>);
+        return;
+      case DW_FORM_strx2:
+        func(&ReadAttr<&FormReader::ReadIndexedString<2>>);
+        return;
+      case DW_FORM_strx3:
+        func(&ReadAttr<&FormReader::ReadIndexedString<3>>);
+        return;
+      case DW_FORM_strx4:
+        func(&ReadAttr<&FormReader::ReadIndexedString<4>>);
+        return;
       case DW_FORM_data1:
         func(&ReadAttr<&FormReader::ReadFixed<1>>);
         return;
@@ -823,6 +1402,22 @@ class FormReader<string_view> : public FormReaderBase<FormReader<string_view>> {
     StringTable table(reader_.dwarf().debug_str);
     *val_ = table.ReadEntry(ofs);
   }
+
+  template <class D>
+  void ReadLineString() {
+    D ofs = ReadMemcpy<D>(&data_);
+    StringTable table(reader_.dwarf().debug_line_str);
+    *val_ = table.ReadEntry(ofs);
+  }
+
+  template <size_t N>
+  void ReadIndexedString() {
+    *val_ = reader_.ReadIndexedString(ReadFixedUnsigned<N>(&data_));
+  }
+
+  void ReadVariableIndexedString() {
+    *val_ = reader_.ReadIndexedString(ReadLEB128<uint64_t>(&data_));
+  }
 };
 
 // FormReader for all integral types.  We accept any DW_FORM_data* forms (sign
@@ -836,12 +1431,13 @@ class FormReader<T, typename std::enable_if<std::is_integral<T>::value>::type>
   typedef FormReaderBase<ME> Base;
   typedef T type;
   using Base::data_;
+  using Base::reader_;
 
   FormReader(const DIEReader& reader, string_view data, T* val)
       : Base(reader, data), val_(val) {}
 
   template <class Func>
-  static void GetFunctionForForm(CompilationUnitSizes sizes, uint8_t form,
+  static void GetFunctionForForm(CompilationUnitSizes sizes, uint16_t form,
                                  Func func) {
     switch (form) {
       case DW_FORM_data1:
@@ -884,7 +1480,43 @@ class FormReader<T, typename std::enable_if<std::is_integral<T>::value>::type>
                  sizes.address_size);
         }
         return;
-
+      case DW_FORM_addrx:
+      case DW_FORM_GNU_addr_index:
+      case DW_FORM_addrx1:
+      case DW_FORM_addrx2:
+      case DW_FORM_addrx3:
+      case DW_FORM_addrx4:
+        // Indexed addresses are resolved through .debug_addr, so the result
+        // has the same requirements as DW_FORM_addr.
+        if (sizeof(T) < 8 || std::is_signed<T>::value) {
+          THROW("can't fit addrx into this type");
+        }
+        switch (form) {
+          case DW_FORM_addrx1:
+            func(&Base::template ReadAttr<&ME::ReadIndexedAddress<1>>);
+            break;
+          case DW_FORM_addrx2:
+            func(&Base::template ReadAttr<&ME::ReadIndexedAddress<2>>);
+            break;
+          case DW_FORM_addrx3:
+            func(&Base::template ReadAttr<&ME::ReadIndexedAddress<3>>);
+            break;
+          case DW_FORM_addrx4:
+            func(&Base::template ReadAttr<&ME::ReadIndexedAddress<4>>);
+            break;
+          default:
+            func(&Base::template ReadAttr<&ME::ReadVariableIndexedAddress>);
+            break;
+        }
+        return;
+      case DW_FORM_rnglistx:
+        // Resolved to an offset into .debug_rnglists, so that users can treat
+        // it exactly like DW_FORM_sec_offset.
+        if (sizeof(T) < 8 || std::is_signed<T>::value) {
+          THROW("can't fit rnglistx into this type");
+        }
+        func(&Base::template ReadAttr<&ME::ReadRangeListIndex>);
+        return;
       case DW_FORM_sec_offset:
         // We require FORM_addr to be parsed into 8 bytes, since there is always
         // the possibility of running into 64-bit files.
@@ -935,6 +1567,19 @@ class FormReader<T, typename std::enable_if<std::is_integral<T>::value>::type>
   void ReadVariable() {
     *val_ = ReadLEB128<T>(&data_);
   }
+
+  template <size_t N>
+  void ReadIndexedAddress() {
+    *val_ = reader_.ReadIndexedAddress(ReadFixedUnsigned<N>(&data_));
+  }
+
+  void ReadVariableIndexedAddress() {
+    *val_ = reader_.ReadIndexedAddress(ReadLEB128<uint64_t>(&data_));
+  }
+
+  void ReadRangeListIndex() {
+    *val_ = reader_.ReadIndexedRangeListOffset(ReadLEB128<uint64_t>(&data_));
+  }
 };
 
 // FormReader for bool.  The only types we expect for a bool field are
@@ -951,7 +1596,7 @@ class FormReader<bool> : public FormReaderBase<FormReader<bool>> {
       : Base(reader, data), val_(val) {}
 
   template <class Func>
-  static void GetFunctionForForm(const DIEReader& /*reader*/, uint8_t form,
+  static void GetFunctionForForm(CompilationUnitSizes /*sizes*/, uint16_t form,
                                  Func func) {
     switch (form) {
       case DW_FORM_flag:
@@ -993,33 +1638,48 @@ class FormReader<void> : public FormReaderBase<FormReader<void>> {
       : Base(reader, data) {}
 
   template <class Func>
-  static void GetFunctionForForm(CompilationUnitSizes sizes, uint8_t form,
+  static void GetFunctionForForm(CompilationUnitSizes sizes, uint16_t form,
                                  Func func) {
     switch (form) {
       case DW_FORM_flag_present:
+      case DW_FORM_implicit_const:
         func(&Base::template ReadAttr<&ME::DoNothing>);
         return;
       case DW_FORM_data1:
       case DW_FORM_ref1:
       case DW_FORM_flag:
+      case DW_FORM_strx1:
+      case DW_FORM_addrx1:
         func(&Base::template ReadAttr<&ME::SkipFixed<1>>);
         return;
       case DW_FORM_data2:
       case DW_FORM_ref2:
+      case DW_FORM_strx2:
+      case DW_FORM_addrx2:
         func(&Base::template ReadAttr<&ME::SkipFixed<2>>);
         return;
+      case DW_FORM_strx3:
+      case DW_FORM_addrx3:
+        func(&Base::template ReadAttr<&ME::SkipFixed<3>>);
+        return;
       case DW_FORM_data4:
       case DW_FORM_ref4:
+      case DW_FORM_ref_sup4:
+      case DW_FORM_strx4:
+      case DW_FORM_addrx4:
         func(&Base::template ReadAttr<&ME::SkipFixed<4>>);
         return;
       case DW_FORM_data8:
       case DW_FORM_ref8:
       case DW_FORM_ref_sig8:
+      case DW_FORM_ref_sup8:
         func(&Base::template ReadAttr<&ME::SkipFixed<8>>);
         return;
+      case DW_FORM_data16:
+        func(&Base::template ReadAttr<&ME::SkipFixed<16>>);
+        return;
       case DW_FORM_addr:
-      case DW_FORM_ref_addr:
-        if (sizes.address_size) {
+        if (sizes.address_size == 8) {
           func(&Base::template ReadAttr<&ME::SkipFixed<8>>);
         } else if (sizes.address_size == 4) {
           func(&Base::template ReadAttr<&ME::SkipFixed<4>>);
@@ -1027,8 +1687,18 @@ class FormReader<void> : public FormReaderBase<FormReader<void>> {
           THROWF("don't know how to skip address size $0", sizes.address_size);
         }
         return;
+      case DW_FORM_ref_addr:
+        // DWARF 2 had this as an address, but it became an offset in DWARF 3.
+        if (sizes.dwarf_version <= 2) {
+          GetFunctionForForm(sizes, DW_FORM_addr, func);
+        } else {
+          GetFunctionForForm(sizes, DW_FORM_sec_offset, func);
+        }
+        return;
       case DW_FORM_sec_offset:
       case DW_FORM_strp:
+      case DW_FORM_line_strp:
+      case DW_FORM_strp_sup:
         if (sizes.dwarf64) {
           func(&Base::template ReadAttr<&ME::SkipFixed<8>>);
         } else {
@@ -1038,6 +1708,12 @@ class FormReader<void> : public FormReaderBase<FormReader<void>> {
       case DW_FORM_sdata:
       case DW_FORM_udata:
       case DW_FORM_ref_udata:
+      case DW_FORM_strx:
+      case DW_FORM_addrx:
+      case DW_FORM_loclistx:
+      case DW_FORM_rnglistx:
+      case DW_FORM_GNU_str_index:
+      case DW_FORM_GNU_addr_index:
         func(&Base::template ReadAttr<&ME::SkipVariable>);
         return;
       case DW_FORM_block1:
@@ -1092,6 +1768,99 @@ class FormReader<void> : public FormReaderBase<FormReader<void>> {
   }
 };
 
+// The bases for the DWARF 5 indexed forms are attributes of the unit's root
+// DIE, but we need them before we can decode any indexed form (including ones
+// in the root DIE itself).  So we make a quick pass over the root DIE to find
+// them before any user reads its attributes.  The same pass picks up the
+// attributes that link skeleton and split units.
+void DIEReader::ReadUnitAttributes() {
+  str_offsets_base_ = 0;
+  addr_base_ = skeleton_addr_base_;
+  rnglists_base_ = 0;
+  gnu_ranges_base_ = 0;
+  unit_dwo_name_ = string_view();
+  unit_comp_dir_ = string_view();
+
+  if (unit_type_ == DW_UT_split_compile || unit_type_ == DW_UT_split_type) {
+    // Split units have no *_base attributes: their tables in the .dwo each
+    // have a single contribution, whose entries start right after its header.
+    str_offsets_base_ = unit_sizes_.dwarf64 ? 16 : 8;
+    rnglists_base_ = unit_sizes_.dwarf64 ? 20 : 12;
+  }
+
+  const AbbrevTable::Abbrev& abbrev = GetAbbrev();
+  bool has_unit_attributes = false;
+
+  for (const auto& attr : abbrev.attr) {
+    switch (attr.name) {
+      case DW_AT_str_offsets_base:
+      case DW_AT_addr_base:
+      case DW_AT_GNU_addr_base:
+      case DW_AT_rnglists_base:
+      case DW_AT_dwo_name:
+      case DW_AT_GNU_dwo_name:
+      case DW_AT_GNU_dwo_id:
+        has_unit_attributes = true;
+        break;
+    }
+  }
+
+  if (!has_unit_attributes) {
+    return;
+  }
+
+  // Strings may be indexed (DW_FORM_strx), so we read them in a second pass,
+  // once we know DW_AT_str_offsets_base.
+  ReadUnitAttributesPass(false);
+  ReadUnitAttributesPass(true);
+}
+
+void DIEReader::ReadUnitAttributesPass(bool strings) {
+  string_view data = remaining_;
+
+  for (const auto& attr : GetAbbrev().attr) {
+    uint64_t* base = nullptr;
+    string_view* str = nullptr;
+
+    switch (attr.name) {
+      case DW_AT_str_offsets_base:
+        base = &str_offsets_base_;
+        break;
+      case DW_AT_addr_base:
+      case DW_AT_GNU_addr_base:
+        base = &addr_base_;
+        break;
+      case DW_AT_rnglists_base:
+        base = &rnglists_base_;
+        break;
+      case DW_AT_GNU_ranges_base:
+        base = &gnu_ranges_base_;
+        break;
+      case DW_AT_GNU_dwo_id:
+        base = &unit_dwo_id_;
+        break;
+      case DW_AT_dwo_name:
+      case DW_AT_GNU_dwo_name:
+        str = &unit_dwo_name_;
+        break;
+      case DW_AT_comp_dir:
+        str = &unit_comp_dir_;
+        break;
+    }
+
+    if (base && !strings) {
+      data = GetFormDecodeFunc<uint64_t>(attr.form, unit_sizes_)(*this, data,
+                                                                 base);
+    } else if (str && strings) {
+      data = GetFormDecodeFunc<string_view>(attr.form, unit_sizes_)(
+          *this, data, str);
+    } else {
+      data = GetFormDecodeFunc<void>(attr.form, unit_sizes_)(*this, data,
+                                                             nullptr);
+    }
+  }
+}
+
 
 // ActionBuf ///////////////////////////////////////////////////////////////////
 
@@ -1099,6 +1868,23 @@ class FormReader<void> : public FormReaderBase<FormReader<void>> {
 // where to store the data) when a particular abbreviation is seen.  It is used
 // by the attribute readers.
 
+// Stores a DW_FORM_implicit_const value into a destination of type T.
+typedef void ImplicitConstFunc(int64_t value, void* val);
+
+template <class T, class Enable = void>
+struct ImplicitConstStorer {
+  static ImplicitConstFunc* Get() { return nullptr; }
+};
+
+template <class T>
+struct ImplicitConstStorer<
+    T, typename std::enable_if<std::is_integral<T>::value>::type> {
+  static ImplicitConstFunc* Get() { return &Store; }
+  static void Store(int64_t value, void* val) {
+    *static_cast<T*>(val) = static_cast<T>(value);
+  }
+};
+
 class ActionBuf {
  private:
   struct AttrAction {
@@ -1111,11 +1897,30 @@ class ActionBuf {
 
   struct IndexedAction {
     IndexedAction(size_t index_, FormDecodeFunc* func_, void* data_, bool* has_)
-        : index(index_), action(func_, data_, has_) {}
+        : index(index_), action(func_, data_, has_), implicit_const(nullptr) {}
     size_t index;         // The index where this action should go.
     AttrAction action;    // The action, but func will be nullptr if invalid.
+
+    // Set instead of action.func for DW_FORM_implicit_const attributes.
+    ImplicitConstFunc* implicit_const;
+  };
+
+  // DW_FORM_implicit_const attributes have no data in the DIE, so the action
+  // for them stores a constant from the abbreviation.  We keep the constant and
+  // its destination here and give the action a pointer to it.
+  struct ImplicitConst {
+    ImplicitConstFunc* store;
+    int64_t value;
+    void* data;
   };
 
+  static string_view ReadImplicitConst(const DIEReader& /*reader*/,
+                                       string_view data, void* val) {
+    auto implicit = static_cast<const ImplicitConst*>(val);
+    implicit->store(implicit->value, implicit->data);
+    return data;
+  }
+
  public:
   // Build a list of actions to perform for the given abbreviation in a
   // compilation unit with the given sizes.  Any attributes you want to parse
@@ -1135,7 +1940,8 @@ class ActionBuf {
   string_view ReadAttributes(const DIEReader& reader, string_view data) const;
 
  private:
-  std::vector<AttrAction> action_list_;
+  std::vector<AttrAction, DwarfAllocator<AttrAction>> action_list_;
+  std::vector<std::unique_ptr<ImplicitConst>> implicit_consts_;
 };
 
 ActionBuf::ActionBuf(const AbbrevTable::Abbrev& abbrev,
@@ -1155,14 +1961,23 @@ ActionBuf::ActionBuf(const AbbrevTable::Abbrev& abbrev,
 
   // Overwrite any entries for attributes we actually want to store somewhere.
   for (const auto& action : indexed_actions) {
-    if (action.action.func) {
+    if (action.action.func || action.implicit_const) {
       assert(action.index < action_list_.size());
       if (action_list_[action.index].data) {
         THROW(
             "internal error, specified same DWARF attribute more "
             "than once");
       }
-      action_list_[action.index] = action.action;
+      if (action.implicit_const) {
+        implicit_consts_.emplace_back(new ImplicitConst{
+            action.implicit_const, abbrev.attr[action.index].implicit_const,
+            action.action.data});
+        action_list_[action.index] =
+            AttrAction(&ReadImplicitConst, implicit_consts_.back().get(),
+                       action.action.has);
+      } else {
+        action_list_[action.index] = action.action;
+      }
     }
   }
 }
@@ -1174,6 +1989,16 @@ ActionBuf::IndexedAction ActionBuf::GetAction(uint16_t attr_name,
                                               void* data, bool* has) {
   for (size_t i = 0; i < abbrev.attr.size(); i++) {
     if (attr_name == abbrev.attr[i].name) {
+      if (abbrev.attr[i].form == DW_FORM_implicit_const) {
+        IndexedAction ret(i, nullptr, data, has);
+        ret.implicit_const = ImplicitConstStorer<T>::Get();
+        if (!ret.implicit_const) {
+          THROWF("don't know how to convert implicit_const to type $0",
+                 typeid(T).name());
+        }
+        return ret;
+      }
+
       FormDecodeFunc* func = GetFormDecodeFunc<T>(abbrev.attr[i].form, sizes);
 
       if (!func) {
@@ -1283,7 +2108,7 @@ class FixedAttrReader {
 
   // Keyed by abbrev code, this stores a list of attribute actions and
   // associated data pointers.
-  typedef std::unordered_map<uint32_t, ActionBuf> AbbrevCodeMap;
+  typedef DwarfMap<uint32_t, ActionBuf> AbbrevCodeMap;
 
   const ActionBuf& GetActionBuf(const DIEReader& reader) {
     if (actions_.size() <= reader.abbrev_version()) {
@@ -1322,7 +2147,7 @@ class FixedAttrReader {
 
   // Indexed by DIEReader::abbrev_version(), so we have a different code map
   // when the abbreviation table or compilation unit sizes change.
-  std::vector<AbbrevCodeMap> actions_;
+  std::vector<AbbrevCodeMap, DwarfAllocator<AbbrevCodeMap>> actions_;
 };
 
 template <class... Args>
@@ -1395,16 +2220,12 @@ class LineInfoReader {
     }
 
     auto& ret = expanded_filenames_[index];
-    if (ret.empty()) {
+    if (!ret) {
       const FileName& filename = filenames_[index];
       string_view directory = include_directories_[filename.directory_index];
-      ret = std::string(directory);
-      if (!ret.empty()) {
-        ret += "/";
-      }
-      ret += std::string(filename.name);
+      ret = &InternFilename(directory, filename.name);
     }
-    return ret;
+    return *ret;
   }
 
  private:
@@ -1423,7 +2244,15 @@ class LineInfoReader {
   std::vector<string_view> include_directories_;
   std::vector<FileName> filenames_;
   std::vector<uint8_t> standard_opcode_lengths_;
-  std::vector<std::string> expanded_filenames_;
+  std::vector<const std::string*> expanded_filenames_;
+
+  // The same files (headers especially) appear in the line tables of many
+  // units, so we only expand each (directory, name) pair once.  The keys point
+  // into the DWARF sections, so they outlive every unit.  Unlike the rest of
+  // our state, this is kept when seeking to another unit.
+  const std::string& InternFilename(string_view directory, string_view name);
+  std::map<std::pair<string_view, string_view>, std::string>
+      interned_filenames_;
 
   string_view remaining_;
 
@@ -1461,8 +2290,144 @@ class LineInfoReader {
   void SpecialOpcodeAdvance(uint8_t op) {
     Advance(AdjustedOpcode(op) / params_.line_range);
   }
+
+  // DWARF 5 replaced the fixed include_directories/file_names tables with
+  // self-describing ones: each table is preceded by a list of (content type,
+  // form) pairs that describe the fields of every entry.
+  typedef std::vector<std::pair<uint64_t, uint16_t>> EntryFormat;
+  void ReadEntryFormat(string_view* data, EntryFormat* format);
+  void ReadDirectoriesV5(string_view* data);
+  void ReadFilenamesV5(string_view* data);
+  string_view ReadFormString(uint16_t form, string_view* data);
+  uint64_t ReadFormInteger(uint16_t form, string_view* data);
+  void SkipForm(uint16_t form, string_view* data);
 };
 
+const std::string& LineInfoReader::InternFilename(string_view directory,
+                                                  string_view name) {
+  std::string& ret = interned_filenames_[std::make_pair(directory, name)];
+  if (ret.empty()) {
+    ret.reserve(directory.size() + name.size() + 1);
+    ret.append(directory.data(), directory.size());
+    if (!ret.empty()) {
+      ret += "/";
+    }
+    ret.append(name.data(), name.size());
+  }
+  return ret;
+}
+
+void LineInfoReader::ReadEntryFormat(string_view* data, EntryFormat* format) {
+  uint8_t count = ReadMemcpy<uint8_t>(data);
+  format->clear();
+  for (uint8_t i = 0; i < count; i++) {
+    uint64_t content_type = ReadLEB128<uint64_t>(data);
+    uint16_t form = ReadLEB128<uint16_t>(data);
+    format->push_back(std::make_pair(content_type, form));
+  }
+}
+
+string_view LineInfoReader::ReadFormString(uint16_t form, string_view* data) {
+  switch (form) {
+    case DW_FORM_string:
+      return ReadNullTerminated(data);
+    case DW_FORM_line_strp:
+      return StringTable(file_.debug_line_str)
+          .ReadEntry(sizes_.ReadDWARFOffset(data));
+    case DW_FORM_strp:
+      return StringTable(file_.debug_str)
+          .ReadEntry(sizes_.ReadDWARFOffset(data));
+    default:
+      THROWF("unexpected form $0 for string in DWARF line table", form);
+  }
+}
+
+uint64_t LineInfoReader::ReadFormInteger(uint16_t form, string_view* data) {
+  switch (form) {
+    case DW_FORM_data1:
+      return ReadMemcpy<uint8_t>(data);
+    case DW_FORM_data2:
+      return ReadMemcpy<uint16_t>(data);
+    case DW_FORM_data4:
+      return ReadMemcpy<uint32_t>(data);
+    case DW_FORM_data8:
+      return ReadMemcpy<uint64_t>(data);
+    case DW_FORM_udata:
+      return ReadLEB128<uint64_t>(data);
+    default:
+      THROWF("unexpected form $0 for integer in DWARF line table", form);
+  }
+}
+
+void LineInfoReader::SkipForm(uint16_t form, string_view* data) {
+  switch (form) {
+    case DW_FORM_data16:
+      SkipBytes(16, data);
+      break;
+    case DW_FORM_block:
+      SkipBytes(ReadLEB128<uint64_t>(data), data);
+      break;
+    case DW_FORM_string:
+    case DW_FORM_line_strp:
+    case DW_FORM_strp:
+      ReadFormString(form, data);
+      break;
+    default:
+      ReadFormInteger(form, data);
+      break;
+  }
+}
+
+void LineInfoReader::ReadDirectoriesV5(string_view* data) {
+  EntryFormat format;
+  ReadEntryFormat(data, &format);
+  uint64_t count = ReadLEB128<uint64_t>(data);
+
+  for (uint64_t i = 0; i < count; i++) {
+    string_view dir;
+    for (const auto& field : format) {
+      if (field.first == DW_LNCT_path) {
+        dir = ReadFormString(field.second, data);
+      } else {
+        SkipForm(field.second, data);
+      }
+    }
+
+    // Unlike earlier versions, directory 0 is explicit: it is the compilation
+    // directory.  We leave it empty, as it is implicitly in earlier versions,
+    // so that files in it get the same relative labels as before.
+    include_directories_.push_back(i == 0 ? string_view() : dir);
+  }
+}
+
+void LineInfoReader::ReadFilenamesV5(string_view* data) {
+  EntryFormat format;
+  ReadEntryFormat(data, &format);
+  uint64_t count = ReadLEB128<uint64_t>(data);
+
+  for (uint64_t i = 0; i < count; i++) {
+    FileName file_name = FileName();
+    for (const auto& field : format) {
+      switch (field.first) {
+        case DW_LNCT_path:
+          file_name.name = ReadFormString(field.second, data);
+          break;
+        case DW_LNCT_directory_index:
+          file_name.directory_index = ReadFormInteger(field.second, data);
+          break;
+        default:
+          SkipForm(field.second, data);
+          break;
+      }
+    }
+
+    if (file_name.directory_index >= include_directories_.size()) {
+      THROW("directory index out of range");
+    }
+    filenames_.push_back(file_name);
+  }
+}
+
 void LineInfoReader::SeekToOffset(uint64_t offset, uint8_t address_size) {
   string_view data = file_.debug_line;
   SkipBytes(offset, &data);
@@ -1470,12 +2435,24 @@ void LineInfoReader::SeekToOffset(uint64_t offset, uint8_t address_size) {
   sizes_.address_size = address_size;
   data = sizes_.ReadInitialLength(&data);
   uint16_t version = ReadMemcpy<uint16_t>(&data);
+
+  if (version > 5) {
+    THROW("DWARF line info is in a version we don't understand");
+  }
+
+  if (version >= 5) {
+    sizes_.address_size = ReadMemcpy<uint8_t>(&data);
+    if (ReadMemcpy<uint8_t>(&data) != 0) {
+      THROW("we don't know how to handle segmented addresses.");
+    }
+  }
+
   uint64_t header_length = sizes_.ReadDWARFOffset(&data);
   string_view program = data;
   SkipBytes(header_length, &program);
 
   params_.minimum_instruction_length = ReadMemcpy<uint8_t>(&data);
-  if (version == 4) {
+  if (version >= 4) {
     params_.maximum_operations_per_instruction = ReadMemcpy<uint8_t>(&data);
   } else {
     params_.maximum_operations_per_instruction = 1;
@@ -1493,8 +2470,20 @@ void LineInfoReader::SeekToOffset(uint64_t offset, uint8_t address_size) {
     standard_opcode_lengths_[i] = ReadMemcpy<uint8_t>(&data);
   }
 
-  // Read include_directories.
   include_directories_.clear();
+  filenames_.clear();
+  expanded_filenames_.clear();
+
+  if (version >= 5) {
+    ReadDirectoriesV5(&data);
+    ReadFilenamesV5(&data);
+    info_ = LineInfo(params_.default_is_stmt);
+    remaining_ = program;
+    shadow_ = false;
+    return;
+  }
+
+  // Read include_directories.
 
   // Implicit current directory entry.
   include_directories_.push_back(string_view());
@@ -1508,8 +2497,6 @@ void LineInfoReader::SeekToOffset(uint64_t offset, uint8_t address_size) {
   }
 
   // Read file_names.
-  filenames_.clear();
-  expanded_filenames_.clear();
 
   // Filename 0 is unused.
   filenames_.push_back(FileName());
@@ -1665,52 +2652,184 @@ bool LineInfoReader::ReadLineInfo() {
   }
 }
 
+
+// Split DWARF /////////////////////////////////////////////////////////////////
+
+// A .dwp package concatenates the sections of many .dwo files.  Its
+// .debug_cu_index is a hash table from dwo id to a row of (offset, size)
+// contributions to each section.
+
+void ReadDWPUnits(const File& dwp, std::unordered_map<uint64_t, File>* units) {
+  string_view data = dwp.debug_cu_index;
+
+  // Version 2 is the GNU extension, version 5 is DWARF 5.  The latter is a
+  // 2-byte version and 2 bytes of padding, which reads the same.
+  uint32_t version = ReadMemcpy<uint32_t>(&data);
+  if (version != 2 && version != 5) {
+    THROWF("unknown .debug_cu_index version: $0", version);
+  }
+
+  uint32_t section_count = ReadMemcpy<uint32_t>(&data);
+  uint32_t unit_count = ReadMemcpy<uint32_t>(&data);
+  uint32_t slot_count = ReadMemcpy<uint32_t>(&data);
+
+  string_view hashes = ReadPiece(slot_count * 8, &data);
+  string_view indexes = ReadPiece(slot_count * 4, &data);
+  string_view section_ids = ReadPiece(section_count * 4, &data);
+  string_view offsets = data;
+
+  for (uint32_t i = 0; i < slot_count; i++) {
+    uint64_t dwo_id = ReadMemcpy<uint64_t>(&hashes);
+    uint32_t row = ReadMemcpy<uint32_t>(&indexes);
+
+    if (row == 0) {
+      continue;  // Empty slot.
+    }
+
+    // Rows are 1-based; the size table follows all rows of the offset table.
+    string_view ids = section_ids;
+    string_view row_offsets = offsets;
+    SkipBytes((row - 1) * section_count * 4, &row_offsets);
+    string_view row_sizes = offsets;
+    SkipBytes((uint64_t(unit_count) + row - 1) * section_count * 4,
+              &row_sizes);
+
+    // Shared sections, and ones we don't use, are passed through unchanged.
+    File& unit = (*units)[dwo_id];
+    unit = dwp;
+    unit.debug_cu_index = string_view();
+
+    for (uint32_t j = 0; j < section_count; j++) {
+      uint32_t id = ReadMemcpy<uint32_t>(&ids);
+      uint32_t offset = ReadMemcpy<uint32_t>(&row_offsets);
+      uint32_t size = ReadMemcpy<uint32_t>(&row_sizes);
+      string_view* section = nullptr;
+
+      switch (id) {
+        case DW_SECT_INFO:
+          section = &unit.debug_info;
+          break;
+        case DW_SECT_ABBREV:
+          section = &unit.debug_abbrev;
+          break;
+        case DW_SECT_LINE:
+          section = &unit.debug_line;
+          break;
+        case DW_SECT_STR_OFFSETS:
+          section = &unit.debug_str_offsets;
+          break;
+        case DW_SECT_RNGLISTS:
+          if (version == 5) {
+            section = &unit.debug_rnglists;
+          }
+          break;
+      }
+
+      if (section) {
+        SkipBytes(offset, section);
+        *section = ReadPiece(size, section);
+      }
+    }
+  }
+}
+
 } // namespace dwarf
 
 
 // Bloaty DWARF Data Sources ///////////////////////////////////////////////////
 
+// If |skeleton| is at a skeleton unit whose split unit we can find, returns a
+// reader positioned at the split unit's root DIE.  Otherwise returns nullptr.
+static std::unique_ptr<dwarf::DIEReader> OpenSplitUnit(
+    const dwarf::File& file, const dwarf::DIEReader& skeleton) {
+  if (!file.split_loader || skeleton.unit_dwo_name().empty()) {
+    return nullptr;
+  }
+
+  const dwarf::File* split = file.split_loader->GetSplitUnit(
+      skeleton.unit_dwo_id(), skeleton.unit_comp_dir(),
+      skeleton.unit_dwo_name());
+
+  if (!split) {
+    return nullptr;
+  }
+
+  std::unique_ptr<dwarf::DIEReader> reader(new dwarf::DIEReader(*split));
+  reader->SetSkeleton(skeleton);
+
+  if (reader->SeekToStart(dwarf::DIEReader::Section::kDebugInfo)) {
+    do {
+      if (reader->unit_dwo_id() == skeleton.unit_dwo_id() &&
+          reader->unit_type() != DW_UT_split_type) {
+        return reader;
+      }
+    } while (reader->NextCompilationUnit());
+  }
+
+  return nullptr;
+}
+
+// Maps compilation unit offset -> source filename
+// Lazily initialized.
+class FilenameMap {
+ public:
+  FilenameMap(const dwarf::File& file)
+      : file_(file),
+        die_reader_(file),
+        attr_reader_(&die_reader_, {DW_AT_name}),
+        missing_("[DWARF is missing filename]") {}
+
+  std::string GetFilename(uint64_t compilation_unit_offset) {
+    auto& name = map_[compilation_unit_offset];
+    if (name.empty()) {
+      name = LookupFilename(compilation_unit_offset);
+    }
+    return name;
+  }
+
+ private:
+  std::string LookupFilename(uint64_t compilation_unit_offset) {
+    auto section = dwarf::DIEReader::Section::kDebugInfo;
+    if (!die_reader_.SeekToCompilationUnit(section, compilation_unit_offset)) {
+      return missing_;
+    }
+
+    // Skeleton units don't have a name, but their split units do.
+    auto split_reader = OpenSplitUnit(file_, die_reader_);
+    if (split_reader) {
+      dwarf::FixedAttrReader<string_view> split_attr_reader(
+          split_reader.get(), {DW_AT_name});
+      return ReadUnitName(split_reader.get(), &split_attr_reader);
+    }
+
+    return ReadUnitName(&die_reader_, &attr_reader_);
+  }
+
+  std::string ReadUnitName(dwarf::DIEReader* reader,
+                           dwarf::FixedAttrReader<string_view>* attr_reader) {
+    if (reader->GetTag() == DW_TAG_compile_unit &&
+        (attr_reader->ReadAttributes(reader),
+         attr_reader->HasAttribute<0>())) {
+      return std::string(attr_reader->GetAttribute<0>());
+    } else {
+      return missing_;
+    }
+  }
+
+  const dwarf::File& file_;
+  dwarf::DIEReader die_reader_;
+  dwarf::FixedAttrReader<string_view> attr_reader_;
+  std::unordered_map<uint64_t, std::string> map_;
+  std::string missing_;
+};
+
 // The DWARF .debug_aranges section should, in theory, give us exactly the
 // information we need to map file ranges in linked binaries to compilation
 // units from where that code came.  However, .debug_aranges is often incomplete
 // or missing completely, so we use it as just one of several data sources for
 // the "compileunits" data source.
 static bool ReadDWARFAddressRanges(const dwarf::File& file, RangeSink* sink) {
-  // Maps compilation unit offset -> source filename
-  // Lazily initialized.
-  class FilenameMap {
-   public:
-    FilenameMap(const dwarf::File& file)
-        : die_reader_(file),
-          attr_reader_(&die_reader_, {DW_AT_name}),
-          missing_("[DWARF is missing filename]") {}
-
-    std::string GetFilename(uint64_t compilation_unit_offset) {
-      auto& name = map_[compilation_unit_offset];
-      if (name.empty()) {
-        name = LookupFilename(compilation_unit_offset);
-      }
-      return name;
-    }
-
-   private:
-    std::string LookupFilename(uint64_t compilation_unit_offset) {
-      auto section = dwarf::DIEReader::Section::kDebugInfo;
-      if (die_reader_.SeekToCompilationUnit(section, compilation_unit_offset) &&
-          die_reader_.GetTag() == DW_TAG_compile_unit &&
-          (attr_reader_.ReadAttributes(&die_reader_),
-           attr_reader_.HasAttribute<0>())) {
-        return std::string(attr_reader_.GetAttribute<0>());
-      } else {
-        return missing_;
-      }
-    }
-
-    dwarf::DIEReader die_reader_;
-    dwarf::FixedAttrReader<string_view> attr_reader_;
-    std::unordered_map<uint64_t, std::string> map_;
-    std::string missing_;
-  } map(file);
+  FilenameMap map(file);
 
   dwarf::AddressRanges ranges(file.debug_aranges);
 
@@ -1726,66 +2845,123 @@ static bool ReadDWARFAddressRanges(const dwarf::File& file, RangeSink* sink) {
   return true;
 }
 
-void AddDIE(const std::string& name,
-            const dwarf::FixedAttrReader<string_view, string_view, uint64_t,
-                                         uint64_t>& attr,
-            const SymbolTable& symtab, RangeSink* sink) {
-  uint64_t low_pc = attr.GetAttribute<2>();
-  uint64_t high_pc = attr.GetAttribute<3>();
+// Uses .debug_names or .gdb_index, if present, to attribute symbols to
+// compilation units.  Returns false if there is no index we can use.
+//
+// The index is only a fast path: it can't resolve names that several units
+// define, and its names are source names, which don't match the mangled names
+// in the symbol table.  So the .debug_info offsets of units with names it
+// couldn't resolve are added to |units_to_walk|, and the caller still has to
+// read all of the DIEs of those units.
+static bool ReadDWARFNameIndex(const dwarf::File& file,
+                               const SymbolTable& symtab, RangeSink* sink,
+                               std::unordered_set<uint64_t>* units_to_walk) {
+  dwarf::NameIndex index;
+
+  if (!file.debug_names.empty()) {
+    if (!index.ReadDebugNames(file.debug_names, file.debug_str)) {
+      return false;
+    }
+  } else if (!file.gdb_index.empty()) {
+    if (!index.ReadGdbIndex(file.gdb_index)) {
+      return false;
+    }
+  } else {
+    return false;
+  }
 
-  if (attr.HasAttribute<2>() && attr.HasAttribute<3>()) {
-    sink->AddVMRangeIgnoreDuplicate(low_pc, high_pc - low_pc, name);
+  FilenameMap map(file);
+  const auto& unit_offsets = index.unit_offsets();
+
+  for (const auto& range : index.address_ranges()) {
+    sink->AddVMRangeIgnoreDuplicate(range.low, range.high - range.low,
+                                    map.GetFilename(unit_offsets[range.unit]));
   }
 
-  if (attr.HasAttribute<1>()) {
-    auto it = symtab.find(attr.GetAttribute<1>());
+  // An index name that isn't in the symbol table may just have no symbol (if
+  // it was always inlined, say), but if there are mangled names it is more
+  // likely to be one of those.
+  auto mangled = symtab.lower_bound("_Z");
+  bool have_mangled_names =
+      mangled != symtab.end() && absl::StartsWith(mangled->first, "_Z");
+
+  for (const auto& name : index.names()) {
+    auto it = symtab.find(name.first);
     if (it != symtab.end()) {
       sink->AddVMRangeIgnoreDuplicate(it->second.first, it->second.second,
-                                      name);
+                                      map.GetFilename(unit_offsets[name.second]));
+    } else if (have_mangled_names) {
+      units_to_walk->insert(unit_offsets[name.second]);
     }
   }
-}
-
-// The DWARF debug info can help us get compileunits info.  DIEs for compilation
-// units, functions, and global variables often have attributes that will
-// resolve to addresses.
-static void ReadDWARFDebugInfo(const dwarf::File& file,
-                               const SymbolTable& symtab, RangeSink* sink) {
-  dwarf::DIEReader die_reader(file);
-  dwarf::FixedAttrReader<string_view, string_view, uint64_t, uint64_t>
-      attr_reader(&die_reader, {DW_AT_name, DW_AT_linkage_name, DW_AT_low_pc,
-                                 DW_AT_high_pc});
 
-  if (!die_reader.SeekToStart(dwarf::DIEReader::Section::kDebugInfo)) {
-    WARN("debug info is present, but empty");
-    return;
+  for (uint32_t unit : index.ambiguous_units()) {
+    units_to_walk->insert(unit_offsets[unit]);
   }
 
-  do {
-    attr_reader.ReadAttributes(&die_reader);
-    std::string compileunit_name = std::string(attr_reader.GetAttribute<0>());
-    if (!compileunit_name.empty()) {
-      AddDIE(compileunit_name, attr_reader, symtab, sink);
+  return true;
+}
 
-      while (die_reader.NextDIE()) {
-        attr_reader.ReadAttributes(&die_reader);
-        AddDIE(compileunit_name, attr_reader, symtab, sink);
+// Since DWARF 4, DW_AT_high_pc may be encoded as a constant, in which case it
+// is an offset from DW_AT_low_pc instead of an address.
+static bool HighPCIsOffset(const dwarf::DIEReader& die_reader) {
+  for (const auto& attr : die_reader.GetAbbrev().attr) {
+    if (attr.name == DW_AT_high_pc) {
+      switch (attr.form) {
+        case DW_FORM_addr:
+        case DW_FORM_addrx:
+        case DW_FORM_addrx1:
+        case DW_FORM_addrx2:
+        case DW_FORM_addrx3:
+        case DW_FORM_addrx4:
+        case DW_FORM_GNU_addr_index:
+          return false;
+        default:
+          return true;
       }
     }
-  } while (die_reader.NextCompilationUnit());
+  }
+  return false;
 }
 
-void ReadDWARFCompileUnits(const dwarf::File& file, const SymbolTable& symtab,
-                           RangeSink* sink) {
-  if (!file.debug_info.size()) {
-    THROW("missing debug info");
+typedef dwarf::FixedAttrReader<string_view, string_view, uint64_t, uint64_t,
+                               uint64_t, uint64_t>
+    DIEAttrReader;
+
+static const DwarfAttribute kDIEAttributes[] = {
+    DW_AT_name,    DW_AT_linkage_name, DW_AT_low_pc,
+    DW_AT_high_pc, DW_AT_ranges,       DW_AT_stmt_list};
+
+void AddDIE(const std::string& name, const dwarf::DIEReader& die_reader,
+            uint64_t unit_low_pc, const DIEAttrReader& attr,
+            const SymbolTable& symtab, RangeSink* sink) {
+  uint64_t low_pc = attr.GetAttribute<2>();
+  uint64_t high_pc = attr.GetAttribute<3>();
+
+  if (attr.HasAttribute<2>() && attr.HasAttribute<3>()) {
+    if (HighPCIsOffset(die_reader)) {
+      high_pc += low_pc;
+    }
+    sink->AddVMRangeIgnoreDuplicate(low_pc, high_pc - low_pc, name);
   }
 
-  if (file.debug_aranges.size()) {
-    ReadDWARFAddressRanges(file, sink);
+  // Non-contiguous code (eg. a function split into hot and cold parts, or a
+  // compilation unit with more than one text section) is described by a range
+  // list instead.
+  if (attr.HasAttribute<4>()) {
+    dwarf::ReadRangeList(die_reader, unit_low_pc, attr.GetAttribute<4>(),
+                         [sink, &name](uint64_t addr, uint64_t size) {
+                           sink->AddVMRangeIgnoreDuplicate(addr, size, name);
+                         });
   }
 
-  ReadDWARFDebugInfo(file, symtab, sink);
+  if (attr.HasAttribute<1>()) {
+    auto it = symtab.find(attr.GetAttribute<1>());
+    if (it != symtab.end()) {
+      sink->AddVMRangeIgnoreDuplicate(it->second.first, it->second.second,
+                                      name);
+    }
+  }
 }
 
 static std::string LineInfoKey(const std::string& file, uint32_t line,
@@ -1802,16 +2978,30 @@ static void ReadDWARFStmtList(bool include_line,
                               RangeSink* sink) {
   uint64_t span_startaddr = 0;
   std::string last_source;
+  std::string name;
+  bool have_name = false;
+  uint32_t last_file = 0;
+  uint32_t last_line = 0;
 
   while (line_info_reader->ReadLineInfo()) {
     const auto& line_info = line_info_reader->lineinfo();
     auto addr = line_info.address;
     auto number = line_info.line;
-    auto name =
-        line_info.end_sequence
-            ? last_source
-            : LineInfoKey(line_info_reader->GetExpandedFilename(line_info.file),
-                          number, include_line);
+
+    // Consecutive rows very often have the same file and line (they differ in
+    // column or flags), so we only rebuild the label when it could change.
+    if (line_info.end_sequence) {
+      name = last_source;
+      have_name = false;
+    } else if (!have_name || line_info.file != last_file ||
+               (include_line && number != last_line)) {
+      name = LineInfoKey(line_info_reader->GetExpandedFilename(line_info.file),
+                         number, include_line);
+      have_name = true;
+      last_file = line_info.file;
+      last_line = number;
+    }
+
     if (!span_startaddr) {
       span_startaddr = addr;
     } else if (line_info.end_sequence ||
@@ -1827,6 +3017,124 @@ static void ReadDWARFStmtList(bool include_line,
   }
 }
 
+// The DWARF debug info can help us get compileunits info.  DIEs for compilation
+// units, functions, and global variables often have attributes that will
+// resolve to addresses.
+//
+// When |units_to_walk| is non-null, only the root DIE is read for units that
+// aren't in it.  If |inlines_sink| is non-null, we also read the line table of
+// each unit into it, saving a separate pass over the units.
+static void ReadDWARFDebugInfo(
+    const dwarf::File& file, const SymbolTable& symtab,
+    const std::unordered_set<uint64_t>* units_to_walk, RangeSink* sink,
+    RangeSink* inlines_sink) {
+  dwarf::DIEReader die_reader(file);
+  DIEAttrReader attr_reader(&die_reader, kDIEAttributes);
+  dwarf::LineInfoReader line_info_reader(file);
+
+  // Units can share a line table, which we only need to read once.
+  std::unordered_set<uint64_t> stmt_lists_read;
+
+  if (!die_reader.SeekToStart(dwarf::DIEReader::Section::kDebugInfo)) {
+    WARN("debug info is present, but empty");
+    return;
+  }
+
+  do {
+    BLOATY_TRACE_SPAN("compile unit", sink->input_file().filename());
+
+    // For split DWARF, the skeleton unit only has the unit's address ranges;
+    // its name and all other DIEs are in the split unit.
+    auto split_reader = OpenSplitUnit(file, die_reader);
+    dwarf::DIEReader* unit_reader =
+        split_reader ? split_reader.get() : &die_reader;
+    std::unique_ptr<DIEAttrReader> split_attr_reader;
+    DIEAttrReader* unit_attr_reader = &attr_reader;
+
+    if (split_reader) {
+      split_attr_reader.reset(
+          new DIEAttrReader(split_reader.get(), kDIEAttributes));
+      unit_attr_reader = split_attr_reader.get();
+    }
+
+    attr_reader.ReadAttributes(&die_reader);
+    uint64_t unit_low_pc =
+        attr_reader.HasAttribute<2>() ? attr_reader.GetAttribute<2>() : 0;
+
+    // The line table is always in the main binary, even for split DWARF.
+    if (inlines_sink && attr_reader.HasAttribute<5>() &&
+        stmt_lists_read.insert(attr_reader.GetAttribute<5>()).second) {
+      line_info_reader.SeekToOffset(attr_reader.GetAttribute<5>(),
+                                    die_reader.unit_sizes().address_size);
+      ReadDWARFStmtList(true, &line_info_reader, inlines_sink);
+    }
+
+    if (split_reader) {
+      unit_attr_reader->ReadAttributes(unit_reader);
+    }
+
+    bool units_only =
+        units_to_walk && units_to_walk->count(die_reader.unit_offset()) == 0;
+    std::string compileunit_name =
+        std::string(unit_attr_reader->GetAttribute<0>());
+    if (!compileunit_name.empty()) {
+      if (split_reader) {
+        AddDIE(compileunit_name, die_reader, unit_low_pc, attr_reader, symtab,
+               sink);
+      }
+      AddDIE(compileunit_name, *unit_reader, unit_low_pc, *unit_attr_reader,
+             symtab, sink);
+
+      while (!units_only && unit_reader->NextDIE()) {
+        unit_attr_reader->ReadAttributes(unit_reader);
+        AddDIE(compileunit_name, *unit_reader, unit_low_pc, *unit_attr_reader,
+               symtab, sink);
+      }
+    }
+  } while (die_reader.NextCompilationUnit());
+}
+
+static void DoReadDWARFCompileUnits(const dwarf::File& file,
+                                    const SymbolTable& symtab, RangeSink* sink,
+                                    RangeSink* inlines_sink) {
+  if (!file.debug_info.size()) {
+    THROW("missing debug info");
+  }
+
+  if (file.debug_aranges.size()) {
+    BLOATY_TRACE_SPAN("debug_aranges", sink->input_file().filename());
+    ReadDWARFAddressRanges(file, sink);
+  }
+
+  // A name index tells us which unit defines each function and variable, so
+  // from the DIEs we then only need each unit's own address ranges, except in
+  // units where the index left some names unresolved.
+  bool have_index;
+  std::unordered_set<uint64_t> units_to_walk;
+  {
+    BLOATY_TRACE_SPAN("name index", sink->input_file().filename());
+    have_index = ReadDWARFNameIndex(file, symtab, sink, &units_to_walk);
+  }
+  ReadDWARFDebugInfo(file, symtab, have_index ? &units_to_walk : nullptr, sink,
+                     inlines_sink);
+}
+
+void ReadDWARFCompileUnits(const dwarf::File& file, const SymbolTable& symtab,
+                           RangeSink* sink) {
+  DoReadDWARFCompileUnits(file, symtab, sink, nullptr);
+}
+
+void ReadDWARFCompileUnitsAndInlines(const dwarf::File& file,
+                                     const SymbolTable& symtab,
+                                     RangeSink* compileunits_sink,
+                                     RangeSink* inlines_sink) {
+  if (!file.debug_line.size()) {
+    THROW("no debug info");
+  }
+
+  DoReadDWARFCompileUnits(file, symtab, compileunits_sink, inlines_sink);
+}
+
 void ReadDWARFInlines(const dwarf::File& file, RangeSink* sink,
                       bool include_line) {
   if (!file.debug_info.size() || !file.debug_line.size()) {
@@ -1837,14 +3145,19 @@ void ReadDWARFInlines(const dwarf::File& file, RangeSink* sink,
   dwarf::LineInfoReader line_info_reader(file);
   dwarf::FixedAttrReader<uint64_t> attr_reader(&die_reader, {DW_AT_stmt_list});
 
+  // Units can share a line table, which we only need to read once.
+  std::unordered_set<uint64_t> stmt_lists_read;
+
   if (!die_reader.SeekToStart(dwarf::DIEReader::Section::kDebugInfo)) {
     WARN("debug info is present, but empty");
   }
 
   while (true) {
+    BLOATY_TRACE_SPAN("compile unit", sink->input_file().filename());
     attr_reader.ReadAttributes(&die_reader);
 
-    if (attr_reader.HasAttribute<0>()) {
+    if (attr_reader.HasAttribute<0>() &&
+        stmt_lists_read.insert(attr_reader.GetAttribute<0>()).second) {
       uint64_t offset = attr_reader.GetAttribute<0>();
       line_info_reader.SeekToOffset(offset,
                                     die_reader.unit_sizes().address_size);
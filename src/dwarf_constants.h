@@ -87,6 +87,8 @@ enum DwarfTag {
   DW_TAG_type_unit = 0x41,
   DW_TAG_rvalue_reference_type = 0x42,
   DW_TAG_template_alias = 0x43,
+  // DWARF 5.
+  DW_TAG_skeleton_unit = 0x4a,
   DW_TAG_lo_user = 0x4080,
   DW_TAG_hi_user = 0xffff,
   // SGI/MIPS Extensions.
@@ -152,9 +154,27 @@ enum DwarfForm {
   DW_FORM_exprloc = 0x18,
   DW_FORM_flag_present = 0x19,
   // DWARF 5.
+  DW_FORM_strx = 0x1a,
+  DW_FORM_addrx = 0x1b,
+  DW_FORM_ref_sup4 = 0x1c,
+  DW_FORM_strp_sup = 0x1d,
+  DW_FORM_data16 = 0x1e,
   DW_FORM_line_strp = 0x1f,
   // DWARF 4.
   DW_FORM_ref_sig8 = 0x20,
+  // DWARF 5.
+  DW_FORM_implicit_const = 0x21,
+  DW_FORM_loclistx = 0x22,
+  DW_FORM_rnglistx = 0x23,
+  DW_FORM_ref_sup8 = 0x24,
+  DW_FORM_strx1 = 0x25,
+  DW_FORM_strx2 = 0x26,
+  DW_FORM_strx3 = 0x27,
+  DW_FORM_strx4 = 0x28,
+  DW_FORM_addrx1 = 0x29,
+  DW_FORM_addrx2 = 0x2a,
+  DW_FORM_addrx3 = 0x2b,
+  DW_FORM_addrx4 = 0x2c,
   // Extensions for Fission.  See http://gcc.gnu.org/wiki/DebugFission.
   DW_FORM_GNU_addr_index = 0x1f01,
   DW_FORM_GNU_str_index = 0x1f02
@@ -261,6 +281,15 @@ enum DwarfAttribute {
   DW_AT_const_expr = 0x6c,
   DW_AT_enum_class = 0x6d,
   DW_AT_linkage_name = 0x6e,
+  // DWARF 5 values.
+  DW_AT_string_length_bit_size = 0x6f,
+  DW_AT_string_length_byte_size = 0x70,
+  DW_AT_rank = 0x71,
+  DW_AT_str_offsets_base = 0x72,
+  DW_AT_addr_base = 0x73,
+  DW_AT_rnglists_base = 0x74,
+  DW_AT_dwo_name = 0x76,
+  DW_AT_loclists_base = 0x8c,
   // SGI/MIPS extensions.
   DW_AT_MIPS_fde = 0x2001,
   DW_AT_MIPS_loop_begin = 0x2002,
@@ -351,6 +380,37 @@ enum DwarfAttribute {
 };
 
 
+// Unit header unit type encodings (DWARF 5).
+enum DwarfUnitType {
+  DW_UT_compile = 0x01,
+  DW_UT_type = 0x02,
+  DW_UT_partial = 0x03,
+  DW_UT_skeleton = 0x04,
+  DW_UT_split_compile = 0x05,
+  DW_UT_split_type = 0x06
+};
+
+// Range list entry encodings (DWARF 5).
+enum DwarfRangeListEntry {
+  DW_RLE_end_of_list = 0x00,
+  DW_RLE_base_addressx = 0x01,
+  DW_RLE_startx_endx = 0x02,
+  DW_RLE_startx_length = 0x03,
+  DW_RLE_offset_pair = 0x04,
+  DW_RLE_base_address = 0x05,
+  DW_RLE_start_end = 0x06,
+  DW_RLE_start_length = 0x07
+};
+
+// Index attributes for .debug_names (DWARF 5).
+enum DwarfNameIndexAttribute {
+  DW_IDX_compile_unit = 1,
+  DW_IDX_type_unit = 2,
+  DW_IDX_die_offset = 3,
+  DW_IDX_parent = 4,
+  DW_IDX_type_hash = 5
+};
+
 // Line number opcodes.
 enum DwarfLineNumberOps {
   DW_LNS_extended_op = 0,
@@ -616,7 +676,9 @@ enum DwarfSectionId {
   DW_SECT_LOC = 5,
   DW_SECT_STR_OFFSETS = 6,
   DW_SECT_MACINFO = 7,
-  DW_SECT_MACRO = 8
+  DW_SECT_MACRO = 8,
+  // DWARF 5 package files use 8 for range lists instead.
+  DW_SECT_RNGLISTS = 8
 };
 
 }  // namespace dwarf2reader
@@ -15,6 +15,8 @@
 #include <algorithm>
 #include <string>
 #include <iostream>
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/substitute.h"
 #include "re2/re2.h"
@@ -24,6 +26,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 using absl::string_view;
 
@@ -856,6 +859,12 @@ static void ReadDWARFSections(const ElfFile& elf, dwarf::File* dwarf) {
 
     string_view name = section_names.ReadName(header.sh_name);
 
+    // Split DWARF files (.dwo and .dwp) have the same sections, but with a
+    // suffix.
+    if (absl::EndsWith(name, ".dwo")) {
+      name.remove_suffix(4);
+    }
+
     if (name == ".debug_aranges") {
       dwarf->debug_aranges = section.contents();
     } else if (name == ".debug_str") {
@@ -866,13 +875,161 @@ static void ReadDWARFSections(const ElfFile& elf, dwarf::File* dwarf) {
       dwarf->debug_abbrev = section.contents();
     } else if (name == ".debug_line") {
       dwarf->debug_line = section.contents();
+    } else if (name == ".debug_ranges") {
+      dwarf->debug_ranges = section.contents();
+    } else if (name == ".debug_str_offsets") {
+      dwarf->debug_str_offsets = section.contents();
+    } else if (name == ".debug_addr") {
+      dwarf->debug_addr = section.contents();
+    } else if (name == ".debug_rnglists") {
+      dwarf->debug_rnglists = section.contents();
+    } else if (name == ".debug_line_str") {
+      dwarf->debug_line_str = section.contents();
+    } else if (name == ".debug_names") {
+      dwarf->debug_names = section.contents();
+    } else if (name == ".gdb_index") {
+      dwarf->gdb_index = section.contents();
+    } else if (name == ".debug_cu_index") {
+      dwarf->debug_cu_index = section.contents();
     }
   }
 }
 
+// Finds the split DWARF for binaries built with -gsplit-dwarf.  We look in a
+// <binary>.dwp package first, and then for the .dwo file named by each skeleton
+// unit.  Files are only opened once a skeleton unit refers to them, and each
+// unit is only looked up once.
+class ElfSplitDwarfLoader : public dwarf::SplitDwarfLoader {
+ public:
+  ElfSplitDwarfLoader(const InputFileFactory& file_factory,
+                      const InputFile& file, const dwarf::File& skeleton)
+      : file_factory_(file_factory),
+        filename_(file.filename()),
+        skeleton_(skeleton) {}
+
+  const dwarf::File* GetSplitUnit(uint64_t dwo_id, string_view comp_dir,
+                                  string_view dwo_name) override {
+    auto it = units_.find(dwo_id);
+    if (it != units_.end()) {
+      return it->second.get();
+    }
+
+    std::unique_ptr<dwarf::File>& unit = units_[dwo_id];
+    LoadPackage();
+
+    auto dwp_it = dwp_units_.find(dwo_id);
+    if (dwp_it != dwp_units_.end()) {
+      unit.reset(new dwarf::File(dwp_it->second));
+    } else {
+      unit = LoadDwo(comp_dir, dwo_name);
+    }
+
+    if (unit) {
+      // Split units still use the main binary's address table, and (before
+      // DWARF 5) its range lists.
+      unit->debug_addr = skeleton_.debug_addr;
+      if (unit->debug_rnglists.empty()) {
+        unit->debug_ranges = skeleton_.debug_ranges;
+      }
+    } else if (!warned_) {
+      WARN("couldn't find some split DWARF (.dwo) files");
+      warned_ = true;
+    }
+
+    return unit.get();
+  }
+
+ private:
+  std::unique_ptr<InputFile> TryOpenFile(const std::string& filename) {
+    // These paths come from the binary, which could name a FIFO or device
+    // that would hang or fail to map, so only regular files are opened.
+    struct stat buf;
+    if (stat(filename.c_str(), &buf) < 0 || !S_ISREG(buf.st_mode)) {
+      return nullptr;
+    }
+
+    try {
+      return file_factory_.OpenFile(filename);
+    } catch (const bloaty::Error&) {
+      return nullptr;
+    }
+  }
+
+  bool ReadFile(std::unique_ptr<InputFile> file, dwarf::File* dwarf) {
+    if (!file) {
+      return false;
+    }
+
+    ElfFile elf(file->data());
+    if (!elf.IsOpen()) {
+      return false;
+    }
+
+    ReadDWARFSections(elf, dwarf);
+    files_.push_back(std::move(file));
+    return true;
+  }
+
+  void LoadPackage() {
+    if (dwp_loaded_) {
+      return;
+    }
+
+    dwp_loaded_ = true;
+    dwarf::File dwp;
+    if (ReadFile(TryOpenFile(filename_ + ".dwp"), &dwp) &&
+        !dwp.debug_cu_index.empty()) {
+      ReadDWPUnits(dwp, &dwp_units_);
+    }
+  }
+
+  std::unique_ptr<dwarf::File> LoadDwo(string_view comp_dir,
+                                       string_view dwo_name) {
+    std::vector<std::string> candidates;
+
+    if (absl::StartsWith(dwo_name, "/") || comp_dir.empty()) {
+      candidates.push_back(std::string(dwo_name));
+    } else {
+      candidates.push_back(absl::StrCat(comp_dir, "/", dwo_name));
+    }
+
+    // The build directory may have moved, so also try next to the binary.
+    size_t slash = filename_.rfind('/');
+    string_view basename = dwo_name.substr(dwo_name.rfind('/') + 1);
+    if (slash == std::string::npos) {
+      candidates.push_back(std::string(basename));
+    } else {
+      candidates.push_back(
+          absl::StrCat(filename_.substr(0, slash + 1), basename));
+    }
+
+    for (const auto& candidate : candidates) {
+      std::unique_ptr<dwarf::File> dwarf(new dwarf::File);
+      if (ReadFile(TryOpenFile(candidate), dwarf.get())) {
+        return dwarf;
+      }
+    }
+
+    return nullptr;
+  }
+
+  const InputFileFactory& file_factory_;
+  std::string filename_;
+  const dwarf::File& skeleton_;
+  bool dwp_loaded_ = false;
+  bool warned_ = false;
+  std::vector<std::unique_ptr<InputFile>> files_;
+  std::unordered_map<uint64_t, dwarf::File> dwp_units_;
+  std::unordered_map<uint64_t, std::unique_ptr<dwarf::File>> units_;
+};
+
 }  // namespace
 
 class ElfFileHandler : public FileHandler {
+ public:
+  ElfFileHandler(const InputFileFactory& file_factory, Demangler* demangler)
+      : file_factory_(file_factory), demangler_(demangler) {}
+
   void ProcessBaseMap(RangeSink* sink) override {
     if (IsObjectFile(sink->input_file().data())) {
       DoReadELFSections(sink, kReportBySectionName);
@@ -883,8 +1040,42 @@ class ElfFileHandler : public FileHandler {
     }
   }
 
+  bool HasVMAddresses(const InputFile& file) const override {
+    // Object files pack a section index into them (see ToVMAddr()).
+    return !IsObjectFile(file.data());
+  }
+
   void ProcessFile(const std::vector<RangeSink*>& sinks) override {
+    // compileunits and inlines both read the DWARF units, and compileunits also
+    // needs the symbol table.  So we share this work: the DWARF sources are
+    // handled last, after any symbols source has read the symbol table, and
+    // one compileunits source and one inlines source are fed by a single pass.
+    RangeSink* compileunits_sink = nullptr;
+    RangeSink* inlines_sink = nullptr;
+    SymbolTable symtab;
+    bool have_symtab = false;
+
+    for (auto sink : sinks) {
+      if (sink->data_source() == DataSource::kCompileUnits) {
+        CheckNotObject("compileunits", sink);
+        if (!compileunits_sink) {
+          compileunits_sink = sink;
+        }
+      } else if (sink->data_source() == DataSource::kInlines) {
+        CheckNotObject("lineinfo", sink);
+        if (!inlines_sink) {
+          inlines_sink = sink;
+        }
+      }
+    }
+
     for (auto sink : sinks) {
+      if (sink->data_source() == DataSource::kCompileUnits ||
+          sink->data_source() == DataSource::kInlines) {
+        continue;  // Handled below.
+      }
+      StatsTimer timer(sink->input_file().filename(),
+                       GetDataSourceLabel(sink->data_source()));
       switch (sink->data_source()) {
         case DataSource::kSegments:
           ReadELFSegments(sink);
@@ -895,44 +1086,111 @@ class ElfFileHandler : public FileHandler {
         case DataSource::kSymbols:
         case DataSource::kCppSymbols:
         case DataSource::kCppSymbolsStripped:
-          ReadELFSymbols(sink->input_file(), sink, nullptr, &demangler_);
+          if (compileunits_sink && !have_symtab) {
+            ReadELFSymbols(sink->input_file(), sink, &symtab, demangler_);
+            have_symtab = true;
+          } else {
+            ReadELFSymbols(sink->input_file(), sink, nullptr, demangler_);
+          }
           break;
         case DataSource::kArchiveMembers:
           DoReadELFSections(sink, kReportByFilename);
           break;
-        case DataSource::kCompileUnits: {
-          CheckNotObject("compileunits", sink);
-          SymbolTable symtab;
-          ElfFile elf(sink->input_file().data());
-          ReadELFSymbols(sink->input_file(), nullptr, &symtab, &demangler_);
-          dwarf::File dwarf;
-          ReadDWARFSections(elf, &dwarf);
-          ReadDWARFCompileUnits(dwarf, symtab, sink);
-          break;
-        }
-        case DataSource::kInlines: {
-          CheckNotObject("lineinfo", sink);
-          ElfFile elf(sink->input_file().data());
-          dwarf::File dwarf;
-          ReadDWARFSections(elf, &dwarf);
-          ReadDWARFInlines(dwarf, sink, true);
-          break;
-        }
         default:
           THROW("unknown data source");
       }
     }
+
+    if (!compileunits_sink && !inlines_sink) {
+      return;
+    }
+
+    // The DWARF sources share one pass, so they are timed together.
+    const InputFile& file = sinks[0]->input_file();
+    StatsTimer timer(file.filename(), compileunits_sink && inlines_sink
+                                          ? "compileunits,inlines"
+                                          : compileunits_sink ? "compileunits"
+                                                              : "inlines");
+    ElfFile elf(file.data());
+    dwarf::File dwarf;
+    ReadDWARFSections(elf, &dwarf);
+    ElfSplitDwarfLoader split_loader(file_factory_, file, dwarf);
+    dwarf.split_loader = &split_loader;
+
+    if (compileunits_sink && !have_symtab) {
+      ReadELFSymbols(file, nullptr, &symtab, demangler_);
+    }
+
+    for (auto sink : sinks) {
+      if (sink == compileunits_sink && inlines_sink) {
+        ReadDWARFCompileUnitsAndInlines(dwarf, symtab, sink, inlines_sink);
+      } else if (sink->data_source() == DataSource::kCompileUnits) {
+        ReadDWARFCompileUnits(dwarf, symtab, sink);
+      } else if (sink->data_source() == DataSource::kInlines &&
+                 (sink != inlines_sink || !compileunits_sink)) {
+        ReadDWARFInlines(dwarf, sink, true);
+      }
+    }
   }
 
  private:
-  Demangler demangler_;
+  const InputFileFactory& file_factory_;
+  Demangler* demangler_;
 };
 
-std::unique_ptr<FileHandler> TryOpenELFFile(const InputFile& file) {
+bool ReadArchiveMembers(const InputFile& file,
+                        std::vector<ArchiveMember>* members) {
+  ArFile ar_file(file.data());
+  if (!ar_file.IsOpen()) {
+    return false;
+  }
+
+  ArFile::MemberFile member;
+  ArFile::MemberReader reader(ar_file);
+
+  while (reader.ReadMember(&member)) {
+    if (member.file_type != ArFile::MemberFile::kNormal) {
+      continue;
+    }
+
+    ArchiveMember out;
+    out.filename = member.filename;
+    out.contents = member.contents;
+    out.extent = string_view(member.header.data(),
+                             member.header.size() + member.contents.size());
+    out.vmsize = 0;
+
+    // Only the section headers are read, so this stays cheap.  This matches
+    // how DoReadELFSections() assigns VM sizes to object files.
+    ElfFile elf(member.contents);
+    if (elf.IsOpen()) {
+      for (Elf64_Xword i = 1; i < elf.section_count(); i++) {
+        ElfFile::Section section;
+        elf.ReadSection(i, &section);
+        const auto& header = section.header();
+        if (header.sh_name == SHN_UNDEF) {
+          break;
+        }
+        if (header.sh_flags & SHF_ALLOC) {
+          out.vmsize += header.sh_size;
+        }
+      }
+    }
+
+    members->push_back(out);
+  }
+
+  return true;
+}
+
+std::unique_ptr<FileHandler> TryOpenELFFile(const InputFile& file,
+                                            const InputFileFactory& file_factory,
+                                            Demangler* demangler) {
   ElfFile elf(file.data());
   ArFile ar(file.data());
   if (elf.IsOpen() || ar.IsOpen()) {
-    return std::unique_ptr<FileHandler>(new ElfFileHandler());
+    return std::unique_ptr<FileHandler>(
+        new ElfFileHandler(file_factory, demangler));
   } else {
     return nullptr;
   }
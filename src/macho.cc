@@ -213,6 +213,8 @@ class MachOFileHandler : public FileHandler {
 
   void ProcessFile(const std::vector<RangeSink*>& sinks) override {
     for (auto sink : sinks) {
+      StatsTimer timer(sink->input_file().filename(),
+                       GetDataSourceLabel(sink->data_source()));
       switch (sink->data_source()) {
         case DataSource::kSegments:
           ParseMachOSegments(sink);
@@ -233,17 +235,38 @@ class MachOFileHandler : public FileHandler {
   }
 };
 
-std::unique_ptr<FileHandler> TryOpenMachOFile(const InputFile& file) {
-  std::string cmd = "file " + file.filename();
-  std::string cmd_tonull = cmd + " > /dev/null 2> /dev/null";
-  if (system(cmd_tonull.c_str()) < 0) {
-    return nullptr;
+// Recognizes Mach-O files by their magic number, in either byte order, for 32-
+// and 64-bit files and for universal ("fat") binaries.
+static bool IsMachO(absl::string_view data) {
+  if (data.size() < 8) {
+    return false;
   }
 
-  for (auto& line : ReadLinesFromPipe(cmd)) {
-    if (line.find("Mach-O") != std::string::npos) {
-      return std::unique_ptr<FileHandler>(new MachOFileHandler);
-    }
+  auto read32 = [&](size_t ofs) {
+    const unsigned char* p =
+        reinterpret_cast<const unsigned char*>(data.data()) + ofs;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+  };
+
+  switch (read32(0)) {
+    case 0xfeedface:  // MH_MAGIC
+    case 0xcefaedfe:  // MH_CIGAM
+    case 0xfeedfacf:  // MH_MAGIC_64
+    case 0xcffaedfe:  // MH_CIGAM_64
+      return true;
+    case 0xcafebabe:  // FAT_MAGIC, always big-endian.
+      // Java class files have the same magic.  Where a fat binary has its
+      // (small) architecture count, they have a version number of 45 or more.
+      return read32(4) < 45;
+    default:
+      return false;
+  }
+}
+
+std::unique_ptr<FileHandler> TryOpenMachOFile(const InputFile& file) {
+  if (IsMachO(file.data())) {
+    return std::unique_ptr<FileHandler>(new MachOFileHandler);
   }
 
   return nullptr;
@@ -15,7 +15,14 @@
 #include "bloaty.h"
 #include "bloaty.pb.h"
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <thread>
+
+// How many input files "--serve" keeps open.  They're only mapped, so this
+// costs address space more than memory.
+static const size_t kServeCachedFiles = 64;
 
 int main(int argc, char *argv[]) {
   bloaty::Options options;
@@ -28,6 +35,69 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (!output_options.serve_socket.empty()) {
+    bloaty::Server server(std::thread::hardware_concurrency(),
+                          kServeCachedFiles);
+    if (!server.Listen(output_options.serve_socket, &error)) {
+      fprintf(stderr, "bloaty: %s\n", error.c_str());
+      return 1;
+    }
+    server.Run();
+    return 0;
+  }
+
+  if (!output_options.trace_file.empty()) {
+    bloaty::StartTrace();
+  }
+
+  if (!output_options.batch_manifest.empty()) {
+    bloaty::MmapInputFileFactory mmap_factory;
+    int threads = std::max(std::thread::hardware_concurrency(), 1u);
+    bool ok = bloaty::RunBatch(output_options.batch_manifest, options,
+                               output_options, mmap_factory, threads, &error);
+    if (!ok) {
+      fprintf(stderr, "bloaty: %s\n", error.c_str());
+    }
+    if (!output_options.trace_file.empty() &&
+        !bloaty::WriteTrace(output_options.trace_file)) {
+      fprintf(stderr, "bloaty: couldn't write trace to %s\n",
+              output_options.trace_file.c_str());
+      return 1;
+    }
+    return ok ? 0 : 1;
+  }
+
+  if (!output_options.lookup_file.empty()) {
+    bloaty::MmapInputFileFactory mmap_factory;
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (output_options.lookup_file != "-") {
+      file.open(output_options.lookup_file);
+      if (!file) {
+        fprintf(stderr, "bloaty: couldn't open %s\n",
+                output_options.lookup_file.c_str());
+        return 1;
+      }
+      in = &file;
+    }
+    if (!bloaty::LookupAddresses(options, mmap_factory, in, &std::cout,
+                                 &error)) {
+      fprintf(stderr, "bloaty: %s\n", error.c_str());
+      return 1;
+    }
+    if (output_options.stats_format != bloaty::StatsFormat::kNone) {
+      std::cout.flush();
+      bloaty::PrintStats(output_options.stats_format, &std::cerr);
+    }
+    if (!output_options.trace_file.empty() &&
+        !bloaty::WriteTrace(output_options.trace_file)) {
+      fprintf(stderr, "bloaty: couldn't write trace to %s\n",
+              output_options.trace_file.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
   bloaty::RollupOutput output;
   bloaty::MmapInputFileFactory mmap_factory;
   if (!bloaty::BloatyMain(options, mmap_factory, &output, &error)) {
@@ -37,6 +107,24 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  output.Print(output_options, &std::cout);
+  {
+    bloaty::StatsTimer timer("", "output");
+    output.Print(output_options, &std::cout);
+  }
+  if (!std::cout) {
+    return 1;
+  }
+
+  if (output_options.stats_format != bloaty::StatsFormat::kNone) {
+    std::cout.flush();
+    bloaty::PrintStats(output_options.stats_format, &std::cerr);
+  }
+
+  if (!output_options.trace_file.empty() &&
+      !bloaty::WriteTrace(output_options.trace_file)) {
+    fprintf(stderr, "bloaty: couldn't write trace to %s\n",
+            output_options.trace_file.c_str());
+    return 1;
+  }
   return 0;
 }
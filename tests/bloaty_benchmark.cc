@@ -0,0 +1,404 @@
+// Copyright 2016 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for Bloaty's hot paths.
+//
+// USAGE: bloaty_benchmark [benchmark flags] [file]
+//
+// The DWARF benchmarks read the debug info of [file], which defaults to this
+// benchmark binary itself (built with -g by default, so it has plenty of real
+// compilation units).
+
+#include "bloaty.h"
+#include "bloaty.pb.h"
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "benchmark/benchmark.h"
+
+namespace bloaty {
+
+static std::string dwarf_filename;
+
+// Cheap deterministic pseudo-random numbers, so every run does the same work.
+class Lcg {
+ public:
+  explicit Lcg(uint64_t seed) : state_(seed) {}
+  uint64_t Next() {
+    state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state_ >> 16;
+  }
+
+ private:
+  uint64_t state_;
+};
+
+static std::vector<std::string> MakeLabels(size_t n) {
+  std::vector<std::string> labels;
+  for (size_t i = 0; i < n; i++) {
+    labels.push_back(absl::StrCat("label_", i));
+  }
+  return labels;
+}
+
+// Start addresses for |n| adjacent 16-byte ranges, in a shuffled order (symbol
+// tables are not sorted by address).
+static std::vector<uint64_t> MakeShuffledAddresses(size_t n) {
+  std::vector<uint64_t> addrs;
+  for (size_t i = 0; i < n; i++) {
+    addrs.push_back(i * 16);
+  }
+  Lcg lcg(n);
+  for (size_t i = n; i > 1; i--) {
+    std::swap(addrs[i - 1], addrs[lcg.Next() % i]);
+  }
+  return addrs;
+}
+
+// Discards everything written to it.
+class NullStreamBuf : public std::streambuf {
+ protected:
+  int overflow(int ch) override { return ch; }
+  std::streamsize xsputn(const char* /* s */, std::streamsize n) override {
+    return n;
+  }
+};
+
+
+// RangeMap ////////////////////////////////////////////////////////////////////
+
+static void BM_RangeMapAddDualRange(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto labels = MakeLabels(1000);
+  auto addrs = MakeShuffledAddresses(n);
+
+  for (auto _ : state) {
+    RangeMap map;
+    for (size_t i = 0; i < n; i++) {
+      map.AddDualRange(addrs[i], 16, addrs[i] + 0x100000,
+                       labels[i % labels.size()]);
+    }
+    // Exclude tearing down the map.
+    state.PauseTiming();
+    { RangeMap discard(std::move(map)); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_RangeMapAddDualRange)
+    ->RangeMultiplier(10)
+    ->Range(10000, 10000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_RangeMapAddRangeWithTranslation(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto labels = MakeLabels(1000);
+  auto addrs = MakeShuffledAddresses(n);
+
+  // Like a section table: 64 sections that map VM addresses to file offsets.
+  RangeMap translator;
+  uint64_t section_size = (n * 16) / 64 + 16;
+  for (uint64_t i = 0; i < 64; i++) {
+    translator.AddDualRange(i * section_size, section_size,
+                            0x1000 + i * section_size, labels[i]);
+  }
+
+  for (auto _ : state) {
+    RangeMap vm_map;
+    RangeMap file_map;
+    for (size_t i = 0; i < n; i++) {
+      vm_map.AddRangeWithTranslation(addrs[i], 16, labels[i % labels.size()],
+                                     translator, &file_map);
+    }
+    state.PauseTiming();
+    { RangeMap discard_vm(std::move(vm_map)); }
+    { RangeMap discard_file(std::move(file_map)); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_RangeMapAddRangeWithTranslation)
+    ->RangeMultiplier(10)
+    ->Range(10000, 10000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_RangeMapComputeRollup(benchmark::State& state) {
+  size_t num_maps = state.range(0);
+  const size_t kRanges = 100000;
+  auto labels = MakeLabels(1000);
+
+  // Each map covers the same space at a different granularity, so the
+  // rollup has to break at every edge of every map.
+  std::vector<RangeMap> maps(num_maps);
+  std::vector<const RangeMap*> map_ptrs;
+  for (size_t m = 0; m < num_maps; m++) {
+    uint64_t size = 16 << m;
+    for (uint64_t i = 0; i * size < kRanges * 16; i++) {
+      maps[m].AddRange(i * size, size, labels[i % labels.size()]);
+    }
+    map_ptrs.push_back(&maps[m]);
+  }
+
+  uint64_t rows = 0;
+  RangeMap::RollupFunc func = [&rows](const std::vector<std::string>& names,
+                                      uint64_t start, uint64_t end) {
+    benchmark::DoNotOptimize(names.data());
+    benchmark::DoNotOptimize(end - start);
+    rows++;
+  };
+
+  for (auto _ : state) {
+    RangeMap::ComputeRollup(map_ptrs, "file", -1, func);
+  }
+  state.SetItemsProcessed(rows);
+}
+BENCHMARK(BM_RangeMapComputeRollup)->DenseRange(1, 8)->Unit(
+    benchmark::kMillisecond);
+
+
+// Rollup //////////////////////////////////////////////////////////////////////
+
+static void BM_RollupAddSizes(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto labels = MakeLabels(n);
+  auto sections = MakeLabels(20);
+
+  // AddSizes() skips names[0], which is the base map.
+  std::vector<std::vector<std::string>> names;
+  for (size_t i = 0; i < n; i++) {
+    names.push_back({"", sections[i % sections.size()], labels[i]});
+  }
+
+  for (auto _ : state) {
+    Rollup rollup;
+    for (size_t i = 0; i < n; i++) {
+      rollup.AddSizes(names[i], 16, true, false);
+      rollup.AddSizes(names[i], 16, false, false);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n * 2);
+}
+BENCHMARK(BM_RollupAddSizes)->RangeMultiplier(10)->Range(1000, 1000000);
+
+// Fills |rollup| with |n| rows under each of 20 sections.
+static void FillRollup(size_t n, Rollup* rollup) {
+  auto labels = MakeLabels(n);
+  auto sections = MakeLabels(20);
+  Lcg lcg(n);
+  std::vector<std::string> names(3);
+  for (const auto& section : sections) {
+    names[1] = section;
+    for (const auto& label : labels) {
+      names[2] = label;
+      rollup->AddSizes(names, lcg.Next() % 4096, true, false);
+      rollup->AddSizes(names, lcg.Next() % 4096, false, false);
+    }
+  }
+}
+
+// ComputeRows, which ranks and collapses every level of the tree.
+static void BM_RollupComputeRows(benchmark::State& state) {
+  Rollup rollup;
+  FillRollup(state.range(0), &rollup);
+  Options options;
+  options.set_max_rows_per_level(20);
+
+  for (auto _ : state) {
+    RollupOutput output;
+    rollup.CreateRollupOutput(options, &output);
+    benchmark::DoNotOptimize(output.toplevel_row().sorted_children.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 20);
+}
+BENCHMARK(BM_RollupComputeRows)->RangeMultiplier(10)->Range(100, 100000);
+
+
+// Output //////////////////////////////////////////////////////////////////////
+
+// Output writer throughput, in rows per second.
+static void BM_Output(benchmark::State& state) {
+  Rollup rollup;
+  size_t n = state.range(1);
+  FillRollup(n, &rollup);
+  Options options;
+  options.set_max_rows_per_level(0);
+  RollupOutput output;
+  rollup.CreateRollupOutput(options, &output);
+
+  OutputOptions output_options;
+  output_options.output_format = static_cast<OutputFormat>(state.range(0));
+  NullStreamBuf null_buf;
+  std::ostream null_stream(&null_buf);
+
+  for (auto _ : state) {
+    output.Print(output_options, &null_stream);
+  }
+  state.SetItemsProcessed(state.iterations() * (n + 1) * 20);
+}
+BENCHMARK(BM_Output)->ArgsProduct({
+    {static_cast<int>(OutputFormat::kPrettyPrint),
+     static_cast<int>(OutputFormat::kCSV),
+     static_cast<int>(OutputFormat::kProto)},
+    {1000, 100000}});
+
+
+// DWARF ///////////////////////////////////////////////////////////////////////
+
+static void BM_ReadLEB128(benchmark::State& state) {
+  // A mix of 1- to 5-byte values, like the ones in abbrevs and DIEs.
+  std::string data;
+  Lcg lcg(0);
+  for (int i = 0; i < 100000; i++) {
+    uint64_t val = lcg.Next() >> (7 * (i % 5) + 29);
+    do {
+      char byte = val & 0x7f;
+      val >>= 7;
+      if (val) byte |= 0x80;
+      data.push_back(byte);
+    } while (val);
+  }
+
+  for (auto _ : state) {
+    absl::string_view remaining = data;
+    uint64_t sum = 0;
+    while (!remaining.empty()) {
+      sum += dwarf::ReadLEB128Internal(false, &remaining);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ReadLEB128);
+
+// Runs the ELF handler for one data source over dwarf_filename, adding the
+// ranges to a map like a normal run does.
+static void BenchmarkDataSource(benchmark::State& state, DataSource source) {
+  MmapInputFileFactory factory;
+  std::unique_ptr<InputFile> file;
+  std::unique_ptr<FileHandler> handler;
+  Demangler demangler;
+  NameMunger munger;
+  DualMap base_map;
+  try {
+    file = factory.OpenFile(dwarf_filename);
+    handler = TryOpenELFFile(*file, factory, &demangler);
+    if (handler) {
+      RangeSink base_sink(file.get(), DataSource::kSegments, nullptr);
+      base_sink.AddOutput(&base_map, &munger);
+      handler->ProcessBaseMap(&base_sink);
+    }
+  } catch (const Error& e) {
+    state.SkipWithError(e.what());
+    return;
+  }
+  if (!handler) {
+    state.SkipWithError("not an ELF file");
+    return;
+  }
+
+  for (auto _ : state) {
+    DualMap map;
+    RangeSink sink(file.get(), source, &base_map);
+    sink.AddOutput(&map, &munger);
+    try {
+      handler->ProcessFile({&sink});
+    } catch (const Error& e) {
+      state.SkipWithError(e.what());
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * file->data().size());
+}
+
+// DIEReader and FixedAttrReader reading each unit's DW_AT_stmt_list, and
+// LineInfoReader running each unit's line program.
+static void BM_DWARFInlines(benchmark::State& state) {
+  BenchmarkDataSource(state, DataSource::kInlines);
+}
+BENCHMARK(BM_DWARFInlines)->Unit(benchmark::kMillisecond);
+
+// DIEReader and the attribute readers over every DIE of every unit, plus
+// reading the symbol table.
+static void BM_DWARFCompileUnits(benchmark::State& state) {
+  BenchmarkDataSource(state, DataSource::kCompileUnits);
+}
+BENCHMARK(BM_DWARFCompileUnits)->Unit(benchmark::kMillisecond);
+
+
+// Names ///////////////////////////////////////////////////////////////////////
+
+static void BM_NameMungerMunge(benchmark::State& state) {
+  int rules = state.range(0);
+  NameMunger munger;
+  for (int i = 0; i < rules; i++) {
+    munger.AddRegex(absl::StrCat("^ns", i, "::(\\w+)"),
+                    absl::StrCat("namespace ", i));
+  }
+
+  // Half of the names match the last rule, half match none.
+  std::vector<std::string> names;
+  for (int i = 0; i < 1000; i++) {
+    names.push_back(absl::StrCat(i % 2 ? "ns" : "other", rules - 1,
+                                 "::function_", i, "(int, char const*)"));
+  }
+
+  for (auto _ : state) {
+    for (const auto& name : names) {
+      benchmark::DoNotOptimize(munger.Munge(name));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * names.size());
+}
+BENCHMARK(BM_NameMungerMunge)->RangeMultiplier(4)->Range(1, 64);
+
+static void BM_StripName(benchmark::State& state) {
+  const std::vector<std::string> names = {
+    "foo",
+    "foo(int)",
+    "ns::Class::Method(std::vector<int, std::allocator<int> > const&) const",
+    "void std::__introsort_loop<__gnu_cxx::__normal_iterator<int*, "
+        "std::vector<int> >, long>(int*, int*, long)",
+    "(anonymous namespace)::Helper::operator()(int) const",
+    "bloaty::RangeMap::ComputeRollup<std::function<void (std::vector<"
+        "std::string> const&, unsigned long, unsigned long)> >(std::vector<"
+        "bloaty::RangeMap const*> const&, std::string const&, int, "
+        "std::function<void (std::vector<std::string> const&, unsigned long, "
+        "unsigned long)>)",
+  };
+
+  for (auto _ : state) {
+    for (const auto& name : names) {
+      benchmark::DoNotOptimize(StripName(name));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * names.size());
+}
+BENCHMARK(BM_StripName);
+
+}  // namespace bloaty
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (argc > 2) {
+    fprintf(stderr, "USAGE: %s [benchmark flags] [file]\n", argv[0]);
+    return 1;
+  }
+  bloaty::dwarf_filename = argc > 1 ? argv[1] : argv[0];
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -14,6 +14,11 @@
 
 #include "test.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+
 TEST_F(BloatyTest, NoSections) {
   RunBloaty({"bloaty", "01-no-sections.bin"});
 }
@@ -36,3 +41,132 @@ TEST_F(BloatyTest, GoBinary) {
   RunBloaty(
       {"bloaty", "-d", "inlines", "04-go-binary-with-ref-addr.bin"});
 }
+
+TEST_F(BloatyTest, DWARF5Binary) {
+  // Built with "gcc -g -gdwarf-5 -O2", so it uses .debug_line_str,
+  // .debug_rnglists and the DWARF 5 line table header.
+  std::string file = "05-dwarf5-binary.bin";
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", file});
+
+  auto row = FindRow("foo.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("foo", kUnknown, kSameAsVM),
+    std::make_tuple("coldf", kUnknown, kSameAsVM),
+    std::make_tuple("foo.cold", kUnknown, kSameAsVM),
+  });
+
+  row = FindRow("main.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("main", kUnknown, kSameAsVM),
+  });
+
+  RunBloaty({"bloaty", "-d", "inlines", file});
+  EXPECT_GT(top_row_->sorted_children.size(), 1);
+
+  // Files in the compilation directory (directory 0) get relative labels, as
+  // they do with DWARF 4.
+  EXPECT_TRUE(FindRow("foo.c:3") != nullptr);
+  EXPECT_TRUE(FindRow("main.c:2") != nullptr);
+}
+
+TEST_F(BloatyTest, SplitDWARF) {
+  // Built with -gsplit-dwarf, so the binary only has skeleton units and we have
+  // to find the rest in the .dwo files next to it.
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", "06-split-dwarf.bin"});
+
+  auto row = FindRow("foo.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("foo", kUnknown, kSameAsVM),
+    std::make_tuple("coldf", kUnknown, kSameAsVM),
+    std::make_tuple("foo.cold", kUnknown, kSameAsVM),
+  });
+
+  row = FindRow("main.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("main", kUnknown, kSameAsVM),
+  });
+}
+
+TEST_F(BloatyTest, SplitDWARFSkipsSpecialFiles) {
+  // The .dwo paths come from the binary, so they could name a FIFO, which
+  // would block forever if we opened it.
+  char dir_buf[] = "/tmp/bloaty_test_dwo_XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir_buf) != nullptr);
+  std::string dir = dir_buf;
+  std::string binary = dir + "/06-split-dwarf.bin";
+  {
+    std::ifstream in("06-split-dwarf.bin", std::ios::binary);
+    std::ofstream out(binary, std::ios::binary);
+    out << in.rdbuf();
+  }
+  std::vector<std::string> dwos = {dir + "/06-split-dwarf-foo.dwo",
+                                   dir + "/06-split-dwarf-main.dwo"};
+  for (const auto& dwo : dwos) {
+    ASSERT_EQ(0, mkfifo(dwo.c_str(), 0600));
+  }
+
+  // The FIFOs are skipped like missing .dwo files.
+  RunBloaty({"bloaty", "-d", "compileunits", binary});
+
+  for (const auto& dwo : dwos) {
+    unlink(dwo.c_str());
+  }
+  unlink(binary.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST_F(BloatyTest, GdbIndex) {
+  // Linked with "-Wl,--gdb-index", so compileunits can use the index instead
+  // of reading every DIE.
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", "07-gdb-index.bin"});
+
+  auto row = FindRow("foo.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("foo", kUnknown, kSameAsVM),
+    std::make_tuple("coldf", kUnknown, kSameAsVM),
+    std::make_tuple("foo.cold", kUnknown, kSameAsVM),
+  });
+
+  row = FindRow("main.c");
+  ASSERT_TRUE(row != nullptr);
+  AssertChildren(*row, {
+    std::make_tuple("main", kUnknown, kSameAsVM),
+  });
+}
+
+// Collects the VM size of every row as "compileunit/symbol", except [None].
+static void CollectRows(const bloaty::RollupRow& row, const std::string& prefix,
+                        std::map<std::string, int64_t>* rows) {
+  for (const auto& child : row.sorted_children) {
+    if (child.name == "[None]") {
+      continue;
+    }
+    std::string name = prefix + child.name;
+    (*rows)[name] = child.vmsize;
+    CollectRows(child, name + "/", rows);
+  }
+}
+
+TEST_F(BloatyTest, GdbIndexCxx) {
+  // Two C++ files (with mangled globals and a static function in each) linked
+  // with "-Wl,--gdb-index", and the same binary with .gdb_index removed.  The
+  // index only has source names, which don't match the mangled symbols, so
+  // the result must be the same as without it.
+  std::map<std::string, int64_t> with_index;
+  std::map<std::string, int64_t> without_index;
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", "-n", "0",
+             "08-gdb-index-cxx.bin"});
+  CollectRows(*top_row_, "", &with_index);
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", "-n", "0",
+             "08-gdb-index-cxx-noindex.bin"});
+  CollectRows(*top_row_, "", &without_index);
+
+  EXPECT_EQ(without_index, with_index);
+  EXPECT_EQ(256, with_index["a.cc/_ZN2ns7table_aE"]);
+  EXPECT_EQ(128, with_index["b.cc/_ZN2ns7table_bE"]);
+}
@@ -14,6 +14,16 @@
 
 #include "test.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "google/protobuf/io/coded_stream.h"
+
 TEST_F(BloatyTest, EmptyObjectFile) {
   std::string file = "01-empty.o";
   uint64_t size;
@@ -257,3 +267,790 @@ TEST_F(BloatyTest, DiffMode) {
     std::make_tuple("foo_y", 4, 0)
   });
 }
+
+TEST_F(BloatyTest, RowLimit) {
+  std::string file = "05-binary.bin";
+
+  // Rows past the limit are collapsed into a single "[Other]" row, and the
+  // rows that remain are still sorted by size.
+  RunBloaty({"bloaty", "-d", "symbols", "-n", "3", file});
+  ASSERT_EQ(top_row_->sorted_children.size(), 4);
+  EXPECT_TRUE(FindRow("[Other]") != nullptr);
+  for (size_t i = 1; i < top_row_->sorted_children.size(); i++) {
+    const auto& prev = top_row_->sorted_children[i - 1];
+    const auto& row = top_row_->sorted_children[i];
+    EXPECT_GE(std::max(prev.vmsize, prev.filesize),
+              std::max(row.vmsize, row.filesize));
+  }
+
+  // "[None]" is never collapsed into "[Other]", even when it is small.
+  RunBloaty({"bloaty", "-d", "symbols", "-n", "1", file});
+  ASSERT_EQ(top_row_->sorted_children.size(), 2);
+  EXPECT_TRUE(FindRow("[None]") != nullptr);
+  EXPECT_TRUE(FindRow("[Other]") != nullptr);
+
+  // "-n 0" means no limit.
+  RunBloaty({"bloaty", "-d", "symbols", "-n", "0", file});
+  EXPECT_GT(top_row_->sorted_children.size(), 10);
+  for (const auto& child : top_row_->sorted_children) {
+    EXPECT_NE("[Other]", child.name);
+  }
+}
+
+TEST_F(BloatyTest, ProtoOutput) {
+  std::vector<std::vector<std::string>> runs = {
+    {"bloaty", "-d", "sections,symbols", "05-binary.bin"},
+    {"bloaty", "-d", "sections,symbols", "06-diff.a", "--", "03-simple.a"},
+  };
+
+  for (const auto& run : runs) {
+    RunBloaty(run);
+
+    // Reading the proto back should give us exactly the same output.
+    bloaty::OutputOptions options;
+    std::stringstream proto_out;
+    options.output_format = bloaty::OutputFormat::kProto;
+    output_->Print(options, &proto_out);
+
+    bloaty::Report report;
+    ASSERT_TRUE(report.ParseFromString(proto_out.str()));
+    bloaty::RollupOutput loaded;
+    loaded.FromProto(report);
+
+    for (auto format : {bloaty::OutputFormat::kPrettyPrint,
+                        bloaty::OutputFormat::kCSV}) {
+      std::stringstream expected;
+      std::stringstream actual;
+      options.output_format = format;
+      output_->Print(options, &expected);
+      loaded.Print(options, &actual);
+      EXPECT_EQ(expected.str(), actual.str());
+    }
+
+    // The stream variant should merge into the same Report.
+    std::stringstream stream_out;
+    options.output_format = bloaty::OutputFormat::kProtoStream;
+    output_->Print(options, &stream_out);
+    std::string stream_data = stream_out.str();
+
+    google::protobuf::io::CodedInputStream input(
+        reinterpret_cast<const uint8_t*>(stream_data.data()),
+        stream_data.size());
+    bloaty::Report merged;
+    int messages = 0;
+    uint32_t size;
+    while (input.ReadVarint32(&size)) {
+      auto limit = input.PushLimit(size);
+      bloaty::Report chunk;
+      ASSERT_TRUE(chunk.ParseFromCodedStream(&input));
+      input.PopLimit(limit);
+      merged.MergeFrom(chunk);
+      messages++;
+    }
+    EXPECT_EQ(1 + top_row_->sorted_children.size() +
+                  top_row_->shrinking.size() + top_row_->mixed.size(),
+              messages);
+    EXPECT_EQ(report.SerializeAsString(), merged.SerializeAsString());
+  }
+}
+
+TEST_F(BloatyTest, RollupSnapshot) {
+  char path_buf[] = "/tmp/bloaty_test_snapshot_XXXXXX";
+  int fd = mkstemp(path_buf);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  std::string snapshot = path_buf;
+
+  bloaty::OutputOptions options;
+  options.output_format = bloaty::OutputFormat::kCSV;
+
+  // Loading a snapshot gives the same results as scanning the file again.
+  std::stringstream expected;
+  RunBloaty({"bloaty", "-d", "sections,symbols", "-n", "0", "--save-rollup",
+             snapshot, "03-simple.a"});
+  output_->Print(options, &expected);
+
+  std::stringstream actual;
+  RunBloaty({"bloaty", "-d", "sections,symbols", "-n", "0", snapshot});
+  output_->Print(options, &actual);
+  EXPECT_EQ(expected.str(), actual.str());
+
+  // That holds for base files too.
+  expected.str("");
+  actual.str("");
+  RunBloaty({"bloaty", "-d", "sections,symbols", "06-diff.a", "--",
+             "03-simple.a"});
+  output_->Print(options, &expected);
+  RunBloaty({"bloaty", "-d", "sections,symbols", "06-diff.a", "--",
+             snapshot});
+  output_->Print(options, &actual);
+  EXPECT_EQ(expected.str(), actual.str());
+
+  // The snapshot can only be used with the data sources it was saved with.
+  AssertBloatyFails({"bloaty", "-d", "symbols", snapshot}, "data sources");
+
+  // "inputfiles" counts as one of those sources.
+  expected.str("");
+  actual.str("");
+  RunBloaty({"bloaty", "-d", "inputfiles,symbols", "--save-rollup", snapshot,
+             "03-simple.a", "04-simple.so"});
+  output_->Print(options, &expected);
+  RunBloaty({"bloaty", "-d", "inputfiles,symbols", snapshot});
+  output_->Print(options, &actual);
+  EXPECT_EQ(expected.str(), actual.str());
+
+  // A custom source is saved under its own name, and only matches a source
+  // with the same base and rewrites.
+  char config_buf[] = "/tmp/bloaty_test_config_XXXXXX";
+  fd = mkstemp(config_buf);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  auto write_config = [&](const std::string& replacement) {
+    std::ofstream out(config_buf);
+    out << "custom_data_source: { name: \"prefixes\" "
+        << "base_data_source: \"symbols\" "
+        << "rewrite: { pattern: \"^(.)\" replacement: \"" << replacement
+        << "\" } }\n";
+  };
+  write_config("\\\\1");
+  RunBloaty({"bloaty", "-c", config_buf, "-d", "prefixes", "--save-rollup",
+             snapshot, "05-binary.bin"});
+  RunBloaty({"bloaty", "-c", config_buf, "-d", "prefixes", snapshot});
+  AssertBloatyFails({"bloaty", "-d", "symbols", snapshot}, "data sources");
+  write_config("x\\\\1");
+  AssertBloatyFails({"bloaty", "-c", config_buf, "-d", "prefixes", snapshot},
+                    "definition");
+
+  unlink(config_buf);
+  unlink(snapshot.c_str());
+}
+
+TEST_F(BloatyTest, PruneUnchanged) {
+  bloaty::OutputOptions options;
+  options.output_format = bloaty::OutputFormat::kCSV;
+
+  // Skipping the members that are identical in both archives doesn't change
+  // any of the deltas.
+  for (const char* sources : {"symbols", "armembers,symbols", "sections"}) {
+    std::stringstream expected;
+    std::stringstream actual;
+    RunBloaty({"bloaty", "-d", sources, "-n", "0", "06-diff.a", "--",
+               "03-simple.a"});
+    output_->Print(options, &expected);
+    int64_t vmsize = top_row_->vmsize;
+    int64_t filesize = top_row_->filesize;
+
+    RunBloaty({"bloaty", "-d", sources, "-n", "0", "--prune-unchanged",
+               "06-diff.a", "--", "03-simple.a"});
+    output_->Print(options, &actual);
+    EXPECT_EQ(expected.str(), actual.str());
+    EXPECT_EQ(vmsize, top_row_->vmsize);
+    EXPECT_EQ(filesize, top_row_->filesize);
+  }
+}
+
+TEST_F(BloatyTest, Stats) {
+  std::string file = "05-binary.bin";
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", file});
+  EXPECT_GT(bloaty::stats.ranges_added, 0);
+  EXPECT_GT(bloaty::stats.dies_decoded, 0);
+  EXPECT_GT(bloaty::stats.abbrev_tables_built, 0);
+  EXPECT_GT(bloaty::stats.munge_calls, 0);
+
+  // Every phase of the file has a timing, and each counter has a row.
+  std::stringstream csv;
+  bloaty::PrintStats(bloaty::StatsFormat::kCSV, &csv);
+  for (const char* phase : {"base map", "symbols", "compileunits", "rollup"}) {
+    EXPECT_NE(std::string::npos,
+              csv.str().find("wall_ms," + file + "," + phase + ","));
+    EXPECT_NE(std::string::npos,
+              csv.str().find("cpu_ms," + file + "," + phase + ","));
+  }
+  EXPECT_NE(std::string::npos, csv.str().find("counter,,dies_decoded,"));
+  EXPECT_NE(std::string::npos, csv.str().find("counter,,peak_rss_bytes,"));
+
+  // Each run starts from zero.
+  RunBloaty({"bloaty", "-d", "sections", file});
+  EXPECT_EQ(0, bloaty::stats.dies_decoded);
+}
+
+TEST_F(BloatyTest, MaxMemory) {
+  std::vector<std::string> args = {"bloaty", "-d", "inputfiles,symbols",
+                                   "-n", "0", "04-simple.so", "05-binary.bin"};
+  RunBloaty(args);
+  int range_maps = static_cast<int>(bloaty::MemoryUse::kRangeMaps);
+  int rollups = static_cast<int>(bloaty::MemoryUse::kRollups);
+  int64_t range_map_peak = bloaty::stats.memory_peak[range_maps];
+  int64_t rollup_peak = bloaty::stats.memory_peak[rollups];
+  EXPECT_GT(range_map_peak, 0);
+  EXPECT_GT(rollup_peak, 0);
+  EXPECT_EQ(0, bloaty::stats.total_memory_in_use);
+  int64_t vmsize = top_row_->vmsize;
+  int64_t filesize = top_row_->filesize;
+
+  // Too small to scan even one file.
+  AssertBloatyFails({"bloaty", "--max-memory=1", "05-binary.bin"},
+                    "--max-memory");
+
+  // Sizes can't be negative.
+  bloaty::Options parsed;
+  bloaty::OutputOptions parsed_output;
+  std::string error;
+  std::vector<std::string> negative = {"bloaty", "--max-memory=-1",
+                                       "05-binary.bin"};
+  EXPECT_FALSE(bloaty::ParseOptions(negative.size(), StrArr(negative).get(),
+                                    &parsed, &parsed_output, &error));
+  EXPECT_NE(std::string::npos, error.find("invalid size")) << error;
+
+  // Big enough to scan with half of it, but the results take more than the
+  // other half, so small rows are merged.  The totals stay the same.
+  args.push_back("--max-memory=" +
+                 std::to_string(range_map_peak + rollup_peak));
+  RunBloaty(args);
+  EXPECT_EQ(vmsize, top_row_->vmsize);
+  EXPECT_EQ(filesize, top_row_->filesize);
+  bool pruned = false;
+  for (const auto& file : top_row_->sorted_children) {
+    for (const auto& row : file.sorted_children) {
+      if (row.name == "[Pruned]") pruned = true;
+    }
+  }
+  EXPECT_TRUE(pruned);
+}
+
+TEST_F(BloatyTest, MaxMemoryDiff) {
+  std::vector<std::string> args = {"bloaty", "-d", "sections,symbols", "-n",
+                                   "0", "05-binary.bin", "--", "04-simple.so"};
+  RunBloaty(args);
+  int range_maps = static_cast<int>(bloaty::MemoryUse::kRangeMaps);
+  int rollups = static_cast<int>(bloaty::MemoryUse::kRollups);
+  int64_t range_map_peak = bloaty::stats.memory_peak[range_maps];
+  int64_t rollup_peak = bloaty::stats.memory_peak[rollups];
+  ASSERT_GT(rollup_peak, range_map_peak);
+  bloaty::OutputOptions output_options;
+  output_options.output_format = bloaty::OutputFormat::kCSV;
+  std::stringstream expected;
+  output_->Print(output_options, &expected);
+
+  // Big enough to scan, but a row's delta isn't known until the base file is
+  // in too, so results over the other half are an error, not pruned.
+  std::vector<std::string> small = args;
+  small.push_back("--max-memory=" + std::to_string(range_map_peak * 2));
+  AssertBloatyFails(small, "can't be pruned");
+
+  // With room for the results, they are the same as without a budget.
+  args.push_back("--max-memory=" +
+                 std::to_string((range_map_peak + rollup_peak) * 2));
+  RunBloaty(args);
+  std::stringstream actual;
+  output_->Print(output_options, &actual);
+  EXPECT_EQ(expected.str(), actual.str());
+}
+
+TEST_F(BloatyTest, Session) {
+  bloaty::MmapInputFileFactory factory;
+  bloaty::Session session(factory);
+  bloaty::OutputOptions output_options;
+  output_options.output_format = bloaty::OutputFormat::kCSV;
+
+  // Every run in a session (including the ones that reuse its demangler and
+  // custom data sources) gets the same results as a one-off run.
+  for (int i = 0; i < 2; i++) {
+    for (const char* source : {"cppsymbols", "sections", "prefixes"}) {
+      bloaty::Options options;
+      options.add_filename("05-binary.bin");
+      options.add_data_source(source);
+      auto custom = options.add_custom_data_source();
+      custom->set_name("prefixes");
+      custom->set_base_data_source("symbols");
+      auto rewrite = custom->add_rewrite();
+      rewrite->set_pattern("^(foo|bar)_");
+      rewrite->set_replacement("\\1");
+
+      std::string error;
+      bloaty::RollupOutput expected;
+      bloaty::RollupOutput actual;
+      ASSERT_TRUE(bloaty::BloatyMain(options, factory, &expected, &error));
+      ASSERT_TRUE(session.Analyze(options, &actual, &error));
+      std::stringstream expected_csv;
+      std::stringstream actual_csv;
+      expected.Print(output_options, &expected_csv);
+      actual.Print(output_options, &actual_csv);
+      EXPECT_EQ(expected_csv.str(), actual_csv.str());
+
+      bloaty::Report report;
+      ASSERT_TRUE(session.Analyze(options, &report, &error));
+      EXPECT_EQ(actual.toplevel_row().vmsize, report.toplevel_row().vmsize());
+    }
+  }
+
+  // Every name in the file is in the session's demangle cache by now.
+  bloaty::Options options;
+  std::string error;
+  bloaty::RollupOutput output;
+  options.add_filename("05-binary.bin");
+  options.add_data_source("cppsymbols");
+  ASSERT_TRUE(session.Analyze(options, &output, &error));
+  EXPECT_EQ(0, bloaty::stats.demangle_calls);
+
+  // Errors don't break the session.
+  options.set_data_source(0, "nosuchsource");
+  EXPECT_FALSE(session.Analyze(options, &output, &error));
+  EXPECT_NE(std::string::npos, error.find("no such data source"));
+  options.set_data_source(0, "symbols");
+  EXPECT_TRUE(session.Analyze(options, &output, &error));
+}
+
+TEST_F(BloatyTest, Batch) {
+  char dir_buf[] = "/tmp/bloaty_test_batch_XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir_buf) != nullptr);
+  std::string dir = dir_buf;
+  std::string manifest = dir + "/manifest";
+  std::vector<std::string> outputs = {dir + "/binary.csv", dir + "/diff.csv",
+                                      dir + "/missing.csv"};
+  {
+    std::ofstream out(manifest);
+    out << "# A comment, then a blank line.\n\n"
+        << "05-binary.bin " << outputs[0] << "\n"
+        << "05-binary.bin -- 04-simple.so " << outputs[1] << "\n"
+        << "no-such-file " << outputs[2] << "\n"
+        << "no-output-file-given\n";
+  }
+
+  bloaty::Options options;
+  bloaty::OutputOptions output_options;
+  output_options.output_format = bloaty::OutputFormat::kCSV;
+  options.add_data_source("symbols");
+  bloaty::MmapInputFileFactory factory;
+  std::string error;
+
+  // The bad lines fail without stopping the good ones.
+  EXPECT_FALSE(bloaty::RunBatch(manifest, options, output_options, factory, 2,
+                                &error));
+  EXPECT_NE(std::string::npos, error.find("2 of 4 entries"));
+  EXPECT_FALSE(std::ifstream(outputs[2]).good());
+
+  // Options that name a single output file can't be shared by every entry.
+  bloaty::Options save_rollup = options;
+  save_rollup.set_save_rollup(dir + "/snapshot");
+  EXPECT_FALSE(bloaty::RunBatch(manifest, save_rollup, output_options,
+                                factory, 2, &error));
+  EXPECT_NE(std::string::npos, error.find("--save-rollup"));
+  EXPECT_FALSE(std::ifstream(dir + "/snapshot").good());
+
+  std::vector<std::vector<std::string>> runs = {
+      {"bloaty", "--csv", "-d", "symbols", "05-binary.bin"},
+      {"bloaty", "--csv", "-d", "symbols", "05-binary.bin", "--",
+       "04-simple.so"}};
+  for (size_t i = 0; i < runs.size(); i++) {
+    RunBloaty(runs[i]);
+    std::stringstream expected;
+    output_->Print(output_options, &expected);
+    std::ifstream in(outputs[i]);
+    std::stringstream actual;
+    actual << in.rdbuf();
+    EXPECT_EQ(expected.str(), actual.str());
+    unlink(outputs[i].c_str());
+  }
+
+  unlink(manifest.c_str());
+  rmdir(dir_buf);
+}
+
+TEST_F(BloatyTest, Lookup) {
+  std::string file = "05-binary.bin";
+  uint64_t size;
+  ASSERT_TRUE(GetFileSize(file, &size));
+  RunBloaty({"bloaty", "-n", "0", "-d", "sections,symbols", file});
+
+  // Looking up every file offset (backwards, to check that rows come out in
+  // input order) should count up to the file sizes in the rollup.
+  std::stringstream in;
+  for (uint64_t i = size; i > 0; i--) {
+    in << "file:" << i - 1 << "\n";
+  }
+  bloaty::Options options;
+  options.add_filename(file);
+  options.add_data_source("sections");
+  options.add_data_source("symbols");
+  bloaty::MmapInputFileFactory factory;
+  std::stringstream out;
+  std::string error;
+  ASSERT_TRUE(bloaty::LookupAddresses(options, factory, &in, &out, &error))
+      << error;
+
+  std::string line;
+  ASSERT_TRUE(std::getline(out, line));
+  EXPECT_EQ("address,sections,symbols", line);
+  std::map<std::pair<std::string, std::string>, uint64_t> counts;
+  for (uint64_t i = size; i > 0; i--) {
+    ASSERT_TRUE(std::getline(out, line));
+    std::vector<std::string> fields;
+    std::stringstream fields_in(line);
+    for (std::string field; std::getline(fields_in, field, ',');) {
+      fields.push_back(field);
+    }
+    ASSERT_EQ(3, fields.size()) << line;
+    std::stringstream addr;
+    addr << "file:0x" << std::hex << i - 1;
+    EXPECT_EQ(addr.str(), fields[0]);
+    counts[std::make_pair(fields[1], fields[2])]++;
+  }
+  EXPECT_FALSE(std::getline(out, line));
+
+  // (The rollup leaves out the children of rows that only have one.)
+  std::map<std::string, uint64_t> section_counts;
+  for (const auto& count : counts) {
+    section_counts[count.first.first] += count.second;
+  }
+  std::map<std::string, uint64_t> expected_section_counts;
+  for (const auto& section : top_row_->sorted_children) {
+    if (section.filesize > 0) {
+      expected_section_counts[section.name] = section.filesize;
+    }
+    for (const auto& symbol : section.sorted_children) {
+      EXPECT_EQ(symbol.filesize,
+                counts[std::make_pair(section.name, symbol.name)])
+          << section.name << ", " << symbol.name;
+    }
+  }
+  EXPECT_EQ(expected_section_counts, section_counts);
+
+  // VM addresses, and "inputfiles" in its place among the columns.
+  options.clear_data_source();
+  options.add_data_source("inputfiles");
+  options.add_data_source("segments");
+  std::stringstream in2("0\n\n  0x0  \n");
+  std::stringstream out2;
+  ASSERT_TRUE(bloaty::LookupAddresses(options, factory, &in2, &out2, &error))
+      << error;
+  EXPECT_EQ("address,inputfiles,segments\n"
+            "0x0,05-binary.bin,[None]\n"
+            "0x0,05-binary.bin,[None]\n",
+            out2.str());
+
+  // Custom sources are named as themselves, not as their base sources.
+  options.clear_data_source();
+  options.add_data_source("prefixes");
+  auto custom = options.add_custom_data_source();
+  custom->set_name("prefixes");
+  custom->set_base_data_source("symbols");
+  auto rewrite = custom->add_rewrite();
+  rewrite->set_pattern("^(.)");
+  rewrite->set_replacement("\\1");
+  std::stringstream in3("file:0\n");
+  std::stringstream out3;
+  ASSERT_TRUE(bloaty::LookupAddresses(options, factory, &in3, &out3, &error))
+      << error;
+  ASSERT_TRUE(std::getline(out3, line));
+  EXPECT_EQ("address,prefixes", line);
+
+  std::stringstream bad("0x10\nfile:zzz\n");
+  EXPECT_FALSE(bloaty::LookupAddresses(options, factory, &bad, &out2, &error));
+  EXPECT_EQ("line 2: invalid address: file:zzz", error);
+}
+
+TEST_F(BloatyTest, Pages) {
+  // 07-big-bss.bin is a few KiB of file with 64MiB of .bss, most of which
+  // is whole VM pages with no file data.
+  for (std::string file : {"05-binary.bin", "07-big-bss.bin"}) {
+    uint64_t size;
+    ASSERT_TRUE(GetFileSize(file, &size));
+    RunBloaty({"bloaty", "-d", "segments", file});
+    int64_t vmsize = top_row_->vmsize;
+
+    for (uint64_t page_size : {4096, 2 << 20}) {
+      RunBloaty({"bloaty", "-d", "pages", "-n", "0",
+                 "--page-size=" + std::to_string(page_size), file});
+      EXPECT_EQ(vmsize, top_row_->vmsize);
+      EXPECT_EQ(size, top_row_->filesize);
+
+      // Each row is one VM page or one file page, or a run of whole VM pages
+      // with no file data.
+      uint64_t file_pages = 0;
+      for (const auto& row : top_row_->sorted_children) {
+        bool is_file = row.name.compare(0, 5, "file:") == 0;
+        std::string start = is_file ? row.name.substr(5) : row.name;
+        ASSERT_EQ("0x", start.substr(0, 2)) << row.name;
+        char* end;
+        uint64_t addr = strtoull(start.c_str(), &end, 16);
+        EXPECT_EQ(0, addr % page_size);
+        EXPECT_EQ(0, is_file ? row.vmsize : row.filesize) << row.name;
+        if (*end == '-') {
+          EXPECT_FALSE(is_file) << row.name;
+          uint64_t run_end = strtoull(end + 1, nullptr, 16);
+          EXPECT_EQ(0, run_end % page_size) << row.name;
+          EXPECT_EQ(run_end - addr, row.vmsize) << row.name;
+        } else {
+          EXPECT_LE(is_file ? row.filesize : row.vmsize, page_size)
+              << row.name;
+        }
+        file_pages += is_file;
+      }
+      EXPECT_EQ((size + page_size - 1) / page_size, file_pages);
+    }
+  }
+
+  // Relocatable objects have no real VM addresses, so only file pages.
+  RunBloaty({"bloaty", "-d", "pages", "-n", "0", "02-simple.o"});
+  for (const auto& row : top_row_->sorted_children) {
+    EXPECT_TRUE(row.name == "[None]" || row.name.compare(0, 5, "file:") == 0)
+        << row.name;
+  }
+
+  AssertBloatyFails({"bloaty", "-d", "pages", "--page-size=0", "05-binary.bin"},
+                    "page_size");
+
+  bloaty::Options options;
+  bloaty::OutputOptions output_options;
+  std::string error;
+  std::vector<std::string> bad_size = {"bloaty", "--page-size=4q",
+                                       "05-binary.bin"};
+  EXPECT_FALSE(bloaty::ParseOptions(bad_size.size(), StrArr(bad_size).get(),
+                                    &options, &output_options, &error));
+  EXPECT_EQ("invalid size for --page-size: 4q", error);
+}
+
+// Checks that every row under "row" (and "row" itself) has "per_byte" samples
+// for each byte of its file size, all of them hot.
+static void CheckSamplesPerFileByte(const bloaty::RollupRow& row,
+                                    int per_byte) {
+  EXPECT_EQ(row.filesize * per_byte, row.samples) << row.name;
+  EXPECT_EQ(row.filesize, row.hot_bytes) << row.name;
+  for (const auto& child : row.sorted_children) {
+    CheckSamplesPerFileByte(child, per_byte);
+  }
+}
+
+TEST_F(BloatyTest, Samples) {
+  char path_buf[] = "/tmp/bloaty_test_samples_XXXXXX";
+  int fd = mkstemp(path_buf);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  std::string samples = path_buf;
+
+  // Two samples at every file offset.
+  std::string file = "05-binary.bin";
+  uint64_t size;
+  ASSERT_TRUE(GetFileSize(file, &size));
+  {
+    std::ofstream out(samples);
+    out << "# Every byte twice.\n";
+    for (uint64_t i = 0; i < size; i++) {
+      out << "file:0x" << std::hex << i << std::dec << " 2\n";
+    }
+  }
+
+  RunBloaty({"bloaty", "-d", "sections,symbols", "-n", "5", "--samples",
+             samples, file});
+  EXPECT_TRUE(output_->has_samples());
+  CheckSamplesPerFileByte(*top_row_, 2);
+  EXPECT_EQ(2 * size, top_row_->samples);
+
+  // Sorted by samples, which here is the same as by file size.
+  RunBloaty({"bloaty", "-d", "sections", "-s", "samples", "--samples",
+             samples, file});
+  for (size_t i = 1; i < top_row_->sorted_children.size(); i++) {
+    EXPECT_GE(top_row_->sorted_children[i - 1].samples,
+              top_row_->sorted_children[i].samples);
+  }
+
+  // Samples survive the trip through a Report.
+  bloaty::Report report;
+  output_->ToProto(&report);
+  bloaty::RollupOutput from_proto;
+  from_proto.FromProto(report);
+  EXPECT_TRUE(from_proto.has_samples());
+  EXPECT_EQ(top_row_->samples, from_proto.toplevel_row().samples);
+  EXPECT_EQ(top_row_->hot_bytes, from_proto.toplevel_row().hot_bytes);
+
+  AssertBloatyFails({"bloaty", "--samples", samples, file, "--", file},
+                    "diff mode");
+  AssertBloatyFails({"bloaty", "-s", "samples", file}, "sample file");
+  {
+    std::ofstream out(samples);
+    out << "0x10 many\n";
+  }
+  AssertBloatyFails({"bloaty", "--samples", samples, file}, "sample count");
+
+  unlink(samples.c_str());
+}
+
+#ifdef __linux__
+static void CheckAllResident(const bloaty::RollupRow& row) {
+  EXPECT_EQ(row.filesize, row.resident) << row.name;
+  for (const auto& child : row.sorted_children) {
+    CheckAllResident(child);
+  }
+}
+
+TEST_F(BloatyTest, Resident) {
+  std::string file = "05-binary.bin";
+  std::string pid = std::to_string(getpid());
+  uint64_t size;
+  ASSERT_TRUE(GetFileSize(file, &size));
+  int fd = open(file.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+
+  // Nothing is resident in a mapping that was never touched (Bloaty's own
+  // mapping of the file doesn't count).
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ASSERT_NE(MAP_FAILED, map);
+  RunBloaty({"bloaty", "-d", "sections", "--pid", pid, file});
+  EXPECT_TRUE(output_->has_resident());
+  EXPECT_EQ(0, top_row_->resident);
+  munmap(map, size);
+
+  // And everything is in one that was populated.
+  map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  ASSERT_NE(MAP_FAILED, map);
+  RunBloaty({"bloaty", "-d", "segments,sections", "-n", "0", "--pid", pid,
+             file});
+  CheckAllResident(*top_row_);
+
+  // Residency survives the trip through a Report.
+  bloaty::Report report;
+  output_->ToProto(&report);
+  bloaty::RollupOutput from_proto;
+  from_proto.FromProto(report);
+  EXPECT_TRUE(from_proto.has_resident());
+  EXPECT_EQ(top_row_->resident, from_proto.toplevel_row().resident);
+
+  AssertBloatyFails({"bloaty", "--pid", pid, "04-simple.so"}, "isn't mapped");
+  AssertBloatyFails({"bloaty", "--pid", pid, file, "--", file}, "diff mode");
+  AssertBloatyFails({"bloaty", "-s", "resident", file}, "pid");
+
+  munmap(map, size);
+  close(fd);
+}
+#endif
+
+TEST_F(BloatyTest, Serve) {
+  char dir_buf[] = "/tmp/bloaty_test_serve_XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir_buf) != nullptr);
+  std::string socket_path = std::string(dir_buf) + "/socket";
+  std::string error;
+
+  // Only a socket at the path is replaced, never a file.
+  std::ofstream(socket_path) << "keep me";
+  {
+    bloaty::Server not_a_socket(1, 1);
+    EXPECT_FALSE(not_a_socket.Listen(socket_path, &error));
+    EXPECT_NE(std::string::npos, error.find("socket")) << error;
+  }
+  std::ifstream kept(socket_path);
+  std::string line;
+  EXPECT_TRUE(std::getline(kept, line));
+  EXPECT_EQ("keep me", line);
+  unlink(socket_path.c_str());
+
+  bloaty::Server server(2, 4);
+  ASSERT_TRUE(server.Listen(socket_path, &error)) << error;
+  std::thread server_thread([&server] { server.Run(); });
+
+  bloaty::OutputOptions output_options;
+  output_options.output_format = bloaty::OutputFormat::kCSV;
+  std::vector<std::string> sources = {"symbols", "sections", "cppsymbols"};
+  std::vector<std::string> expected;
+  for (const auto& source : sources) {
+    RunBloaty({"bloaty", "-d", source, "05-binary.bin"});
+    std::stringstream csv;
+    output_->Print(output_options, &csv);
+    expected.push_back(csv.str());
+  }
+
+  // More clients than workers, all at once, get the same results as one-off
+  // runs.
+  const int kClients = 4;
+  std::vector<std::vector<std::string>> actual(kClients);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kClients; i++) {
+    clients.emplace_back([&, i] {
+      for (const auto& source : sources) {
+        bloaty::Options options;
+        options.add_filename("05-binary.bin");
+        options.add_data_source(source);
+        bloaty::RollupOutput output;
+        std::string client_error;
+        std::stringstream csv;
+        if (bloaty::QueryServer(socket_path, options, &output,
+                                &client_error)) {
+          output.Print(output_options, &csv);
+        } else {
+          csv << client_error;
+        }
+        actual[i].push_back(csv.str());
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  for (int i = 0; i < kClients; i++) {
+    EXPECT_EQ(expected, actual[i]);
+  }
+
+  // Errors go back to the client.
+  bloaty::Options options;
+  bloaty::RollupOutput output;
+  options.add_filename("no-such-file");
+  EXPECT_FALSE(bloaty::QueryServer(socket_path, options, &output, &error));
+  EXPECT_NE(std::string::npos, error.find("couldn't open file"));
+
+  // Requests can't make the server write files or read other processes.
+  std::string snapshot = std::string(dir_buf) + "/snapshot";
+  options.clear_filename();
+  options.add_filename("05-binary.bin");
+  options.set_save_rollup(snapshot);
+  EXPECT_FALSE(bloaty::QueryServer(socket_path, options, &output, &error));
+  EXPECT_NE(std::string::npos, error.find("save_rollup")) << error;
+  EXPECT_FALSE(std::ifstream(snapshot).good());
+  options.clear_save_rollup();
+  options.set_pid(getpid());
+  EXPECT_FALSE(bloaty::QueryServer(socket_path, options, &output, &error));
+  EXPECT_NE(std::string::npos, error.find("pid")) << error;
+
+  // The server has no output of its own, so output flags are errors.
+  for (const char* flag : {"--stats", "--csv", "--output-format=proto"}) {
+    bloaty::Options parsed;
+    bloaty::OutputOptions parsed_output;
+    std::vector<std::string> args = {"bloaty", "--serve", socket_path, flag};
+    EXPECT_FALSE(bloaty::ParseOptions(args.size(), StrArr(args).get(),
+                                      &parsed, &parsed_output, &error))
+        << flag;
+    EXPECT_NE(std::string::npos, error.find("--serve")) << error;
+  }
+
+  server.Stop();
+  server_thread.join();
+  unlink(socket_path.c_str());
+  rmdir(dir_buf);
+}
+
+#ifdef BLOATY_ENABLE_TRACING
+TEST_F(BloatyTest, Trace) {
+  char path_buf[] = "/tmp/bloaty_test_trace_XXXXXX";
+  int fd = mkstemp(path_buf);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  std::string trace_file = path_buf;
+
+  bloaty::StartTrace();
+  RunBloaty({"bloaty", "-d", "compileunits,symbols", "05-binary.bin"});
+  ASSERT_TRUE(bloaty::WriteTrace(trace_file));
+
+  std::ifstream in(trace_file);
+  std::stringstream json;
+  json << in.rdbuf();
+  EXPECT_EQ(0, json.str().find("{\"traceEvents\":["));
+  for (const char* name : {"05-binary.bin", "ProcessFile", "base map",
+                           "symbols", "compileunits", "compile unit",
+                           "rollup"}) {
+    EXPECT_NE(std::string::npos,
+              json.str().find(std::string("{\"name\":\"") + name + "\""))
+        << name;
+  }
+
+  unlink(trace_file.c_str());
+}
+#endif
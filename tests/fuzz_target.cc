@@ -12,6 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "bloaty.h"
 #include "bloaty.pb.h"
 #include "strarr.h"
@@ -41,7 +45,14 @@ class StringPieceInputFileFactory : public InputFileFactory {
   }
 };
 
-void RunBloaty(const InputFileFactory& factory,
+// Besides crashes, we look for inputs that make Bloaty do more than linear
+// work, since we run it on untrusted files.  Each run may do at most this many
+// work units (see Stats::WorkUnits()) per byte of input, plus a fixed
+// allowance.  Real binaries need well under one per byte.
+static const uint64_t kMaxWorkPerByte = 32;
+static const uint64_t kWorkAllowance = 4096;
+
+void RunBloaty(const InputFileFactory& factory, size_t size,
                const std::string& data_source) {
   bloaty::RollupOutput output;
   bloaty::Options options;
@@ -49,6 +60,17 @@ void RunBloaty(const InputFileFactory& factory,
   options.add_data_source(data_source);
   options.add_filename("dummy_filename");
   bloaty::BloatyMain(options, factory, &output, &error);
+
+  uint64_t work = stats.WorkUnits();
+  if (work > kMaxWorkPerByte * size + kWorkAllowance) {
+    fprintf(stderr,
+            "data source %s did %" PRIu64 " work units for %zu bytes of "
+            "input (%" PRIu64 " map iterations, %" PRIu64 " DIEs, %" PRIu64
+            " LEB128 reads)\n",
+            data_source.c_str(), work, size, stats.map_iterations,
+            stats.dies_decoded, stats.leb128_reads);
+    abort();
+  }
 }
 
 }  // namespace bloaty
@@ -58,12 +80,13 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
   bloaty::StringPieceInputFileFactory factory(string_view(data2, size));
 
   // Try all of the data sources.
-  RunBloaty(factory, "segments");
-  RunBloaty(factory, "sections");
-  RunBloaty(factory, "symbols");
-  RunBloaty(factory, "compileunits");
-  RunBloaty(factory, "inlines");
-  RunBloaty(factory, "armembers");
+  RunBloaty(factory, size, "segments");
+  RunBloaty(factory, size, "sections");
+  RunBloaty(factory, size, "symbols");
+  RunBloaty(factory, size, "compileunits");
+  RunBloaty(factory, size, "inlines");
+  RunBloaty(factory, size, "armembers");
+  RunBloaty(factory, size, "pages");
 
   return 0;
 }
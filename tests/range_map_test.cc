@@ -190,4 +190,59 @@ TEST_F(RangeMapTest, Translation2) {
   });
 }
 
+TEST_F(RangeMapTest, ManyOverlaps) {
+  // Adding ranges over a long run of existing ones shouldn't step through the
+  // whole run each time, or crafted inputs can make us quadratic.
+  const uint64_t n = 10000;
+  std::vector<Entry> expected;
+  for (uint64_t i = 0; i < n; i++) {
+    map_.AddRange(i * 10, 5, "small");
+    expected.push_back(
+        std::make_tuple(i * 10, i * 10 + 5, UINT64_MAX, "small"));
+    expected.push_back(
+        std::make_tuple(i * 10 + 5, i * 10 + 10, UINT64_MAX, "gaps"));
+  }
+  map_.AddRange(0, n * 10, "gaps");
+  expected.push_back(std::make_tuple(n * 10, n * 10 + 5, UINT64_MAX, "big"));
+
+  stats = Stats();
+  for (uint64_t i = 0; i < n; i++) {
+    map_.AddRange(i * 10, (n - i) * 10 + 5, "big");
+  }
+  CheckConsistency();
+  AssertMainMapEquals(expected);
+  EXPECT_LT(stats.map_iterations, n * 10);
+}
+
+TEST_F(RangeMapTest, LookupSorted) {
+  map_.AddRange(10, 10, "foo");
+  map_.AddRange(30, 10, "bar");
+  for (int i = 0; i < 100; i++) {
+    map_.AddRange(100 + i * 10, 5, "many" + std::to_string(i));
+  }
+
+  std::vector<uint64_t> addrs = {0,   10,  19,  20,  30,   30,
+                                 39,  40,  104, 995, 1094, 1095};
+  std::vector<const char*> expected = {
+      nullptr, "foo",  "foo",    nullptr, "bar",    "bar",
+      "bar",   nullptr, "many0", nullptr, "many99", nullptr};
+  std::vector<const std::string*> labels;
+  map_.LookupSorted(addrs, &labels);
+  ASSERT_EQ(expected.size(), labels.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    if (expected[i]) {
+      ASSERT_TRUE(labels[i] != nullptr) << i;
+      EXPECT_EQ(expected[i], *labels[i]) << i;
+    } else {
+      EXPECT_EQ(nullptr, labels[i]) << i;
+    }
+  }
+
+  // Far-apart addresses are searched for, rather than stepped to.
+  stats = Stats();
+  map_.LookupSorted({0, 1094}, &labels);
+  EXPECT_EQ("many99", *labels[1]);
+  EXPECT_LT(stats.map_iterations, 100);
+}
+
 }  // namespace bloaty
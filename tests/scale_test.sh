@@ -0,0 +1,93 @@
+#!/bin/bash
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Runs every data source over synthetic binaries of increasing size (made by
+# testdata/make_large_files.sh) and prints the time and peak memory of each
+# run as CSV.
+#
+# The "exponent" column is how the time grew since the previous size: about 1
+# for a linear path, about 2 for a quadratic one.  Rows where it is over 1.5
+# are flagged with "*".  (Times under 50ms are too noisy for this, so those
+# rows get no exponent.)
+#
+# SIZES is the list of function counts to try (default "10000 30000 100000").
+# Files are generated once per size under <work dir> and reused by later runs;
+# the other make_large_files.sh variables (CUS, INLINE_DEPTH, etc.) apply when
+# they are generated.
+
+if [ "$#" != "2" ] ; then
+  echo "Usage: scale_test.sh <bloaty binary> <work dir>"
+  exit 1
+fi
+
+set -e
+
+BLOATY=`cd $(dirname $1) && pwd`/`basename $1`
+WORK_DIR=$2
+SIZES="${SIZES:-10000 30000 100000}"
+MAKE_LARGE_FILES=`cd $(dirname $0) && pwd`/testdata/make_large_files.sh
+
+BIN_SOURCES="segments sections symbols cppsymbols cppxsyms compileunits inlines pages"
+AR_SOURCES="armembers sections symbols cppsymbols"
+
+mkdir -p $WORK_DIR
+STATS=`mktemp`
+trap "rm -f $STATS" EXIT
+
+# Runs Bloaty with data source $2 on file $1, printing "<seconds> <peak RSS in
+# MiB>".
+function measure() {
+  local start=`date +%s.%N`
+  "$BLOATY" --stats=csv -n 0 -d $2 $1 > /dev/null 2> $STATS
+  local end=`date +%s.%N`
+  local rss=`grep '^counter,,peak_rss_bytes,' $STATS | cut -d, -f4`
+  awk -v start=$start -v end=$end -v rss=$rss \
+      'BEGIN { printf "%.3f %.1f", end - start, rss / 1048576 }'
+}
+
+declare -A LAST_SIZE
+declare -A LAST_TIME
+
+echo "functions,file,data_source,seconds,peak_rss_mib,exponent"
+for size in $SIZES; do
+  dir=$WORK_DIR/$size
+  if [ ! -f $dir/large.a ]; then
+    FUNCTIONS=$size $MAKE_LARGE_FILES $dir > /dev/null
+  fi
+
+  for file in large.bin large.a; do
+    if [ $file == large.bin ]; then
+      sources=$BIN_SOURCES
+    else
+      sources=$AR_SOURCES
+    fi
+
+    for source in $sources; do
+      read seconds rss_mib <<< `measure $dir/$file $source`
+      key=$file,$source
+      exponent=`awk -v t=$seconds -v n=$size \
+                    -v t0=${LAST_TIME[$key]:-0} -v n0=${LAST_SIZE[$key]:-0} '
+        BEGIN {
+          if (n0 > 0 && t0 >= 0.05 && n > n0) {
+            e = log(t / t0) / log(n / n0)
+            printf "%.2f%s", e, (e > 1.5 ? "*" : "")
+          }
+        }'`
+      LAST_SIZE[$key]=$size
+      LAST_TIME[$key]=$seconds
+      echo "$size,$file,$source,$seconds,$rss_mib,$exponent"
+    done
+  done
+done
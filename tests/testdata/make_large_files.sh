@@ -0,0 +1,117 @@
+#!/bin/bash
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Generates synthetic C++ programs of a given size and builds them with the
+# local compiler, for testing Bloaty at scale (see tests/scale_test.sh).
+# Writes large.bin (an executable) and large.a (an archive) to <output dir>.
+#
+# The shape of the output is controlled with these environment variables:
+#
+#   FUNCTIONS        Total number of functions (default 100000).
+#   CUS              Number of compilation units (default 100).
+#   INLINE_DEPTH     Depth of the chain of always-inline functions that every
+#                    function expands, which is one DW_TAG_inlined_subroutine
+#                    per level (default 8).
+#   NAMESPACE_DEPTH  How deep the namespaces are that the functions are in, for
+#                    long mangled names (default 6).
+#   ARCHIVE_MEMBERS  Number of members in large.a.  The compiled CUs are
+#                    reused under new names if this is larger than CUS
+#                    (default: CUS).
+#   CXX, CXXFLAGS    The compiler and flags (default: c++, -g -O2).
+#   JOBS             How many compiles to run at once (default: nproc).
+
+if [ "$#" == "0" ] ; then
+  echo "Usage: make_large_files.sh <output dir>"
+  exit 1
+fi
+
+set -e
+
+FUNCTIONS="${FUNCTIONS:-100000}"
+CUS="${CUS:-100}"
+INLINE_DEPTH="${INLINE_DEPTH:-8}"
+NAMESPACE_DEPTH="${NAMESPACE_DEPTH:-6}"
+ARCHIVE_MEMBERS="${ARCHIVE_MEMBERS:-$CUS}"
+CXX="${CXX:-c++}"
+CXXFLAGS="${CXXFLAGS:--g -O2}"
+JOBS="${JOBS:-`nproc`}"
+
+mkdir -p $1
+cd $1
+OUTPUT_DIR=`pwd`
+TMP=`mktemp -d`
+trap "rm -rf $TMP" EXIT
+echo Writing output to $OUTPUT_DIR
+echo Working in $TMP
+cd $TMP
+
+# The inline chain: inline_N() inlines inline_N-1() and so on down to inline_0.
+awk -v depth=$INLINE_DEPTH 'BEGIN {
+  print "namespace synthetic_inlines {"
+  print "static inline __attribute__((always_inline)) int inline_0(int x) {"
+  print "  return x * 3 + 1;"
+  print "}"
+  for (i = 1; i <= depth; i++) {
+    print "static inline __attribute__((always_inline)) int inline_" i "(int x) {"
+    print "  return inline_" i - 1 "(x ^ " i ") * 7 + " i ";"
+    print "}"
+  }
+  print "}"
+}' > inlines.h
+
+# One file per CU, with FUNCTIONS / CUS functions each.  Every function (and
+# every data array) is distinct, so the linker can't fold any of them.
+awk -v functions=$FUNCTIONS -v cus=$CUS -v inline_depth=$INLINE_DEPTH \
+    -v ns_depth=$NAMESPACE_DEPTH 'BEGIN {
+  for (cu = 0; cu < cus; cu++) {
+    file = "cu_" cu ".cc"
+    print "#include \"inlines.h\"" > file
+    for (d = 0; d < ns_depth; d++) {
+      print "namespace synthetic_namespace_" d " {" > file
+    }
+    print "namespace cu_" cu " {" > file
+    print "int data_" cu "[" 16 + cu % 64 "] = {" cu "};" > file
+    first = int(functions * cu / cus)
+    last = int(functions * (cu + 1) / cus)
+    for (f = first; f < last; f++) {
+      print "int function_" f "(int x) {" > file
+      print "  return synthetic_inlines::inline_" inline_depth "(x + " f ") + data_" cu "[x & 15];" > file
+      print "}" > file
+    }
+    for (d = 0; d <= ns_depth; d++) {
+      print "}" > file
+    }
+    close(file)
+  }
+}'
+echo "int main() { return 0; }" > main.cc
+
+echo "Compiling $CUS CUs with $FUNCTIONS functions"
+ls cu_*.cc main.cc | sed 's/\.cc$//' |
+  xargs -P $JOBS -I{} $CXX $CXXFLAGS -c -o {}.o {}.cc
+
+$CXX $CXXFLAGS -o large.bin cu_*.o main.o
+cp large.bin $OUTPUT_DIR
+echo large.bin
+
+# Archive members are the CUs, reused under new names as needed.
+mkdir members
+for i in `seq 0 $((ARCHIVE_MEMBERS - 1))`; do
+  ln cu_$((i % CUS)).o members/member_$i.o
+done
+(cd members && ls | xargs ar qc ../large.a)
+ar s large.a
+cp large.a $OUTPUT_DIR
+echo large.a
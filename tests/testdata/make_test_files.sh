@@ -114,3 +114,9 @@ int foo_func() { return foo_y / 17 * 37 / 21; }
 "
 
 make_ar "06-diff.a" "foo2.o" "bar.o" "a_filename_longer_than_sixteen_chars.o"
+
+# A small binary whose .bss is much bigger than the file.
+
+make_tmp_obj "big_bss.o" "char big_bss[64 << 20];"
+
+make_binary "07-big-bss.bin" "big_bss.o" "main.o"